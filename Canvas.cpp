@@ -1,15 +1,111 @@
 #include "Canvas.hpp"
+#include <QFile>
 #include <QDebug>
+#include <QPointer>
 #include <QFileInfo>
+#include <QKeyEvent>
 #include <QMimeData>
 #include <QMessageBox>
+#include <QMatrix4x4>
 #include <QMouseEvent>
-#include <QImageReader>
-#include <QRotationSensor>
+#include <QSettings>
+#include <QVideoFrame>
+#include <QThreadPool>
+#include <QApplication>
+#include <QElapsedTimer>
+#include <QStandardPaths>
+#include <QOpenGLPixelTransferOptions>
+#include "Utils.hpp"
+#include "VrLens.hpp"
+#include "HdrImage.hpp"
+#include "Downscaler.hpp"
+#include "DualFisheye.hpp"
+#include "VideoPlayer.hpp"
+#include "ImageDecoder.hpp"
+#include "ImageEncoder.hpp"
+#include "PyramidCache.hpp"
+#include "ColorManagement.hpp"
+#include "OrientationTracker.hpp"
+
+// Core in desktop GL 3.3, from EXT_disjoint_timer_query in GLES
+#ifndef GL_TIME_ELAPSED
+# define GL_TIME_ELAPSED 0x88BF
+#endif
 
 namespace
 {
 
+#ifdef Q_OS_ANDROID
+constexpr qint64 TEXTURE_CACHE_BUDGET = 256ll << 20;
+constexpr qint64 IMAGE_CACHE_BUDGET = 256ll << 20;
+#else
+constexpr qint64 TEXTURE_CACHE_BUDGET = 1ll << 30;
+constexpr qint64 IMAGE_CACHE_BUDGET = 1ll << 30;
+#endif
+
+constexpr double TARGET_FRAME_TIME = 1000. / 60; // ms
+constexpr double MIN_RENDER_SCALE = 0.35;
+// How long the view has to stay still to be rendered at native resolution
+constexpr double SETTLE_TIME = 150; // ms
+constexpr int MAX_CUBE_FACE_SIZE = 4096;
+// Until GL has been initialized once, the real limit isn't known. This one is
+// common on desktops, and paintGL drops the mip levels that are larger.
+constexpr int DEFAULT_MAX_TEX_SIZE = 16384;
+constexpr double DEGREE = M_PI / 180;
+constexpr double EXPOSURE_STEP = 1. / 3; // EV
+
+QImage fitToSize(const QImage& image, const int maxSize)
+{
+    if(image.width() <= maxSize && image.height() <= maxSize)
+        return image;
+
+    qWarning() << "Image resolution of" << image.width() << "×" << image.height()
+        << "exceeds GL_MAX_TEXTURE_SIZE =" << maxSize;
+    QElapsedTimer timer;
+    timer.start();
+    const auto scaled = downscale(image, QSize(std::min(image.width(), maxSize),
+                                               std::min(image.height(), maxSize)));
+    qDebug() << "Image resized to" << scaled.width() << "×" << scaled.height()
+             << "in" << timer.elapsed() << "ms";
+    return scaled;
+}
+
+double maxViewAngle(const Canvas::Projection projection)
+{
+    switch(projection)
+    {
+    case Canvas::Projection::LittlePlanet: return 340 * DEGREE;
+    case Canvas::Projection::Fisheye:      return 360 * DEGREE;
+    default:                               return 160 * DEGREE;
+    }
+}
+
+// Columns are the directions of the s and t axes and of the center of each
+// face of a cube map, in the order of GL_TEXTURE_CUBE_MAP_POSITIVE_X + n
+Eigen::Matrix3d cubeFaceMatrix(const int face)
+{
+    using V = Eigen::Vector3d;
+    static const V axes[6][3] =
+    {
+        {V( 0, 0,-1), V(0,-1, 0), V( 1, 0, 0)},
+        {V( 0, 0, 1), V(0,-1, 0), V(-1, 0, 0)},
+        {V( 1, 0, 0), V(0, 0, 1), V( 0, 1, 0)},
+        {V( 1, 0, 0), V(0, 0,-1), V( 0,-1, 0)},
+        {V( 1, 0, 0), V(0,-1, 0), V( 0, 0, 1)},
+        {V(-1, 0, 0), V(0,-1, 0), V( 0, 0,-1)},
+    };
+    Eigen::Matrix3d m;
+    m << axes[face][0], axes[face][1], axes[face][2];
+    return m;
+}
+
+// GL capabilities are remembered from the previous run, so that loading a
+// file can start before GL is initialized
+QString glCapabilitiesPath()
+{
+    return QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/gl-capabilities.ini";
+}
+
 QSurfaceFormat makeGLSurfaceFormat()
 {
     QSurfaceFormat format;
@@ -25,7 +121,7 @@ QSurfaceFormat makeGLSurfaceFormat()
     return format;
 }
 
-QByteArray prependGLSLVersion(const char*const src)
+QByteArray prependGLSLVersion(const char*const src, const QByteArray& defines = {})
 {
     QByteArray out;
     if(QOpenGLContext::currentContext()->isOpenGLES())
@@ -33,96 +129,47 @@ QByteArray prependGLSLVersion(const char*const src)
               "precision highp float;\n";
     else
         out = "#version 330\n";
+    out += defines;
     out += src;
     return out;
 }
 
-QPoint position(QMouseEvent* event)
-{
-#if QT_VERSION < QT_VERSION_CHECK(6,0,0)
-    return event->pos();
-#else
-    return event->position().toPoint();
-#endif
-}
-
-inline QMatrix3x3 toQMatrix(Eigen::Matrix3d const& m)
-{
-    const Eigen::Matrix3f mf = m.cast<float>().transpose();
-    return QMatrix3x3(mf.data());
-}
-
-double normalizedAngle(double angle)
-{
-    while(angle > M_PI)
-        angle -= M_PI*2;
-    while(angle < -M_PI)
-        angle += M_PI*2;
-    return angle;
-}
-
-}
-
-Canvas::Canvas(QWidget* parent)
-    : QOpenGLWidget(parent)
-    , sensor_(new QRotationSensor(this))
-{
-    setFormat(makeGLSurfaceFormat());
-    setAcceptDrops(true);
-    const int freq = 1000 / 60;
-    frameTimer_.start(freq);
-    connect(&frameTimer_, &QTimer::timeout, this, qOverload<>(&Canvas::update));
-    sensor_->setDataRate(2 * freq);
-    if(sensor_->connectToBackend())
-    {
-        qDebug() << "Sensor connected to backend, starting";
-        sensor_->start();
-    }
-    else
-    {
-        qDebug() << "Failed to connect sensor to backend";
-    }
-}
-
-void Canvas::setupBuffers()
+const char VERTEX_SHADER_SRC[] = R"(
+out vec3 position;
+#ifdef STEREO_MESH
+// The lens distortion mesh of an eye, see VrLens. It's drawn with two
+// instances, the left eye being the first one.
+layout(location = 0) in vec2 meshPosition;
+layout(location = 1) in vec2 meshTangent;
+out vec2 viewTangent;
+void main()
 {
-    if(!vao_)
-        glGenVertexArrays(1, &vao_);
-    glBindVertexArray(vao_);
-    if(!vbo_)
-        glGenBuffers(1, &vbo_);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo_);
-    const GLfloat vertices[]=
-    {
-        -1, -1,
-         1, -1,
-        -1,  1,
-         1,  1,
-    };
-    glBufferData(GL_ARRAY_BUFFER, sizeof vertices, vertices, GL_STATIC_DRAW);
-    constexpr GLuint attribIndex=0;
-    constexpr int coordsPerVertex=2;
-    glVertexAttribPointer(attribIndex, coordsPerVertex, GL_FLOAT, false, 0, 0);
-    glEnableVertexAttribArray(attribIndex);
-    glBindVertexArray(0);
+    float side = gl_InstanceID == 0 ? -1. : 1.;
+    vec2 pos = vec2(meshPosition.x * 0.5 + side * 0.5, meshPosition.y);
+    viewTangent = meshTangent;
+    position = vec3(pos, 0);
+    gl_Position = vec4(pos, 0, 1);
 }
-
-void Canvas::setupShaders()
-{
-    const auto vertSrc = prependGLSLVersion(R"(
+#else
 in vec3 vertex;
-out vec3 position;
 void main()
 {
     position=vertex;
     gl_Position=vec4(vertex,1);
 }
-)");
-    if(!program_.addShaderFromSourceCode(QOpenGLShader::Vertex, vertSrc))
-        QMessageBox::critical(nullptr, tr("Error compiling shader"),
-                              tr("Failed to compile %1:\n%2").arg("vertex shader").arg(program_.log()));
+#endif
+)";
+
+// Variants are selected by defining PROJECTION to a value of Canvas::Projection,
+// and DUAL_FISHEYE for dual-fisheye sources. CUBE_MAP_FACE and VIDEO_CONVERT
+// select the helper programs rendering into textures.
+const char FRAGMENT_SHADER_SRC[] = R"(
+#define EQUIRECT 0
+#define CUBE_MAP 1
+#define LITTLE_PLANET 2
+#define FISHEYE 3
+#define VR_STEREO 4
 
-    const auto fragSrc = prependGLSLVersion(R"(
 uniform sampler2D tex;
 in vec3 position;
 out vec4 color;
@@ -130,20 +177,22 @@ out vec4 color;
 uniform float horizViewAngle;
 uniform float viewportAspectRatio;
 uniform mat3 cameraRotation;
+// Scale and offset of the viewport within the whole view, which differ from
+// (1,1,0,0) when the view is rendered in tiles
+uniform vec4 viewportTile;
+// For HDR sources: the texture holds linear radiance, which is scaled by
+// exposure and tone-mapped to sRGB
+uniform bool hdr;
+uniform float exposure;
+// Converts from the color space of the image to the one of the display,
+// see ColorManagement
+uniform bool colorManaged;
+uniform highp sampler3D colorLut;
 
 const float PI = 3.1415926535897932;
 
-vec3 calcViewDir()
+vec4 sampleEquirect(vec3 viewDir)
 {
-    vec2 pos=position.xy;
-    float camDistToScreen = 1. / tan(horizViewAngle/2.);
-    pos.y /= viewportAspectRatio;
-    return cameraRotation * normalize(vec3(-camDistToScreen, pos));
-}
-
-void main()
-{
-    vec3 viewDir = calcViewDir();
     float elevation = asin(clamp(viewDir.z, -1., 1.));
     float azimuth = atan(viewDir.y, viewDir.x);
     vec2 texc = vec2(-azimuth / (2.*PI),
@@ -165,179 +214,1653 @@ void main()
     float texTdy = dFdy(texc.t);
     vec2 texDx = vec2(gradLongitude.s/(2.*PI), texTdx);
     vec2 texDy = vec2(gradLongitude.t/(2.*PI), texTdy);
-    color = textureGrad(tex, texc, texDx, texDy);
+    return textureGrad(tex, texc, texDx, texDy);
 }
-)");
-    if(!program_.addShaderFromSourceCode(QOpenGLShader::Fragment, fragSrc))
-        QMessageBox::critical(nullptr, tr("Error compiling shader"),
-                              tr("Failed to compile %1:\n%2").arg("fragment shader").arg(program_.log()));
-    if(!program_.link())
+
+#ifdef DUAL_FISHEYE
+
+// The front lens (0) looks along -X, where the camera initially looks, the
+// back one (1) along +X. For each lens: center of the circle and its radius
+// in units of the image height, half of the field of view, and roll.
+uniform vec4 lensCircle[2];
+uniform float lensRoll[2];
+uniform float seamWidth;
+uniform float sourceAspectRatio;
+
+// Equidistant fisheye model
+vec2 fisheyeTexCoords(vec3 dir, int lens)
+{
+    float axisSign = lens == 0 ? -1. : 1.;
+    float angle = acos(clamp(axisSign * dir.x, -1., 1.));
+    // Right and down in the image of the lens
+    vec2 planar = vec2(-axisSign * dir.y, -dir.z);
+    float len = length(planar);
+    vec2 radial = len > 0. ? planar / len : vec2(0);
+    float c = cos(lensRoll[lens]), s = sin(lensRoll[lens]);
+    radial = mat2(c, s, -s, c) * radial;
+    vec4 circle = lensCircle[lens];
+    vec2 pos = circle.xy + radial * (circle.z * angle / circle.w);
+    return pos / vec2(sourceAspectRatio, 1.);
+}
+
+vec4 sampleSource(vec3 viewDir)
+{
+    vec3 dir = normalize(viewDir);
+    vec2 texc0 = fisheyeTexCoords(dir, 0);
+    vec2 texc1 = fisheyeTexCoords(dir, 1);
+    // Derivatives have to be taken in uniform control flow
+    vec2 texc0dx = dFdx(texc0), texc0dy = dFdy(texc0);
+    vec2 texc1dx = dFdx(texc1), texc1dy = dFdy(texc1);
+    // Across the horizon of the lenses, the front image fades into the back
+    // one. Neither lens is sampled beyond its field of view.
+    float angle0 = acos(clamp(-dir.x, -1., 1.));
+    float weight1 = smoothstep(PI/2. - seamWidth/2., PI/2. + seamWidth/2., angle0);
+    if(angle0 > lensCircle[0].w) weight1 = 1.;
+    else if(PI - angle0 > lensCircle[1].w) weight1 = 0.;
+    vec4 color = vec4(0);
+    if(weight1 < 1.)
+        color += (1. - weight1) * textureGrad(tex, texc0, texc0dx, texc0dy);
+    if(weight1 > 0.)
+        color += weight1 * textureGrad(tex, texc1, texc1dx, texc1dy);
+    return color;
+}
+
+#else
+
+vec4 sampleSource(vec3 viewDir)
+{
+    return sampleEquirect(viewDir);
+}
+
+#endif
+
+#if defined(CUBE_MAP_FACE)
+
+// Renders a face of the cube map: maps (s,t,1) of the face to the direction
+uniform mat3 faceMatrix;
+void main()
+{
+    color = sampleSource(normalize(faceMatrix * vec3(position.xy, 1.)));
+}
+
+#elif defined(VIDEO_CONVERT)
+
+// Converts a video frame from its planes to RGB, see Canvas::VideoPlanes
+uniform sampler2D plane0;
+uniform sampler2D plane1;
+uniform sampler2D plane2;
+uniform int planeLayout;
+uniform mat4 yuvToRGB;
+void main()
+{
+    // Row 0 of the planes is the top of the frame, as for the images
+    vec2 texc = position.xy * 0.5 + 0.5;
+    vec4 first = texture(plane0, texc);
+    if(planeLayout == 0) // RGBA
     {
-        QMessageBox::critical(nullptr, tr("Error linking shader program"),
-                              tr("Failed to link %1:\n%2").arg("shader program").arg(program_.log()));
+        color = vec4(first.rgb, 1);
+        return;
     }
-    else
+    if(planeLayout == 1) // BGRA
     {
-        qDebug() << "Shaders compiled and linked successfully";
+        color = vec4(first.bgr, 1);
+        return;
     }
+    vec2 chroma = planeLayout == 2 ? texture(plane1, texc).rg // NV12
+                                   : vec2(texture(plane1, texc).r, texture(plane2, texc).r); // YUV420P
+    color = vec4((yuvToRGB * vec4(first.r, chroma, 1)).rgb, 1);
 }
 
-void Canvas::initializeGL()
-{
-    initializeOpenGLFunctions();
-    getViewportSize();
-
-    setupBuffers();
-    setupShaders();
+#else
 
-    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTexSize_);
-    qDebug() << "GL_MAX_TEXTURE_SIZE:" << maxTexSize_;
+#if PROJECTION == CUBE_MAP
+uniform samplerCube cubeTex;
+#endif
+#if PROJECTION == VR_STEREO
+in vec2 viewTangent;
+#endif
 
-    glFinish();
+// ACES filmic curve fit by K. Narkowicz, followed by sRGB encoding
+vec3 toneMap(vec3 v)
+{
+    v = clamp(v * (2.51 * v + 0.03) / (v * (2.43 * v + 0.59) + 0.14), 0., 1.);
+    return mix(12.92 * v, 1.055 * pow(v, vec3(1. / 2.4)) - 0.055, step(0.0031308, v));
 }
 
-void Canvas::getViewportSize()
+// Direction in the camera frame, where the camera looks along -X, and the
+// screen axes go along Y and Z. The w component is zero for the points
+// outside of the image.
+vec4 calcCameraDir(vec2 pos, float aspectRatio)
 {
-    GLint vp[4] = {};
-    glGetIntegerv(GL_VIEWPORT, vp);
-    viewportWidth_ = vp[2];
-    viewportHeight_ = vp[3];
+    pos.y /= aspectRatio;
+#if PROJECTION == LITTLE_PLANET || PROJECTION == FISHEYE
+    float r = length(pos);
+# if PROJECTION == LITTLE_PLANET
+    // Stereographic
+    float angle = 2. * atan(r * tan(horizViewAngle / 4.));
+# else
+    // Equidistant
+    float angle = r * horizViewAngle / 2.;
+# endif
+    vec2 dir = r > 0. ? pos / r : vec2(0);
+    return vec4(-cos(angle), sin(angle) * dir, angle <= PI ? 1. : 0.);
+#else
+    float camDistToScreen = 1. / tan(horizViewAngle/2.);
+    return vec4(normalize(vec3(-camDistToScreen, pos)), 1.);
+#endif
 }
 
-Canvas::~Canvas()
+void main()
 {
-    makeCurrent();
+#if PROJECTION == VR_STEREO
+    // Side by side, the same view for both eyes, since there's no parallax
+    // in a panorama. The lens distortion is already in the interpolated
+    // tangents of the mesh.
+    vec4 cameraDir = vec4(normalize(vec3(-1., viewTangent)), 1.);
+#else
+    vec2 pos = position.xy * viewportTile.xy + viewportTile.zw;
+    vec4 cameraDir = calcCameraDir(pos, viewportAspectRatio);
+#endif
+    vec3 viewDir = cameraRotation * cameraDir.xyz;
+#if PROJECTION == CUBE_MAP
+    vec4 texColor = texture(cubeTex, viewDir);
+#else
+    vec4 texColor = sampleSource(viewDir);
+#endif
+    if(hdr)
+        texColor = vec4(toneMap(texColor.rgb * exposure), 1);
+    if(colorManaged)
+    {
+        // The grid points of the LUT are at the centers of the texels
+        float lutSize = float(textureSize(colorLut, 0).x);
+        texColor.rgb = texture(colorLut, (texColor.rgb * (lutSize - 1.) + 0.5) / lutSize).rgb;
+    }
+    color = cameraDir.w > 0. ? texColor : vec4(0,0,0,1);
 }
 
-Eigen::Matrix3d Canvas::cameraRotation() const
+#endif
+)";
+
+QPoint position(QMouseEvent* event)
 {
-    using namespace Eigen;
-    Matrix3d m;
-    m = AngleAxisd(yaw_ + deltaYaw_, Vector3d::UnitZ()) *
-        AngleAxisd(pitch_ + deltaPitch_, -Vector3d::UnitY()) *
-        AngleAxisd(deltaRoll_, Vector3d::UnitX());
-    return m;
+#if QT_VERSION < QT_VERSION_CHECK(6,0,0)
+    return event->pos();
+#else
+    return event->position().toPoint();
+#endif
 }
 
-Eigen::Vector3d Canvas::calcViewDir(const double screenX, const double screenY) const
+inline QMatrix3x3 toQMatrix(Eigen::Matrix3d const& m)
 {
-    const auto x = screenX / viewportWidth_ * 2 - 1;
-    const auto y = 1 - screenY / viewportWidth_ * 2; // width instead of height takes aspect ratio into account
-    const float camDistToScreen = 1 / std::tan(horizViewAngle_ / 2);
-    return cameraRotation() * Eigen::Vector3d(-camDistToScreen, x, y).normalized();
+    const Eigen::Matrix3f mf = m.cast<float>().transpose();
+    return QMatrix3x3(mf.data());
 }
 
-void Canvas::mouseMoveEvent(QMouseEvent*const event)
+struct TextureFormats
 {
-    const auto pos = QPointF(::position(event)) * devicePixelRatio();
-    switch(dragMode_)
-    {
-    case DragMode::Camera:
+    QOpenGLTexture::TextureFormat internal;
+    QOpenGLTexture::PixelFormat source;
+    // Where the channels of the texture are taken from, for the layouts GL
+    // has no matching format for
+    QOpenGLTexture::SwizzleValue swizzle[4] = {QOpenGLTexture::RedValue, QOpenGLTexture::GreenValue,
+                                               QOpenGLTexture::BlueValue, QOpenGLTexture::AlphaValue};
+};
+
+bool hasTextureFormats(const QImage::Format format)
+{
+    switch(format)
     {
-        const auto dir0 = calcViewDir(viewportWidth_ / 2., viewportHeight_ / 2.);
-        const auto dir1 = calcViewDir(viewportWidth_ / 2. + 1, viewportHeight_ / 2. + 1);
-        const auto anglePerPixel = std::acos(std::min(1., dir0.dot(dir1)));
-        const auto deltaYaw = -(prevMouseX_-pos.x())*anglePerPixel;
-        const auto deltaPitch = (prevMouseY_-pos.y())*anglePerPixel;
-        pitch_ = std::clamp(pitch_ + deltaPitch, -M_PI/2, M_PI/2);
-        yaw_ = std::remainder(yaw_ + deltaYaw, 2*M_PI);
-        break;
-    }
+    case QImage::Format_Grayscale8:
+    case QImage::Format_RGB888:
+    case QImage::Format_RGBX8888:
+    case QImage::Format_RGBA8888:
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+        return true;
     default:
-        break;
+        return false;
     }
-    prevMouseX_=pos.x();
-    prevMouseY_=pos.y();
-    update();
 }
 
-void Canvas::mousePressEvent(QMouseEvent*const event)
+// The images are uploaded as they are, and the swizzle puts the channels in
+// place, so that nothing has to be converted on the CPU
+TextureFormats textureFormats(const QImage::Format format)
 {
-    if(!texture_ && event->button() == Qt::LeftButton)
+    using T = QOpenGLTexture;
+    switch(format)
     {
-        // Tapped an empty space
-        emit newFileRequested();
-    }
-
-    const auto pos = QPointF(::position(event)) * devicePixelRatio();
-    switch(event->button())
+    case QImage::Format_Grayscale8:
+        return {T::R8_UNorm, T::Red, {T::RedValue, T::RedValue, T::RedValue, T::OneValue}};
+    case QImage::Format_RGB888:
+        return {T::RGB8_UNorm, T::RGB};
+    case QImage::Format_RGBX8888:
+        return {T::RGBA8_UNorm, T::RGBA, {T::RedValue, T::GreenValue, T::BlueValue, T::OneValue}};
+    // 32-bit words 0xAARRGGBB. GLES has no BGRA source format, so they go in as RGBA and get swizzled.
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
     {
-    case Qt::LeftButton:
-        setDragMode(DragMode::Camera, pos.x(), pos.y());
-        break;
+        const bool opaque = format == QImage::Format_RGB32;
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+        return {T::RGBA8_UNorm, T::RGBA, {T::BlueValue, T::GreenValue, T::RedValue, opaque ? T::OneValue : T::AlphaValue}};
+#else
+        return {T::RGBA8_UNorm, T::RGBA, {T::GreenValue, T::BlueValue, T::AlphaValue, opaque ? T::OneValue : T::RedValue}};
+#endif
+    }
     default:
-        break;
+        assert(format == QImage::Format_RGBA8888);
+        return {T::RGBA8_UNorm, T::RGBA};
     }
 }
 
-void Canvas::mouseReleaseEvent(QMouseEvent*)
+void setSwizzle(QOpenGLTexture& texture, const TextureFormats& formats)
 {
-    setDragMode(DragMode::None);
+    const auto& s = formats.swizzle;
+    if(s[0] != QOpenGLTexture::RedValue || s[1] != QOpenGLTexture::GreenValue ||
+       s[2] != QOpenGLTexture::BlueValue || s[3] != QOpenGLTexture::AlphaValue)
+        texture.setSwizzleMask(s[0], s[1], s[2], s[3]);
 }
 
-void Canvas::wheelEvent(QWheelEvent*const event)
+qint64 textureBytes(const QOpenGLTexture& texture)
 {
-    const auto stepSize = event->modifiers() & Qt::ShiftModifier ? 1*DEGREE : 5*DEGREE;
-    const auto step = -stepSize * event->angleDelta().y()/120.;
-    horizViewAngle_ += step;
-    constexpr double minViewAngle = 5 * DEGREE;
-    constexpr double maxViewAngle = 160 * DEGREE;
-    if(horizViewAngle_ <= minViewAngle) horizViewAngle_ = minViewAngle;
-    if(horizViewAngle_ > maxViewAngle) horizViewAngle_ = maxViewAngle;
-    update();
+    int bitsPerTexel;
+    switch(texture.format())
+    {
+    case QOpenGLTexture::R8_UNorm:  bitsPerTexel = 8; break;
+    case QOpenGLTexture::RGBA16F:   bitsPerTexel = 64; break;
+    case QOpenGLTexture::RGB_DXT1:
+    case QOpenGLTexture::RGB8_ETC2: bitsPerTexel = 4; break;
+    // RGB8 is usually padded to 32 bits by the driver
+    default:                        bitsPerTexel = 32; break;
+    }
+    qint64 bits = 0;
+    for(int level = 0; level < texture.mipLevels(); ++level)
+        bits += qint64(std::max(1, texture.width() >> level)) * std::max(1, texture.height() >> level) * bitsPerTexel;
+    return bits / 8;
 }
 
-void Canvas::dragEnterEvent(QDragEnterEvent*const event)
+qint64 imageBytes(const std::vector<QImage>& levels)
 {
-    if(event->mimeData()->hasUrls())
-        event->acceptProposedAction();
+    qint64 bytes = 0;
+    for(const auto& level : levels)
+        bytes += level.sizeInBytes();
+    // Pyramids are memory-mapped, so they cost only the page cache
+    return bytes;
 }
 
-void Canvas::dropEvent(QDropEvent*const event)
+// Maps (Y, Cb, Cr, 1), as sampled from the planes, to (R, G, B, 1)
+QMatrix4x4 yuvToRGBMatrix(const QVideoFrameFormat& format)
 {
-    const auto urls = event->mimeData()->urls();
-    if(urls.count() != 1)
+    double kr, kb;
+    switch(format.colorSpace())
     {
-        QMessageBox::critical(this, tr("Too many files"),
-                              tr("%1 files have been dropped, while only 1 "
-                                 "can be opened at a time.").arg(urls.count()));
-        return;
+    case QVideoFrameFormat::ColorSpace_BT601:  kr = 0.299;  kb = 0.114;  break;
+    case QVideoFrameFormat::ColorSpace_BT2020: kr = 0.2627; kb = 0.0593; break;
+    default:                                   kr = 0.2126; kb = 0.0722; break;
     }
-    const auto path = urls[0].toLocalFile();
-    if(openFile(path))
-        event->acceptProposedAction();
+    const double kg = 1 - kr - kb;
+    const bool fullRange = format.colorRange() == QVideoFrameFormat::ColorRange_Full;
+    const double yOffset = fullRange ? 0 : 16. / 255;
+    const double yScale = fullRange ? 1 : 255. / 219;
+    const double cScale = fullRange ? 1 : 255. / 224;
+
+    const QMatrix4x4 range(yScale, 0,      0,      -yOffset * yScale,
+                           0,      cScale, 0,      -0.5 * cScale,
+                           0,      0,      cScale, -0.5 * cScale,
+                           0,      0,      0,      1);
+    const QMatrix4x4 toRGB(1,  0,                         2 * (1 - kr),              0,
+                           1, -2 * kb * (1 - kb) / kg,   -2 * kr * (1 - kr) / kg,    0,
+                           1,  2 * (1 - kb),              0,                         0,
+                           0,  0,                         0,                         1);
+    return toRGB * range;
 }
 
-void Canvas::setImage(const QImage& image)
+}
+
+Canvas::Canvas(QWidget* parent)
+    : QOpenGLWidget(parent)
+    , fisheyeCalibration_(DualFisheye::calibration())
+    , textureCache_(shared().textureCache)
+    , imageCache_(shared().imageCache)
+    , loadsInProgress_(shared().loadsInProgress)
+    , shownTextures_(shared().shownTextures)
+    , pendingMemory_(MemoryBudget::Category::Images, 0)
+    , textureMemory_(MemoryBudget::Category::Textures, 0)
 {
-    image_ = image;
-    update();
+    setFormat(makeGLSurfaceFormat());
+    setAcceptDrops(true);
+    setFocusPolicy(Qt::StrongFocus);
+    connect(&frameTimer_, &QTimer::timeout, this, qOverload<>(&Canvas::update));
+    renderClock_.start();
+
+    const QSettings glCapabilities(glCapabilitiesPath(), QSettings::IniFormat);
+    maxTexSize_ = glCapabilities.value("maxTextureSize", 0).toInt();
+    const int compression = glCapabilities.value("textureCompression", -1).toInt();
+    if(compression >= 0)
+        textureCompression_ = TextureCompressor::Format(compression);
+
+    connect(&MemoryBudget::instance(), &MemoryBudget::pressureChanged, this, &Canvas::handleMemoryPressure);
+    shared().canvases.push_back(this);
 }
 
-bool Canvas::openFile(const QString& path)
+Canvas::Shared& Canvas::shared()
 {
-    QImageReader imgReader(path);
-    const auto img = imgReader.read();
-    if(img.isNull())
-    {
-        QMessageBox::critical(this, tr("Error opening image"),
-                              tr("Failed to read the image file\n\"%1\":\n%2")
-                                .arg(path)
-                                .arg(imgReader.errorString()));
-        return false;
-    }
-    setImage(img);
-    emit newImageLoaded(QFileInfo(path).fileName());
-    qDebug() << "Image loaded";
-    return true;
+    // Never destroyed, as the textures can only be deleted with a context current
+    static const auto shared = new Shared{{TEXTURE_CACHE_BUDGET, MemoryBudget::Category::Textures},
+                                          {IMAGE_CACHE_BUDGET, MemoryBudget::Category::Images}};
+    return *shared;
 }
 
-void Canvas::closeImage()
+void Canvas::shareGLContexts()
 {
-    texture_.reset();
+    // The global context the others share through must be of the same kind.
+    // With dynamic GL the kind isn't known until QApplication exists.
+#ifndef QT_OPENGL_DYNAMIC
+    QSurfaceFormat::setDefaultFormat(makeGLSurfaceFormat());
+#endif
+    QCoreApplication::setAttribute(Qt::AA_ShareOpenGLContexts);
 }
 
-void Canvas::paintGL()
+void Canvas::startSensor()
+{
+    // Connecting to the sensor backend takes time, and the sensor is useless
+    // until there's a panorama to look at
+    Utils::startupEvent("Starting the sensor");
+    orientationTracker_ = new OrientationTracker(this);
+    connect(this, &QOpenGLWidget::frameSwapped, orientationTracker_, &OrientationTracker::frameSwapped);
+    connect(orientationTracker_, &OrientationTracker::readingReceived, this, &Canvas::sensorReadingReceived);
+    // A replay renders the frames itself
+    if(replayTime_ >= 0) return;
+    const int framePeriod = 1000 / 60;
+    frameTimer_.start(framePeriod);
+}
+
+void Canvas::setReplayTime(const double time)
+{
+    replayTime_ = time;
+    frameTimer_.stop();
+    if(orientationTracker_)
+        orientationTracker_->setReplayTime(std::llround(time * 1000));
+}
+
+void Canvas::replaySensorReading(const qint64 timestamp, const double x, const double y, const double z)
+{
+    if(!orientationTracker_)
+    {
+        startSensor();
+        orientationTracker_->setReplayTime(std::llround(replayTime_ * 1000));
+    }
+    orientationTracker_->replayReading(timestamp, x, y, z);
+}
+
+bool Canvas::setGpuTimingEnabled(const bool enabled)
+{
+    makeCurrent();
+    const auto ctx = context();
+    const bool supported = ctx && (!ctx->isOpenGLES() || ctx->hasExtension("GL_EXT_disjoint_timer_query"));
+    if(enabled && supported && !gpuTimeQuery_)
+    {
+        glGenQueries(1, &gpuTimeQuery_);
+    }
+    else if(!enabled && gpuTimeQuery_)
+    {
+        glDeleteQueries(1, &gpuTimeQuery_);
+        gpuTimeQuery_ = 0;
+    }
+    gpuTimeQueried_ = false;
+    doneCurrent();
+    return supported || !enabled;
+}
+
+Canvas::FrameTiming Canvas::lastFrameTiming()
+{
+    FrameTiming timing{lastCpuFrameTime_, -1};
+    if(!gpuTimeQueried_)
+        return timing;
+    makeCurrent();
+    GLuint nanoseconds = 0;
+    glGetQueryObjectuiv(gpuTimeQuery_, GL_QUERY_RESULT, &nanoseconds);
+    doneCurrent();
+    timing.gpu = nanoseconds * 1e-6;
+    return timing;
+}
+
+void Canvas::setupBuffers()
+{
+    if(!vao_)
+        glGenVertexArrays(1, &vao_);
+    glBindVertexArray(vao_);
+    if(!vbo_)
+        glGenBuffers(1, &vbo_);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo_);
+    const GLfloat vertices[]=
+    {
+        -1, -1,
+         1, -1,
+        -1,  1,
+         1,  1,
+    };
+    glBufferData(GL_ARRAY_BUFFER, sizeof vertices, vertices, GL_STATIC_DRAW);
+    constexpr GLuint attribIndex=0;
+    constexpr int coordsPerVertex=2;
+    glVertexAttribPointer(attribIndex, coordsPerVertex, GL_FLOAT, false, 0, 0);
+    glEnableVertexAttribArray(attribIndex);
+    glBindVertexArray(0);
+}
+
+void Canvas::setupStereoMesh(const double eyeAspectRatio)
+{
+    if(stereoVao_ && eyeAspectRatio == stereoMeshAspectRatio_)
+        return;
+    stereoMeshAspectRatio_ = eyeAspectRatio;
+    const auto mesh = VrLens::buildMesh(vrLens_, eyeAspectRatio);
+    if(!stereoVao_)
+    {
+        glGenVertexArrays(1, &stereoVao_);
+        glGenBuffers(1, &stereoVbo_);
+        glGenBuffers(1, &stereoIbo_);
+    }
+    glBindVertexArray(stereoVao_);
+    glBindBuffer(GL_ARRAY_BUFFER, stereoVbo_);
+    glBufferData(GL_ARRAY_BUFFER, mesh.vertices.size() * sizeof mesh.vertices[0], mesh.vertices.data(),
+                 GL_STATIC_DRAW);
+    constexpr GLsizei stride = VrLens::MESH_COMPONENTS_PER_VERTEX * sizeof(GLfloat);
+    glVertexAttribPointer(0, 2, GL_FLOAT, false, stride, nullptr);
+    glVertexAttribPointer(1, 2, GL_FLOAT, false, stride, reinterpret_cast<const void*>(2 * sizeof(GLfloat)));
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, stereoIbo_);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, mesh.indices.size() * sizeof mesh.indices[0], mesh.indices.data(),
+                 GL_STATIC_DRAW);
+    stereoIndexCount_ = mesh.indices.size();
+    glBindVertexArray(0);
+}
+
+std::unique_ptr<QOpenGLShaderProgram> Canvas::buildProgram(const QByteArray& defines)
+{
+    // Cacheable shaders are stored by Qt as program binaries, keyed by the
+    // GL vendor, renderer, version and the hash of the sources, so only the
+    // first launch with a given driver pays for compilation.
+    auto program = std::make_unique<QOpenGLShaderProgram>();
+    if(!program->addCacheableShaderFromSourceCode(QOpenGLShader::Vertex,
+                                                 prependGLSLVersion(VERTEX_SHADER_SRC, defines)))
+        QMessageBox::critical(nullptr, tr("Error compiling shader"),
+                              tr("Failed to compile %1:\n%2").arg("vertex shader").arg(program->log()));
+    if(!program->addCacheableShaderFromSourceCode(QOpenGLShader::Fragment,
+                                                 prependGLSLVersion(FRAGMENT_SHADER_SRC, defines)))
+        QMessageBox::critical(nullptr, tr("Error compiling shader"),
+                              tr("Failed to compile %1:\n%2").arg("fragment shader").arg(program->log()));
+    if(!program->link())
+    {
+        QMessageBox::critical(nullptr, tr("Error linking shader program"),
+                              tr("Failed to link %1:\n%2").arg("shader program").arg(program->log()));
+        return nullptr;
+    }
+    return program;
+}
+
+QOpenGLShaderProgram* Canvas::program(const Projection projection, const bool dualFisheye)
+{
+    auto& program = programs_[dualFisheye][int(projection)];
+    if(!program)
+    {
+        QElapsedTimer timer;
+        timer.start();
+        program = buildProgram("#define PROJECTION " + QByteArray::number(int(projection)) + "\n" +
+                               (dualFisheye ? "#define DUAL_FISHEYE\n" : "") +
+                               (projection == Projection::VRStereo ? "#define STEREO_MESH\n" : ""));
+        qDebug() << "Shader program for projection" << int(projection) << (dualFisheye ? "of dual fisheye" : "")
+                 << "ready in" << timer.elapsed() << "ms";
+    }
+    return program.get();
+}
+
+QOpenGLShaderProgram* Canvas::cubeFaceProgram(const bool dualFisheye)
+{
+    auto& program = cubeFacePrograms_[dualFisheye];
+    if(!program)
+        program = buildProgram(QByteArray("#define PROJECTION -1\n#define CUBE_MAP_FACE\n") +
+                               (dualFisheye ? "#define DUAL_FISHEYE\n" : ""));
+    return program.get();
+}
+
+void Canvas::setSourceUniforms(QOpenGLShaderProgram& program)
+{
+    if(!dualFisheye_) return;
+    const auto& lenses = fisheyeCalibration_.lenses;
+    const QVector4D circles[2] =
+    {
+        QVector4D(lenses[0].centerX, lenses[0].centerY, lenses[0].radius, lenses[0].fieldOfView / 2),
+        QVector4D(lenses[1].centerX, lenses[1].centerY, lenses[1].radius, lenses[1].fieldOfView / 2),
+    };
+    const GLfloat rolls[2] = {GLfloat(lenses[0].roll), GLfloat(lenses[1].roll)};
+    program.setUniformValueArray("lensCircle", circles, 2);
+    program.setUniformValueArray("lensRoll", rolls, 2, 1);
+    program.setUniformValue("seamWidth", float(std::max(fisheyeCalibration_.seamWidth, 1e-3)));
+    program.setUniformValue("sourceAspectRatio", float(texture_->width()) / texture_->height());
+}
+
+void Canvas::setupShaders()
+{
+    // Only the program for the current projection is needed for the first
+    // frame. The rest are prepared right after it, so that switching is instant.
+    program(projection_, dualFisheye_);
+    connect(this, &QOpenGLWidget::frameSwapped, this, [this]
+    {
+        makeCurrent();
+        for(int n = 0; n < PROJECTION_COUNT; ++n)
+            program(Projection(n), dualFisheye_);
+        cubeFaceProgram(dualFisheye_);
+        doneCurrent();
+    }, Qt::SingleShotConnection);
+}
+
+void Canvas::initializeGL()
+{
+    Utils::startupEvent("Initializing GL");
+    initializeOpenGLFunctions();
+    getViewportSize();
+
+    setupBuffers();
+    setupShaders();
+
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTexSize_);
+    qDebug() << "GL_MAX_TEXTURE_SIZE:" << maxTexSize_;
+
+    // ETC2 is mandatory in GLES 3.0. Desktop drivers often only emulate it
+    // by decompressing on upload, so there we want S3TC instead.
+    const auto ctx = context();
+    if(ctx->isOpenGLES())
+    {
+        if(ctx->format().majorVersion() >= 3)
+            textureCompression_ = TextureCompressor::Format::ETC2_RGB8;
+    }
+    else if(ctx->hasExtension("GL_EXT_texture_compression_s3tc"))
+    {
+        textureCompression_ = TextureCompressor::Format::BC1;
+    }
+    qDebug() << "Texture compression:" << (!textureCompression_ ? "none" :
+                                           *textureCompression_ == TextureCompressor::Format::BC1 ? "BC1" : "ETC2");
+    // Needed to keep HDR values in a cube map
+    floatRenderTargets_ = !ctx->isOpenGLES() || ctx->hasExtension("GL_EXT_color_buffer_half_float") ||
+                          ctx->hasExtension("GL_EXT_color_buffer_float");
+    QSettings glCapabilities(glCapabilitiesPath(), QSettings::IniFormat);
+    const int compression = textureCompression_ ? int(*textureCompression_) : -1;
+    if(glCapabilities.value("maxTextureSize").toInt() != maxTexSize_ ||
+       glCapabilities.value("textureCompression", -1).toInt() != compression)
+    {
+        glCapabilities.setValue("maxTextureSize", maxTexSize_);
+        glCapabilities.setValue("textureCompression", compression);
+    }
+
+#ifdef GL_TEXTURE_CUBE_MAP_SEAMLESS
+    // GLES 3 always filters across the faces, desktop GL needs to be asked
+    if(!ctx->isOpenGLES())
+        glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+#endif
+    Utils::startupEvent("GL initialized");
+}
+
+void Canvas::getViewportSize()
+{
+    GLint vp[4] = {};
+    glGetIntegerv(GL_VIEWPORT, vp);
+    viewportWidth_ = vp[2];
+    viewportHeight_ = vp[3];
+}
+
+Canvas::~Canvas()
+{
+    // Lets the other canvases know the texture is no longer shown here
+    stashCurrentImage();
+    makeCurrent();
+    if(videoFbo_)
+        glDeleteFramebuffers(1, &videoFbo_);
+    if(gpuTimeQuery_)
+        glDeleteQueries(1, &gpuTimeQuery_);
+    auto& canvases = shared().canvases;
+    canvases.erase(std::find(canvases.begin(), canvases.end(), this));
+    // Nobody will show the cached textures, and there'll be no context to delete them
+    if(canvases.empty())
+        textureCache_.clear();
+}
+
+Eigen::Matrix3d Canvas::cameraRotation() const
+{
+    using namespace Eigen;
+    Matrix3d m;
+    m = AngleAxisd(yaw_, Vector3d::UnitZ()) *
+        sensorOrientation_ *
+        AngleAxisd(pitch_, -Vector3d::UnitY());
+    return m;
+}
+
+Eigen::Vector3d Canvas::calcViewDir(const double screenX, const double screenY) const
+{
+    const auto x = screenX / viewportWidth_ * 2 - 1;
+    const auto y = 1 - screenY / viewportWidth_ * 2; // width instead of height takes aspect ratio into account
+    const float camDistToScreen = 1 / std::tan(horizViewAngle_ / 2);
+    return cameraRotation() * Eigen::Vector3d(-camDistToScreen, x, y).normalized();
+}
+
+void Canvas::mouseMoveEvent(QMouseEvent*const event)
+{
+    const auto pos = QPointF(::position(event)) * devicePixelRatio();
+    switch(dragMode_)
+    {
+    case DragMode::Camera:
+    {
+        const auto dir0 = calcViewDir(viewportWidth_ / 2., viewportHeight_ / 2.);
+        const auto dir1 = calcViewDir(viewportWidth_ / 2. + 1, viewportHeight_ / 2. + 1);
+        const auto anglePerPixel = std::acos(std::min(1., dir0.dot(dir1)));
+        const auto deltaYaw = -(prevMouseX_-pos.x())*anglePerPixel;
+        const auto deltaPitch = (prevMouseY_-pos.y())*anglePerPixel;
+        pitch_ = std::clamp(pitch_ + deltaPitch, -M_PI/2, M_PI/2);
+        yaw_ = std::remainder(yaw_ + deltaYaw, 2*M_PI);
+        emit cameraChanged();
+        break;
+    }
+    default:
+        break;
+    }
+    prevMouseX_=pos.x();
+    prevMouseY_=pos.y();
+    update();
+}
+
+void Canvas::keyPressEvent(QKeyEvent*const event)
+{
+    switch(event->key())
+    {
+    case Qt::Key_Left:
+    case Qt::Key_PageUp:
+    case Qt::Key_Backspace:
+        emit adjacentFileRequested(-1);
+        break;
+    case Qt::Key_Right:
+    case Qt::Key_PageDown:
+    case Qt::Key_Space:
+        emit adjacentFileRequested(1);
+        break;
+    case Qt::Key_P:
+        setProjection(Projection((int(projection_) + 1) % PROJECTION_COUNT));
+        break;
+    case Qt::Key_Plus:
+    case Qt::Key_Equal:
+        setExposure(exposure_ + EXPOSURE_STEP);
+        break;
+    case Qt::Key_Minus:
+        setExposure(exposure_ - EXPOSURE_STEP);
+        break;
+    case Qt::Key_0:
+        setExposure(0);
+        break;
+    default:
+        QOpenGLWidget::keyPressEvent(event);
+        break;
+    }
+}
+
+void Canvas::mousePressEvent(QMouseEvent*const event)
+{
+    if(!texture_ && event->button() == Qt::LeftButton)
+    {
+        // Tapped an empty space
+        emit newFileRequested();
+    }
+
+    const auto pos = QPointF(::position(event)) * devicePixelRatio();
+    switch(event->button())
+    {
+    case Qt::LeftButton:
+        setDragMode(DragMode::Camera, pos.x(), pos.y());
+        break;
+    case Qt::BackButton:
+        emit adjacentFileRequested(-1);
+        break;
+    case Qt::ForwardButton:
+        emit adjacentFileRequested(1);
+        break;
+    default:
+        break;
+    }
+}
+
+void Canvas::mouseReleaseEvent(QMouseEvent*)
+{
+    setDragMode(DragMode::None);
+}
+
+void Canvas::wheelEvent(QWheelEvent*const event)
+{
+    const auto stepSize = event->modifiers() & Qt::ShiftModifier ? 1*DEGREE : 5*DEGREE;
+    const auto step = -stepSize * event->angleDelta().y()/120.;
+    horizViewAngle_ += step;
+    constexpr double minViewAngle = 5 * DEGREE;
+    const double maxAngle = maxViewAngle(projection_);
+    if(horizViewAngle_ <= minViewAngle) horizViewAngle_ = minViewAngle;
+    if(horizViewAngle_ > maxAngle) horizViewAngle_ = maxAngle;
+    update();
+    emit cameraChanged();
+}
+
+void Canvas::setCamera(const Camera& camera)
+{
+    yaw_ = camera.yaw;
+    pitch_ = camera.pitch;
+    horizViewAngle_ = std::min(camera.horizViewAngle, maxViewAngle(projection_));
+    update();
+}
+
+void Canvas::setProjection(const Projection projection)
+{
+    if(projection == projection_) return;
+    projection_ = projection;
+    if(projection == Projection::LittlePlanet)
+    {
+        // Look at the nadir, with the whole sphere in view
+        pitch_ = M_PI / 2;
+        horizViewAngle_ = 270 * DEGREE;
+    }
+    horizViewAngle_ = std::min(horizViewAngle_, maxViewAngle(projection));
+    update();
+    emit projectionChanged(projection);
+}
+
+void Canvas::setExposure(const double exposure)
+{
+    exposure_ = exposure;
+    if(texture_ && texture_->format() == QOpenGLTexture::RGB9E5)
+        update();
+}
+
+void Canvas::dragEnterEvent(QDragEnterEvent*const event)
+{
+    if(event->mimeData()->hasUrls())
+        event->acceptProposedAction();
+}
+
+void Canvas::dropEvent(QDropEvent*const event)
+{
+    const auto urls = event->mimeData()->urls();
+    if(urls.count() != 1)
+    {
+        QMessageBox::critical(this, tr("Too many files"),
+                              tr("%1 files have been dropped, while only 1 "
+                                 "can be opened at a time.").arg(urls.count()));
+        return;
+    }
+    const auto path = urls[0].toLocalFile();
+    if(openFile(path))
+        event->acceptProposedAction();
+}
+
+void Canvas::setImage(const QImage& image)
+{
+    stashCurrentImage();
+    const QPointer<Canvas> canvas(this);
+    const int maxSize = maxLoadedSize();
+    QThreadPool::globalInstance()->start([canvas, image, maxSize]
+    {
+        const auto levels = buildMipChain(fitToSize(image, maxSize));
+        QMetaObject::invokeMethod(qApp, [canvas, levels]
+        {
+            // Ignore it if a file has been opened meanwhile
+            if(!canvas || !canvas->currentPath_.isEmpty() || canvas->fileOpened())
+                return;
+            canvas->pendingLevels_ = levels;
+            canvas->pendingDualFisheye_ = false;
+            canvas->pendingHdr_ = false;
+            canvas->pendingColorSpace_ = levels[0].colorSpace();
+            canvas->update();
+        }, Qt::QueuedConnection);
+    });
+}
+
+bool Canvas::openFile(const QString& path)
+{
+    if(path == currentPath_ && fileOpened())
+        return true;
+    // Most errors are only known when loading finishes, but these can be
+    // told right away, and the current image is kept then
+    const QFileInfo fileInfo(path);
+    if(!fileInfo.isFile() || !fileInfo.isReadable())
+    {
+        QMessageBox::critical(this, tr("Error opening image"),
+                              tr("The file\n\"%1\"\ndoesn't exist or can't be read").arg(path));
+        return false;
+    }
+    stashCurrentImage();
+    currentPath_ = path;
+
+    if(VideoPlayer::isVideoFile(path))
+    {
+        openVideo(path);
+        return true;
+    }
+    if(adoptShownTexture(path))
+    {
+        update();
+        emit newImageLoaded(QFileInfo(path).fileName());
+        return true;
+    }
+    if(auto cached = textureCache_.take(path))
+    {
+        texture_ = std::move(cached->texture);
+        dualFisheye_ = cached->dualFisheye;
+        setColorSpace(cached->colorSpace);
+        registerShownTexture();
+        update();
+        emit newImageLoaded(QFileInfo(path).fileName());
+        return true;
+    }
+    if(const auto image = imageCache_.take(path))
+    {
+        handleLoadedImage(path, *image);
+        return true;
+    }
+    const auto load = loadsInProgress_.find(path);
+    if(load == loadsInProgress_.end())
+    {
+        startLoading(path, 0);
+    }
+    else if(load->second && !load->second->exchange(true))
+    {
+        // The prefetch hasn't started and would wait behind the others. It
+        // won't do anything now, and the file is loaded ahead of them instead.
+        startLoading(path, 0);
+    }
+    // Otherwise the result will be shown when it arrives
+    return true;
+}
+
+void Canvas::prefetch(const QStringList& paths)
+{
+    // Whatever is prefetched now would only be evicted
+    if(MemoryBudget::instance().pressure() != MemoryBudget::Pressure::Normal)
+        return;
+    for(const auto& path : paths)
+    {
+        if(path.isEmpty() || path == currentPath_ || isCached(path) || loadsInProgress_.count(path) ||
+           VideoPlayer::isVideoFile(path))
+            continue;
+        // Lower priority than opening a file the user is waiting for
+        startLoading(path, -1);
+    }
+}
+
+bool Canvas::isCached(const QString& path) const
+{
+    return textureCache_.contains(path) || imageCache_.contains(path) || shownTextures_.count(path);
+}
+
+void Canvas::startLoading(const QString& path, const int priority)
+{
+    const int maxSize = maxLoadedSize();
+    const auto compression = textureCompression_;
+    // Until it starts, a prefetch can be taken over by openFile()
+    const auto started = priority < 0 ? std::make_shared<std::atomic_bool>(false) : nullptr;
+    loadsInProgress_[path] = started;
+    // Loading happens off the GUI thread. On a cache miss, the rows are
+    // streamed through the downscaler, so that the full-resolution image
+    // never exists in memory, and then the pyramid is written to the cache.
+    // Compression for the GPU happens only after the uncompressed image has
+    // been shown, so it delays the next opening of the file, not this one.
+    Utils::startupEvent("Starting to load the image");
+    QThreadPool::globalInstance()->start([path, maxSize, compression, started]
+    {
+        if(started && started->exchange(true))
+            return;
+        QElapsedTimer timer;
+        timer.start();
+        LoadedImage result;
+        QSize sourceSize;
+        result.hdr = Hdr::isHdrFile(path);
+        if(!result.hdr)
+            result.pyramid = PyramidCache::load(path, maxSize, compression);
+        if(result.hdr)
+        {
+            result.levels = Hdr::decodeLevels(path, maxSize, result.error);
+        }
+        else if(result.pyramid)
+        {
+            result.dualFisheye = result.pyramid->isDualFisheye();
+        }
+        else
+        {
+            const auto image = decodeImage(path, QSize(maxSize, maxSize), result.error, &sourceSize);
+            if(!image.isNull())
+            {
+                result.dualFisheye = DualFisheye::detect(path, image);
+                result.levels = buildMipChain(image, !result.dualFisheye);
+            }
+        }
+        // Only the headers are read for this, the pixels stay in the source color space
+        if(!result.hdr)
+            result.colorSpace = ColorManagement::embeddedColorSpace(path);
+        qDebug() << "Image" << path << "loaded in" << timer.elapsed() << "ms";
+        Utils::startupEvent("Image loaded");
+        QMetaObject::invokeMethod(qApp, [path, result]
+        {
+            handleLoadResult(path, result);
+        }, Qt::QueuedConnection);
+
+        // HDR levels are RGB9E5 already, and decoding them is about as fast as reading the cache
+        if(!result.levels.empty() && !result.hdr)
+            PyramidCache::store(path, sourceSize, result.levels, result.dualFisheye, compression);
+    }, priority);
+}
+
+void Canvas::handleLoadResult(const QString& path, const LoadedImage& image)
+{
+    auto& shared = Canvas::shared();
+    shared.loadsInProgress.erase(path);
+    // The levels are implicitly shared, and whichever canvas paints first
+    // uploads them for all the others
+    bool shown = false;
+    for(const auto canvas : shared.canvases)
+    {
+        if(path == canvas->currentPath_ && !canvas->texture_ && canvas->pendingLevels_.empty() &&
+           !canvas->pendingPyramid_)
+        {
+            canvas->handleLoadedImage(path, image);
+            shown = true;
+        }
+    }
+    if(shown) return;
+    if(image.levels.empty() && !image.pyramid)
+    {
+        qWarning().noquote() << "Failed to prefetch" << path << ":" << image.error;
+    }
+    else
+    {
+        // Prefetched, or the user has already moved on
+        shared.imageCache.insert(path, image, imageBytes(image.levels));
+    }
+}
+
+void Canvas::stashCurrentImage()
+{
+    if(video_)
+    {
+        // Video frames aren't worth caching
+        delete video_;
+        video_ = nullptr;
+        makeCurrent();
+        texture_.reset();
+        cubeMap_.reset();
+        doneCurrent();
+    }
+    if(texture_)
+    {
+        // Textures may only be deleted with the context current, and the
+        // cache may evict one
+        makeCurrent();
+        cubeMap_.reset();
+        // Only the last canvas showing the file caches the texture
+        const bool shownElsewhere = texture_.use_count() > 1;
+        if(!shownElsewhere)
+            shownTextures_.erase(currentPath_);
+        if(currentPath_.isEmpty() || shownElsewhere)
+        {
+            texture_.reset();
+        }
+        else
+        {
+            const auto bytes = textureBytes(*texture_);
+            textureCache_.insert(currentPath_, {std::move(texture_), dualFisheye_, colorSpace_}, bytes);
+        }
+        doneCurrent();
+    }
+    else if((!pendingLevels_.empty() || pendingPyramid_) && !currentPath_.isEmpty())
+    {
+        imageCache_.insert(currentPath_, {pendingLevels_, pendingPyramid_, {}, pendingDualFisheye_, pendingHdr_,
+                                          pendingColorSpace_},
+                           imageBytes(pendingLevels_));
+    }
+    pendingLevels_.clear();
+    pendingPyramid_.reset();
+    currentPath_.clear();
+    updateMemoryUsage();
+}
+
+bool Canvas::adoptShownTexture(const QString& path)
+{
+    const auto shown = shownTextures_.find(path);
+    if(shown == shownTextures_.end()) return false;
+    auto texture = shown->second.texture.lock();
+    if(!texture) return false;
+    texture_ = std::move(texture);
+    cubeMap_ = shown->second.cubeMap.lock();
+    dualFisheye_ = shown->second.dualFisheye;
+    setColorSpace(shown->second.colorSpace);
+    return true;
+}
+
+void Canvas::registerShownTexture()
+{
+    // Video frames are per canvas
+    if(currentPath_.isEmpty() || video_ || !texture_) return;
+    shownTextures_[currentPath_] = {texture_, cubeMap_, dualFisheye_, colorSpace_};
+}
+
+void Canvas::updateMemoryUsage()
+{
+    pendingMemory_.resize(imageBytes(pendingLevels_));
+    // Each canvas showing a texture accounts for its share, so that the
+    // texture counts once in total
+    qint64 bytes = texture_ ? textureBytes(*texture_) / texture_.use_count() : 0;
+    if(cubeMap_)
+        bytes += 6 * textureBytes(*cubeMap_) / cubeMap_.use_count();
+    textureMemory_.resize(bytes);
+}
+
+void Canvas::handleMemoryPressure(const MemoryBudget::Pressure pressure)
+{
+    // High pressure shrinks the caches to a quarter, critical pressure empties them
+    const int shift = pressure == MemoryBudget::Pressure::Normal ? 0 :
+                      pressure == MemoryBudget::Pressure::High ? 2 : 63;
+    imageCache_.setBudget(shift < 63 ? IMAGE_CACHE_BUDGET >> shift : 0);
+    // Evicted textures are deleted, which needs the context
+    makeCurrent();
+    textureCache_.setBudget(shift < 63 ? TEXTURE_CACHE_BUDGET >> shift : 0);
+    doneCurrent();
+}
+
+void Canvas::handleLoadedImage(const QString& path, const LoadedImage& image)
+{
+    if(image.levels.empty() && !image.pyramid)
+    {
+        QMessageBox::critical(this, tr("Error opening image"),
+                              tr("Failed to read the image file\n\"%1\":\n%2")
+                                .arg(path)
+                                .arg(image.error));
+        return;
+    }
+    pendingLevels_ = image.levels;
+    pendingPyramid_ = image.pyramid;
+    pendingDualFisheye_ = image.dualFisheye;
+    pendingHdr_ = image.hdr;
+    pendingColorSpace_ = image.colorSpace;
+    update();
+    emit newImageLoaded(QFileInfo(path).fileName());
+}
+
+int Canvas::maxLoadedSize() const
+{
+    // Cached from the last run, so it's known before GL is initialized
+    int maxSize = maxTexSize_ ? maxTexSize_ : DEFAULT_MAX_TEX_SIZE;
+    // A quarter of the memory is better than being killed for it
+    if(MemoryBudget::instance().pressure() == MemoryBudget::Pressure::Critical)
+        maxSize /= 2;
+    return maxSize;
+}
+
+void Canvas::createTexture(const QSize& size, const int mipLevels, const QOpenGLTexture::TextureFormat format)
+{
+    cubeMap_.reset();
+    texture_.reset(new QOpenGLTexture(QOpenGLTexture::Target2D));
+    texture_->setSize(size.width(), size.height());
+    texture_->setFormat(format);
+    texture_->setMipLevels(mipLevels ? mipLevels : texture_->maximumMipLevels());
+    texture_->allocateStorage();
+    texture_->bind();
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    GLint anisotropy = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &anisotropy);
+    if(anisotropy > 0)
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, anisotropy);
+}
+
+void Canvas::uploadPendingImage()
+{
+    QElapsedTimer timer;
+    timer.start();
+    dualFisheye_ = pendingDualFisheye_;
+    setColorSpace(pendingColorSpace_);
+    if(pendingPyramid_)
+    {
+        const auto& pyramid = *pendingPyramid_;
+        int first = 0;
+        while(first + 1 < pyramid.levelCount() && !fitsInTexture(pyramid.levelSize(first)))
+            ++first;
+        const auto compression = pyramid.compressedFormat();
+        const auto format = pyramid.imageFormat();
+        const auto textureFormat = !compression ? textureFormats(format).internal :
+                                   *compression == TextureCompressor::Format::BC1 ? QOpenGLTexture::RGB_DXT1
+                                                                                  : QOpenGLTexture::RGB8_ETC2;
+        createTexture(pyramid.levelSize(first), pyramid.levelCount() - first, textureFormat);
+        if(!compression)
+            setSwizzle(*texture_, textureFormats(format));
+
+        constexpr int T = ImagePyramid::TILE_SIZE;
+        QOpenGLPixelTransferOptions options;
+        options.setAlignment(1);
+        options.setRowLength(T);
+        for(int level = first; level < pyramid.levelCount(); ++level)
+        {
+            const auto size = pyramid.levelSize(level);
+            for(int tileY = 0; tileY < pyramid.tilesY(level); ++tileY)
+            {
+                for(int tileX = 0; tileX < pyramid.tilesX(level); ++tileX)
+                {
+                    const int width = std::min(T, size.width() - tileX * T);
+                    const int height = std::min(T, size.height() - tileY * T);
+                    if(compression)
+                    {
+                        glCompressedTexSubImage2D(GL_TEXTURE_2D, level - first, tileX * T, tileY * T,
+                                                  width, height, textureFormat,
+                                                  pyramid.tileDataSize(level, tileX, tileY),
+                                                  pyramid.tile(level, tileX, tileY));
+                    }
+                    else
+                    {
+                        texture_->setData(tileX * T, tileY * T, 0, width, height, 1,
+                                          level - first, textureFormats(format).source, QOpenGLTexture::UInt8,
+                                          pyramid.tile(level, tileX, tileY), &options);
+                    }
+                }
+            }
+        }
+    }
+    else
+    {
+        auto levels = std::move(pendingLevels_);
+        // The loaders fit the image and build the whole mip chain off this
+        // thread, so only the levels larger than the real limit are skipped
+        while(levels.size() > 1 && !fitsInTexture(levels[0].size()))
+            levels.erase(levels.begin());
+        // All the levels share the format of the first one
+        const auto format = pendingHdr_ || hasTextureFormats(levels[0].format()) ? levels[0].format()
+                                                                                 : QImage::Format_RGBA8888;
+        const auto formats = pendingHdr_ ? TextureFormats{QOpenGLTexture::RGB9E5, QOpenGLTexture::RGB}
+                                         : textureFormats(format);
+        const auto pixelType = pendingHdr_ ? QOpenGLTexture::UInt32_RGB9_E5 : QOpenGLTexture::UInt8;
+        createTexture(levels[0].size(), levels.size(), formats.internal);
+        setSwizzle(*texture_, formats);
+
+        // QImage scan lines are 4-byte aligned
+        QOpenGLPixelTransferOptions options;
+        options.setAlignment(4);
+        qint64 uploadedBytes = 0, convertedBytes = 0;
+        for(unsigned level = 0; level < levels.size(); ++level)
+        {
+            const auto image = levels[level].format() == format ? levels[level]
+                                                                : levels[level].convertToFormat(format);
+            if(image.format() != levels[level].format())
+                convertedBytes += image.sizeInBytes();
+            uploadedBytes += image.sizeInBytes();
+            texture_->setData(level, formats.source, pixelType, image.constBits(), &options);
+            // The level is on the GPU now, let its memory go before converting the next one
+            levels[level] = QImage();
+        }
+        qDebug().nospace() << "Uploaded " << uploadedBytes / 1024 << " KiB of " << format
+                           << " texels, of which " << convertedBytes / 1024 << " KiB were converted";
+    }
+    pendingLevels_.clear();
+    pendingPyramid_.reset();
+    if(dualFisheye_)
+    {
+        // The two circles don't wrap into each other
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    }
+    registerShownTexture();
+    qDebug() << "Texture uploaded in" << timer.elapsed() << "ms";
+    Utils::startupEvent("Texture uploaded");
+}
+
+void Canvas::openVideo(const QString& path)
+{
+    video_ = new VideoPlayer(path, this);
+    connect(video_, &VideoPlayer::frameAvailable, this, qOverload<>(&Canvas::update));
+    connect(video_, &VideoPlayer::error, this, [this, path](const QString& message)
+    {
+        QMessageBox::critical(this, tr("Error playing video"),
+                              tr("Failed to play the video file\n\"%1\":\n%2").arg(path).arg(message));
+    });
+}
+
+void Canvas::uploadPlane(const int index, const QSize& size, const QOpenGLTexture::TextureFormat format,
+                         const QOpenGLTexture::PixelFormat sourceFormat, const uchar*const data,
+                         const int bytesPerLine, const int bytesPerPixel)
+{
+    auto& plane = videoPlanes_[index];
+    if(!plane || plane->width() != size.width() || plane->height() != size.height() || plane->format() != format)
+    {
+        plane.reset(new QOpenGLTexture(QOpenGLTexture::Target2D));
+        plane->setSize(size.width(), size.height());
+        plane->setFormat(format);
+        plane->setMipLevels(1);
+        plane->allocateStorage();
+        plane->setMinMagFilters(QOpenGLTexture::Linear, QOpenGLTexture::Linear);
+        plane->setWrapMode(QOpenGLTexture::ClampToEdge);
+    }
+    // Straight from the mapped frame, without a QImage in between
+    QOpenGLPixelTransferOptions options;
+    options.setAlignment(1);
+    options.setRowLength(bytesPerLine / bytesPerPixel);
+    plane->setData(0, 0, 0, size.width(), size.height(), 1, 0, sourceFormat, QOpenGLTexture::UInt8, data, &options);
+}
+
+void Canvas::uploadVideoFrame(QVideoFrame frame)
+{
+    QElapsedTimer timer;
+    timer.start();
+    if(!frame.map(QVideoFrame::ReadOnly))
+    {
+        qWarning() << "Failed to map a video frame";
+        return;
+    }
+    const auto size = frame.size();
+    const QSize chromaSize((size.width() + 1) / 2, (size.height() + 1) / 2);
+    VideoPlanes layout;
+    switch(frame.pixelFormat())
+    {
+    case QVideoFrameFormat::Format_RGBA8888:
+    case QVideoFrameFormat::Format_RGBX8888:
+    case QVideoFrameFormat::Format_BGRA8888:
+    case QVideoFrameFormat::Format_BGRX8888:
+        layout = frame.pixelFormat() == QVideoFrameFormat::Format_RGBA8888 ||
+                 frame.pixelFormat() == QVideoFrameFormat::Format_RGBX8888 ? VideoPlanes::RGBA : VideoPlanes::BGRA;
+        uploadPlane(0, size, QOpenGLTexture::RGBA8_UNorm, QOpenGLTexture::RGBA, frame.bits(0), frame.bytesPerLine(0), 4);
+        break;
+    case QVideoFrameFormat::Format_NV12:
+        layout = VideoPlanes::NV12;
+        uploadPlane(0, size, QOpenGLTexture::R8_UNorm, QOpenGLTexture::Red, frame.bits(0), frame.bytesPerLine(0), 1);
+        uploadPlane(1, chromaSize, QOpenGLTexture::RG8_UNorm, QOpenGLTexture::RG, frame.bits(1), frame.bytesPerLine(1), 2);
+        break;
+    case QVideoFrameFormat::Format_YUV420P:
+        layout = VideoPlanes::YUV420P;
+        uploadPlane(0, size, QOpenGLTexture::R8_UNorm, QOpenGLTexture::Red, frame.bits(0), frame.bytesPerLine(0), 1);
+        uploadPlane(1, chromaSize, QOpenGLTexture::R8_UNorm, QOpenGLTexture::Red, frame.bits(1), frame.bytesPerLine(1), 1);
+        uploadPlane(2, chromaSize, QOpenGLTexture::R8_UNorm, QOpenGLTexture::Red, frame.bits(2), frame.bytesPerLine(2), 1);
+        break;
+    default:
+    {
+        // Rare formats go through the slow conversion by Qt
+        frame.unmap();
+        const auto image = frame.toImage().convertToFormat(QImage::Format_RGBA8888);
+        layout = VideoPlanes::RGBA;
+        uploadPlane(0, image.size(), QOpenGLTexture::RGBA8_UNorm, QOpenGLTexture::RGBA,
+                    image.constBits(), image.bytesPerLine(), 4);
+        break;
+    }
+    }
+    const auto yuvToRGB = yuvToRGBMatrix(frame.surfaceFormat());
+    if(frame.isMapped())
+        frame.unmap();
+
+    // The projection shaders sample an RGB texture with mipmaps, as for images
+    const bool first = !texture_;
+    if(!texture_ || texture_->width() != size.width() || texture_->height() != size.height())
+        createTexture(size, 0, QOpenGLTexture::RGBA8_UNorm);
+    if(first)
+        setColorSpace({});
+    if(!videoConvertProgram_)
+        videoConvertProgram_ = buildProgram("#define PROJECTION -1\n#define VIDEO_CONVERT\n");
+    if(!videoFbo_)
+        glGenFramebuffers(1, &videoFbo_);
+    glBindFramebuffer(GL_FRAMEBUFFER, videoFbo_);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture_->textureId(), 0);
+    glViewport(0, 0, size.width(), size.height());
+    glBindVertexArray(vao_);
+    videoConvertProgram_->bind();
+    for(int n = 0; n < int(videoPlanes_.size()); ++n)
+    {
+        if(videoPlanes_[n])
+            videoPlanes_[n]->bind(n);
+        videoConvertProgram_->setUniformValue(("plane" + std::to_string(n)).c_str(), n);
+    }
+    videoConvertProgram_->setUniformValue("planeLayout", int(layout));
+    videoConvertProgram_->setUniformValue("yuvToRGB", yuvToRGB);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    glBindVertexArray(0);
+    glBindFramebuffer(GL_FRAMEBUFFER, defaultFramebufferObject());
+    glViewport(0, 0, viewportWidth_, viewportHeight_);
+    videoMipLevels_ = 1;
+    generateVideoMips();
+    video_->reportUploadTime(timer.nsecsElapsed() * 1e-6);
+
+    if(first)
+    {
+        // Not from inside paintGL, since the receivers may change the widgets
+        QMetaObject::invokeMethod(this, [this]{ emit newImageLoaded(QFileInfo(currentPath_).fileName()); },
+                                  Qt::QueuedConnection);
+    }
+}
+
+void Canvas::generateVideoMips()
+{
+    // These are box-filtered by the driver, unlike the mip chains of images,
+    // which are filtered in linear light and wrap around the seam, see
+    // buildMipChain(). It's the only filter fast enough for each frame, and
+    // in a moving picture its softer poles and seam go unnoticed.
+    const int levels = sampledMipLevels();
+    if(levels <= videoMipLevels_) return;
+    texture_->bind();
+    // Sampling is clamped to the levels made, and the driver makes only those
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+    if(levels > 1)
+        texture_->generateMipMaps();
+    videoMipLevels_ = levels;
+}
+
+int Canvas::sampledMipLevels() const
+{
+    const int allLevels = texture_->mipLevels();
+    // The estimate below is for the plain rectilinear view of an equirectangular image
+    if(projection_ != Projection::Equirect && projection_ != Projection::CubeMap)
+        return allLevels;
+    if(dualFisheye_)
+        return allLevels;
+
+    // The view comes closest to a pole at a corner
+    const double camDistToScreen = 1 / std::tan(horizViewAngle_ / 2);
+    const double halfDiagonalAngle = std::atan(std::hypot(1., double(viewportHeight_) / viewportWidth_) /
+                                               camDistToScreen);
+    const Eigen::Vector3d centerDir = cameraRotation() * Eigen::Vector3d(-1, 0, 0);
+    const double maxLatitude = std::abs(std::asin(std::clamp(centerDir.z(), -1., 1.))) + halfDiagonalAngle;
+    // Around a pole, the shader averages up to the whole row
+    if(maxLatitude >= 89 * DEGREE)
+        return allLevels;
+    // The pixels at the center of the view span the largest angle, and moving
+    // views are rendered at a fraction of the resolution. Along a parallel,
+    // texels span less angle by the cosine of the latitude.
+    const double anglePerPixel = 2 / (viewportWidth_ * camDistToScreen * MIN_RENDER_SCALE);
+    const double texelsPerPixel = texture_->width() * anglePerPixel / (2 * M_PI * std::cos(maxLatitude));
+    // The level of detail is rounded up for trilinear filtering, and one
+    // more level covers the sensor turning the view before the frame is drawn
+    const int levels = std::ceil(std::log2(std::max(1., texelsPerPixel))) + 2;
+    return std::clamp(levels, 1, allLevels);
+}
+
+void Canvas::closeImage()
+{
+    stashCurrentImage();
+}
+
+double Canvas::updateRenderScale(const Eigen::Matrix3d& cameraRotation)
+{
+    const double time = replayTime_ >= 0 ? replayTime_ : renderClock_.nsecsElapsed() * 1e-6;
+    const double frameTime = time - prevFrameTime_;
+    prevFrameTime_ = time;
+
+    // Sensor noise shouldn't count as motion, so we ignore changes smaller
+    // than half a pixel
+    const double anglePerPixel = horizViewAngle_ / viewportWidth_;
+    const double rotationAngle = Eigen::AngleAxisd(cameraRotation * prevCameraRotation_.transpose()).angle();
+    const bool moving = rotationAngle > anglePerPixel / 2 ||
+                        std::abs(horizViewAngle_ - prevViewAngle_) > anglePerPixel / 2 ||
+                        dragMode_ != DragMode::None;
+    prevCameraRotation_ = cameraRotation;
+    prevViewAngle_ = horizViewAngle_;
+    if(moving)
+        lastMotionTime_ = time;
+
+    if(time - lastMotionTime_ > SETTLE_TIME)
+    {
+        prevFrameMoving_ = false;
+        return 1;
+    }
+    // Only the frames rendered at the moving scale tell us how good it is.
+    // Frame time is proportional to the pixel count, i.e. to the square of
+    // the scale. Frames never come faster than the refresh rate, so we can
+    // only find out whether there's room for a higher scale by trying it.
+    if(prevFrameMoving_ && frameTime < 10 * TARGET_FRAME_TIME)
+    {
+        if(frameTime > 1.2 * TARGET_FRAME_TIME)
+            movingRenderScale_ *= std::sqrt(TARGET_FRAME_TIME / frameTime);
+        else if(frameTime < 1.1 * TARGET_FRAME_TIME)
+            movingRenderScale_ *= 1.02;
+        movingRenderScale_ = std::clamp(movingRenderScale_, MIN_RENDER_SCALE, 1.);
+    }
+    prevFrameMoving_ = true;
+    return movingRenderScale_;
+}
+
+void Canvas::setColorSpace(const QColorSpace& colorSpace)
+{
+    colorSpace_ = colorSpace;
+    const auto display = ColorManagement::displayColorSpace();
+    colorLutKey_ = ColorManagement::needsConversion(colorSpace, display)
+                        ? ColorManagement::lutKey(colorSpace, display) : QByteArray();
+}
+
+QOpenGLTexture* Canvas::colorLut()
+{
+    if(colorLutKey_.isEmpty())
+        return nullptr;
+    const auto it = colorLuts_.find(colorLutKey_);
+    if(it != colorLuts_.end())
+        return it->second.get(); // null while it's being baked
+
+    // Until the LUT is ready, the image is shown unconverted
+    colorLuts_[colorLutKey_] = nullptr;
+    const QPointer<Canvas> canvas(this);
+    QThreadPool::globalInstance()->start([canvas, key = colorLutKey_, source = colorSpace_]
+    {
+        const auto lut = ColorManagement::lut(source, ColorManagement::displayColorSpace());
+        QMetaObject::invokeMethod(qApp, [canvas, key, lut]
+        {
+            if(!canvas) return;
+            constexpr int N = ColorManagement::LUT_SIZE;
+            canvas->makeCurrent();
+            auto& texture = canvas->colorLuts_[key];
+            texture.reset(new QOpenGLTexture(QOpenGLTexture::Target3D));
+            texture->setSize(N, N, N);
+            texture->setFormat(QOpenGLTexture::RGBA16F);
+            texture->setMipLevels(1);
+            texture->allocateStorage();
+            texture->setData(QOpenGLTexture::RGBA, QOpenGLTexture::Float16, lut.data());
+            texture->setMinMagFilters(QOpenGLTexture::Linear, QOpenGLTexture::Linear);
+            texture->setWrapMode(QOpenGLTexture::ClampToEdge);
+            canvas->doneCurrent();
+            canvas->update();
+        }, Qt::QueuedConnection);
+    });
+    return nullptr;
+}
+
+void Canvas::makeCubeMap()
+{
+    QElapsedTimer timer;
+    timer.start();
+    const auto cubeFaceProgram = this->cubeFaceProgram(dualFisheye_);
+
+    // A face covers 90° of the equator, which is a quarter of the texture width
+    GLint maxCubeSize = 0;
+    glGetIntegerv(GL_MAX_CUBE_MAP_TEXTURE_SIZE, &maxCubeSize);
+    const int size = std::clamp(texture_->width() / 4, 1, std::min(maxCubeSize, MAX_CUBE_FACE_SIZE));
+    cubeMap_.reset(new QOpenGLTexture(QOpenGLTexture::TargetCubeMap));
+    cubeMap_->setSize(size, size);
+    // HDR values are kept for tone mapping at display time
+    cubeMap_->setFormat(texture_->format() == QOpenGLTexture::RGB9E5 ? QOpenGLTexture::RGBA16F
+                                                                     : QOpenGLTexture::RGBA8_UNorm);
+    cubeMap_->setMipLevels(cubeMap_->maximumMipLevels());
+    cubeMap_->allocateStorage();
+    cubeMap_->setMinMagFilters(QOpenGLTexture::LinearMipMapLinear, QOpenGLTexture::Linear);
+    cubeMap_->setWrapMode(QOpenGLTexture::ClampToEdge);
+
+    GLuint fbo = 0;
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glViewport(0, 0, size, size);
+    glBindVertexArray(vao_);
+    cubeFaceProgram->bind();
+    texture_->bind(0);
+    cubeFaceProgram->setUniformValue("tex", 0);
+    setSourceUniforms(*cubeFaceProgram);
+    for(int face = 0; face < 6; ++face)
+    {
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X + face,
+                               cubeMap_->textureId(), 0);
+        cubeFaceProgram->setUniformValue("faceMatrix", toQMatrix(cubeFaceMatrix(face)));
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindVertexArray(0);
+    glBindFramebuffer(GL_FRAMEBUFFER, defaultFramebufferObject());
+    glDeleteFramebuffers(1, &fbo);
+    glViewport(0, 0, viewportWidth_, viewportHeight_);
+    cubeMap_->generateMipMaps();
+    registerShownTexture();
+    qDebug() << "Cube map of" << size << "×" << size << "faces made in" << timer.elapsed() << "ms";
+}
+
+Canvas::Projection Canvas::renderedProjection(const Projection projection) const
+{
+    // A cube map would have to be rebuilt for each video frame, while the
+    // rectilinear projection samples the frame directly at the same quality
+    if(projection == Projection::CubeMap && video_)
+        return Projection::Equirect;
+    // Without float render targets, an HDR cube map would clip the highlights
+    const bool hdr = texture_->format() == QOpenGLTexture::RGB9E5;
+    return projection == Projection::CubeMap && hdr && !floatRenderTargets_ ? Projection::Equirect : projection;
+}
+
+void Canvas::drawView(const Projection projection, const Eigen::Matrix3d& rotation,
+                      const float aspectRatio, const QVector4D& tile)
+{
+    const bool stereo = projection == Projection::VRStereo;
+    if(stereo)
+        setupStereoMesh(aspectRatio / 2);
+    glBindVertexArray(stereo ? stereoVao_ : vao_);
+
+    const auto program = this->program(projection, dualFisheye_);
+    program->bind();
+    if(projection == Projection::CubeMap)
+    {
+        cubeMap_->bind(0);
+        program->setUniformValue("cubeTex", 0);
+    }
+    else
+    {
+        texture_->bind(0);
+        program->setUniformValue("tex", 0);
+        setSourceUniforms(*program);
+    }
+    program->setUniformValue("horizViewAngle", float(horizViewAngle_));
+    program->setUniformValue("viewportAspectRatio", aspectRatio);
+    program->setUniformValue("viewportTile", tile);
+    program->setUniformValue("cameraRotation", toQMatrix(rotation));
+    program->setUniformValue("hdr", int(texture_->format() == QOpenGLTexture::RGB9E5));
+    program->setUniformValue("exposure", float(std::exp2(exposure_)));
+    const auto lut = colorLut();
+    if(lut)
+        lut->bind(1);
+    program->setUniformValue("colorManaged", int(lut != nullptr));
+    program->setUniformValue("colorLut", 1);
+    // Both eyes in a single draw call
+    if(stereo)
+        glDrawElementsInstanced(GL_TRIANGLES, stereoIndexCount_, GL_UNSIGNED_SHORT, nullptr, 2);
+    else
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    if(lut)
+        lut->release(1);
+    glBindTexture(projection == Projection::CubeMap ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D, 0);
+
+    glBindVertexArray(0);
+}
+
+bool Canvas::exportView(const QString& path, const QSize& size, QString& errorString,
+                        const std::function<bool(int done, int total)>& progress)
+{
+    if(!texture_)
+    {
+        errorString = tr("No image is shown");
+        return false;
+    }
+    auto encoder = ImageEncoder::create(path, size, errorString);
+    if(!encoder)
+        return false;
+
+    QElapsedTimer timer;
+    timer.start();
+    // Side by side halves would make no sense in a still
+    const auto projection = renderedProjection(projection_ == Projection::VRStereo ? Projection::Equirect
+                                                                                   : projection_);
+    const auto rotation = cameraRotation();
+    const auto tileSize = encoder->tileSize();
+    const int tilesX = (size.width() + tileSize.width() - 1) / tileSize.width();
+    const int tilesY = (size.height() + tileSize.height() - 1) / tileSize.height();
+    makeCurrent();
+    if(projection == Projection::CubeMap && !cubeMap_)
+        makeCubeMap();
+    QOpenGLFramebufferObject fbo(tileSize);
+    bool ok = true;
+    for(int tileY = 0; tileY < tilesY && ok; ++tileY)
+    {
+        for(int tileX = 0; tileX < tilesX && ok; ++tileX)
+        {
+            const auto rect = QRect(QPoint(tileX * tileSize.width(), tileY * tileSize.height()), tileSize)
+                                .intersected(QRect(QPoint(0,0), size));
+            // The tile is a sub-frustum of the view: the part of the whole
+            // viewport's [-1,1]² it covers, with y going up
+            const float scaleX = float(rect.width()) / size.width();
+            const float scaleY = float(rect.height()) / size.height();
+            const QVector4D tile(scaleX, scaleY,
+                                 float(2 * rect.x() + rect.width()) / size.width() - 1,
+                                 1 - float(2 * rect.y() + rect.height()) / size.height());
+            // Events processed by the progress callback may have repainted the widget
+            makeCurrent();
+            fbo.bind();
+            glViewport(0, 0, rect.width(), rect.height());
+            drawView(projection, rotation, float(size.width()) / size.height(), tile);
+            QImage pixels(rect.size(), QImage::Format_RGBA8888);
+            glPixelStorei(GL_PACK_ALIGNMENT, 4);
+            glReadPixels(0, 0, rect.width(), rect.height(), GL_RGBA, GL_UNSIGNED_BYTE, pixels.bits());
+            fbo.release();
+            glViewport(0, 0, viewportWidth_, viewportHeight_);
+
+            // GL rows go from the bottom up
+            if(!encoder->writeTile(rect.topLeft(), std::move(pixels).mirrored()))
+            {
+                errorString = encoder->errorString();
+                ok = false;
+            }
+            else if(progress && !progress(tileY * tilesX + tileX + 1, tilesX * tilesY))
+            {
+                errorString = tr("Export canceled");
+                ok = false;
+            }
+        }
+    }
+    makeCurrent();
+    fbo.release();
+    doneCurrent();
+
+    if(ok && !encoder->finish())
+    {
+        errorString = encoder->errorString();
+        ok = false;
+    }
+    encoder.reset();
+    if(!ok)
+    {
+        QFile::remove(path);
+        return false;
+    }
+    qDebug().nospace() << "Exported a view of " << size.width() << "×" << size.height() << " in "
+                       << tilesX * tilesY << " tiles in " << timer.elapsed() << " ms";
+    return true;
+}
+
+void Canvas::paintGL()
+{
+    QElapsedTimer timer;
+    timer.start();
+    if(gpuTimeQuery_)
+        glBeginQuery(GL_TIME_ELAPSED, gpuTimeQuery_);
+    renderFrame();
+    if(gpuTimeQuery_)
+        glEndQuery(GL_TIME_ELAPSED);
+    gpuTimeQueried_ = gpuTimeQuery_ != 0;
+    lastCpuFrameTime_ = timer.nsecsElapsed() * 1e-6;
+}
+
+void Canvas::renderFrame()
 {
     if(!isVisible())
         return;
@@ -352,69 +1875,79 @@ void Canvas::paintGL()
 #endif
     glClear(GL_COLOR_BUFFER_BIT);
 
-    if(!texture_ && image_.isNull())
-        return;
-
-    if(!image_.isNull())
+    // We have a new image, upload it to the GL, unless another canvas has
+    // already done it
+    if(!pendingLevels_.empty() || pendingPyramid_)
     {
-        if(image_.width() > maxTexSize_ || image_.height() > maxTexSize_)
+        if(adoptShownTexture(currentPath_))
         {
-            qWarning() << "Image resolution of" << image_.width() << "×" << image_.height()
-                << "exceeds GL_MAX_TEXTURE_SIZE =" << maxTexSize_;
-            image_ = image_.scaled(std::min(image_.width(), maxTexSize_),
-                                   std::min(image_.height(), maxTexSize_),
-                                  Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
-            qDebug() << "Image resized to" << image_.width() << "×" << image_.height();
+            pendingLevels_.clear();
+            pendingPyramid_.reset();
         }
-        // We have a new image, upload it to the GL
-        texture_.reset(new QOpenGLTexture(image_));
-        texture_->bind();
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        GLint anisotropy = 0;
-        glGetIntegerv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &anisotropy);
-        if(anisotropy > 0)
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, anisotropy);
-        image_ = {};
-    }
-
-    if(const auto rot = sensor_->reading(); rot && sensor_->hasZ())
-    {
-        using namespace Eigen;
-        Matrix3d sensorRotation;
-        sensorRotation =
-            // Compensate for the default 0,0,0 orientation,
-            // which represents the phone lying on a table.
-            AngleAxisd(M_PI/2, -Vector3d::UnitY()) *
-            // Apply the sensed rotation
-            AngleAxisd(rot->z() * DEGREE, Vector3d::UnitX()) *
-            AngleAxisd(rot->x() * DEGREE, Vector3d::UnitY()) *
-            AngleAxisd(rot->y() * DEGREE, Vector3d::UnitZ());
-        const Vector3d rpy = sensorRotation.eulerAngles(2,1,0).reverse();
-        deltaRoll_ = rpy[0];
-        deltaPitch_ = -rpy[1];
-        deltaYaw_ = rpy[2];
-        if(std::abs(deltaPitch_) > M_PI/2)
+        else
         {
-            // Invert the whole set of angles
-            deltaRoll_  = normalizedAngle(deltaRoll_ - M_PI);
-            deltaPitch_ = normalizedAngle(M_PI - deltaPitch_);
-            deltaYaw_   = normalizedAngle(deltaYaw_ - M_PI);
+            uploadPendingImage();
         }
     }
+    if(video_)
+    {
+        if(auto frame = video_->takeDueFrame())
+            uploadVideoFrame(std::move(*frame));
+        // A paused frame needs coarser levels once zoomed out or turned to a pole
+        else if(texture_)
+            generateVideoMips();
+    }
+    updateMemoryUsage();
 
-    glBindVertexArray(vao_);
+    if(!texture_)
+        return;
 
-    program_.bind();
-    texture_->bind(0);
-    program_.setUniformValue("tex", 0);
-    program_.setUniformValue("horizViewAngle", float(horizViewAngle_));
-    program_.setUniformValue("viewportAspectRatio", float(viewportWidth_) / viewportHeight_);
-    program_.setUniformValue("cameraRotation", toQMatrix(cameraRotation()));
-    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-    glBindTexture(GL_TEXTURE_2D, 0);
+    if(!orientationTracker_)
+    {
+        // Frames that are grabbed rather than swapped would queue it again
+        if(!sensorStartQueued_)
+        {
+            sensorStartQueued_ = true;
+            connect(this, &QOpenGLWidget::frameSwapped, this, [this]
+            {
+                Utils::startupFinished("First panorama frame swapped");
+                // A replay may have started it meanwhile
+                if(!orientationTracker_)
+                    startSensor();
+            }, Qt::SingleShotConnection);
+        }
+    }
+    else if(orientationTracker_->isActive())
+    {
+        sensorOrientation_ = orientationTracker_->beginFrame();
+    }
 
-    glBindVertexArray(0);
+    const auto projection = renderedProjection(projection_);
+    if(projection == Projection::CubeMap && !cubeMap_)
+        makeCubeMap();
+
+    const auto rotation = cameraRotation();
+    const double renderScale = updateRenderScale(rotation);
+    const QSize renderSize(std::max(1, int(std::lround(viewportWidth_ * renderScale))),
+                           std::max(1, int(std::lround(viewportHeight_ * renderScale))));
+    const bool lowRes = renderSize != QSize(viewportWidth_, viewportHeight_);
+    if(lowRes)
+    {
+        if(!lowResFbo_ || lowResFbo_->size() != renderSize)
+            lowResFbo_.reset(new QOpenGLFramebufferObject(renderSize));
+        lowResFbo_->bind();
+        glViewport(0, 0, renderSize.width(), renderSize.height());
+    }
+
+    drawView(projection, rotation, float(viewportWidth_) / viewportHeight_, QVector4D(1, 1, 0, 0));
+
+    if(lowRes)
+    {
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, defaultFramebufferObject());
+        glBlitFramebuffer(0, 0, renderSize.width(), renderSize.height(),
+                          0, 0, viewportWidth_, viewportHeight_,
+                          GL_COLOR_BUFFER_BIT, GL_LINEAR);
+        glBindFramebuffer(GL_FRAMEBUFFER, defaultFramebufferObject());
+        glViewport(0, 0, viewportWidth_, viewportHeight_);
+    }
 }
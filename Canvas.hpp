@@ -1,21 +1,51 @@
 #pragma once
 
 #include <cmath>
+#include <array>
+#include <atomic>
 #include <memory>
+#include <vector>
+#include <optional>
+#include <functional>
+#include <unordered_map>
 #include <QTimer>
 #include <QImage>
+#include <QVector4D>
+#include <QColorSpace>
+#include <QElapsedTimer>
 #include <QOpenGLWidget>
 #include <QOpenGLTexture>
+#include <QOpenGLFramebufferObject>
 #include <QOpenGLShaderProgram>
 #include <QOpenGLExtraFunctions>
 #include <Eigen/Dense>
+#include "LruCache.hpp"
+#include "VrLens.hpp"
+#include "MemoryBudget.hpp"
+#include "DualFisheye.hpp"
+#include "TextureCompressor.hpp"
 
+class QVideoFrame;
 class ToolsWidget;
-class QRotationSensor;
+class VideoPlayer;
+class ImagePyramid;
+class OrientationTracker;
 class Canvas : public QOpenGLWidget, public QOpenGLExtraFunctions
 {
     Q_OBJECT
 
+public:
+    enum class Projection
+    {
+        Equirect,     // Rectilinear view, sampling the equirectangular texture
+        CubeMap,      // Rectilinear view, sampling a cube map made from the texture
+        LittlePlanet, // Stereographic
+        Fisheye,      // Equidistant
+        VRStereo,     // Rectilinear, side by side for a headset
+    };
+    static constexpr int PROJECTION_COUNT = 5;
+
+private:
     enum class DragMode
     {
         None,
@@ -25,35 +55,209 @@ class Canvas : public QOpenGLWidget, public QOpenGLExtraFunctions
     static constexpr double inline DEGREE = M_PI / 180;
     double horizViewAngle_ = 60 * DEGREE;
     double pitch_ = 0, yaw_ = 0;
-    double deltaPitch_ = 0, deltaYaw_ = 0, deltaRoll_ = 0;
+    Eigen::Quaterniond sensorOrientation_ = Eigen::Quaterniond::Identity();
 
     GLuint vao_=0;
     GLuint vbo_=0;
-    QOpenGLShaderProgram program_;
-    std::unique_ptr<QOpenGLTexture> texture_;
-    QImage image_;
+    // Lens distortion mesh for Projection::VRStereo, built for the aspect
+    // ratio of an eye's viewport
+    GLuint stereoVao_ = 0, stereoVbo_ = 0, stereoIbo_ = 0;
+    GLsizei stereoIndexCount_ = 0;
+    double stereoMeshAspectRatio_ = 0;
+    VrLens::Parameters vrLens_ = VrLens::parameters();
+    Projection projection_ = Projection::Equirect;
+    // Indexed by whether the source is dual fisheye
+    std::array<std::array<std::unique_ptr<QOpenGLShaderProgram>, PROJECTION_COUNT>, 2> programs_;
+    std::array<std::unique_ptr<QOpenGLShaderProgram>, 2> cubeFacePrograms_;
+    // Shared with the other canvases that show the same file
+    std::shared_ptr<QOpenGLTexture> texture_;
+    // Whether texture_ holds a dual-fisheye frame rather than an equirectangular image
+    bool dualFisheye_ = false;
+    DualFisheye::Calibration fisheyeCalibration_;
+    // Made from texture_ when first needed by Projection::CubeMap
+    std::shared_ptr<QOpenGLTexture> cubeMap_;
+    // Image data waiting to be uploaded to the texture: either a mip chain
+    // (possibly consisting of the base level only), or a pyramid mapped
+    // from the cache
+    std::vector<QImage> pendingLevels_;
+    std::shared_ptr<const ImagePyramid> pendingPyramid_;
+    bool pendingDualFisheye_ = false;
+    // Whether pendingLevels_ hold RGB9E5 texels, see Hdr::decodeLevels()
+    bool pendingHdr_ = false;
+    // Of the pending image and of texture_. Invalid means sRGB.
+    QColorSpace pendingColorSpace_;
+    QColorSpace colorSpace_;
+    // Empty if colorSpace_ needs no conversion for the display
+    QByteArray colorLutKey_;
+    // Baked LUTs by ColorManagement::lutKey(), null while being baked
+    std::unordered_map<QByteArray, std::unique_ptr<QOpenGLTexture>> colorLuts_;
+    // In EV, applied to HDR images, whose textures are RGB9E5
+    double exposure_ = 0;
+    // The file being shown or loaded, empty for images set by setImage()
+    QString currentPath_;
+
+    struct LoadedImage
+    {
+        std::vector<QImage> levels;
+        std::shared_ptr<const ImagePyramid> pyramid;
+        QString error;
+        bool dualFisheye = false;
+        bool hdr = false;
+        QColorSpace colorSpace;
+    };
+    struct CachedTexture
+    {
+        std::shared_ptr<QOpenGLTexture> texture;
+        bool dualFisheye;
+        QColorSpace colorSpace;
+    };
+    struct ShownTexture
+    {
+        std::weak_ptr<QOpenGLTexture> texture;
+        std::weak_ptr<QOpenGLTexture> cubeMap;
+        bool dualFisheye;
+        QColorSpace colorSpace;
+    };
+    // What all the canvases share, so that N views of M files cost M decodes
+    // and M textures. The GL contexts of the canvases are shared for this,
+    // see shareGLContexts().
+    struct Shared
+    {
+        // Recently shown images stay in GPU memory, prefetched ones wait in RAM
+        LruCache<CachedTexture> textureCache;
+        LruCache<LoadedImage> imageCache;
+        // By path. Prefetches have a flag, which is set when the load starts
+        // or when openFile() takes it over, whichever happens first.
+        std::unordered_map<QString, std::shared_ptr<std::atomic_bool>> loadsInProgress;
+        // Textures of the files being shown, by path
+        std::unordered_map<QString, ShownTexture> shownTextures;
+        std::vector<Canvas*> canvases;
+    };
+    static Shared& shared();
+    LruCache<CachedTexture>& textureCache_;
+    LruCache<LoadedImage>& imageCache_;
+    std::unordered_map<QString, std::shared_ptr<std::atomic_bool>>& loadsInProgress_;
+    std::unordered_map<QString, ShownTexture>& shownTextures_;
+    // The current image, as pending levels and as this canvas' share of the textures
+    MemoryBudget::Allocation pendingMemory_;
+    MemoryBudget::Allocation textureMemory_;
     int viewportWidth_ = 0, viewportHeight_ = 0;
     int maxTexSize_ = 0;
-    QRotationSensor* sensor_ = nullptr;
+    // Compressed format to keep opaque panoramas in, if the GPU supports one
+    std::optional<TextureCompressor::Format> textureCompression_;
+    bool floatRenderTargets_ = false;
+    OrientationTracker* orientationTracker_ = nullptr;
+    // Whether the sensor will be started once the first panorama frame is swapped
+    bool sensorStartQueued_ = false;
     QTimer frameTimer_;
 
+    // Video playback: each frame is uploaded into the planes and converted
+    // into texture_, which is then shown as an image
+    enum class VideoPlanes
+    {
+        RGBA,
+        BGRA,
+        NV12,    // Y, interleaved CbCr
+        YUV420P, // Y, Cb, Cr
+    };
+    VideoPlayer* video_ = nullptr;
+    std::array<std::unique_ptr<QOpenGLTexture>, 3> videoPlanes_;
+    std::unique_ptr<QOpenGLShaderProgram> videoConvertProgram_;
+    GLuint videoFbo_ = 0;
+    // Mip levels of texture_ made from the current frame, see generateVideoMips()
+    int videoMipLevels_ = 0;
+
+    // Dynamic resolution: while the view moves, it's rendered into lowResFbo_
+    // at a fraction of the native resolution, chosen from the measured frame
+    // times, and then upscaled. When the view settles, it's rendered natively.
+    std::unique_ptr<QOpenGLFramebufferObject> lowResFbo_;
+    double movingRenderScale_ = 1;
+    bool prevFrameMoving_ = false;
+    Eigen::Matrix3d prevCameraRotation_ = Eigen::Matrix3d::Identity();
+    double prevViewAngle_ = 0;
+    QElapsedTimer renderClock_;
+    double prevFrameTime_ = -1; // ms
+    double lastMotionTime_ = -1; // ms
+    double replayTime_ = -1; // ms, see setReplayTime()
+
+    // Timer query measuring paintGL on the GPU, 0 unless enabled
+    GLuint gpuTimeQuery_ = 0;
+    bool gpuTimeQueried_ = false;
+    double lastCpuFrameTime_ = -1; // ms
+
 public:
+    struct Camera
+    {
+        double yaw;
+        double pitch;
+        double horizViewAngle;
+    };
+    struct FrameTiming
+    {
+        // In ms, -1 if unknown
+        double cpu;
+        double gpu;
+    };
+
     Canvas(QWidget* parent=nullptr);
     ~Canvas();
+    // Makes all the GL contexts share their objects, so that the canvases
+    // can share textures. Must be called before QApplication is created.
+    static void shareGLContexts();
     void setImage(const QImage& image);
+    // Starts loading the file in the background. Returns false, after telling
+    // the user, if the file doesn't exist or can't be read. Other errors are
+    // reported when the load finishes, success is signaled by newImageLoaded().
     bool openFile(const QString& path);
+    // Starts loading the files in the background, so that opening them later is instant
+    void prefetch(const QStringList& paths);
+    // Whether openFile() would show the file without waiting for decoding
+    bool isCached(const QString& path) const;
+    QString currentFile() const { return currentPath_; }
+    void setProjection(Projection projection);
+    Projection projection() const { return projection_; }
+    // Renders the current view at the given size into the file, tile by tile
+    // through an FBO, and streams the tiles to the encoder. The progress
+    // callback is called after each tile and can cancel the export by
+    // returning false.
+    bool exportView(const QString& path, const QSize& size, QString& errorString,
+                    const std::function<bool(int done, int total)>& progress = {});
+    // Exposure of HDR images relative to the values in the file, in EV
+    void setExposure(double exposure);
+    double exposure() const { return exposure_; }
     int maxTexSize() const { return maxTexSize_; }
     void closeImage();
-    bool fileOpened() const { return texture_ || !image_.isNull(); }
+    Camera camera() const { return {yaw_, pitch_, horizViewAngle_}; }
+    // Doesn't emit cameraChanged()
+    void setCamera(const Camera& camera);
+    bool fileOpened() const { return texture_ || !pendingLevels_.empty() || pendingPyramid_ || video_; }
+
+    // For replaying traces: frames are rendered as if at the given time, in
+    // ms, rather than now, and sensor readings come from replaySensorReading()
+    // rather than the sensor
+    void setReplayTime(double time);
+    void replaySensorReading(qint64 timestamp, double x, double y, double z);
+    // Returns false if the GPU can't measure time
+    bool setGpuTimingEnabled(bool enabled);
+    // Of the last frame, waiting for the GPU to finish it if needed
+    FrameTiming lastFrameTiming();
 
 signals:
     void newImageLoaded(const QString& fileName);
     void newFileRequested();
+    // The user wants to go to the next (step=1) or previous (step=-1) file
+    void adjacentFileRequested(int step);
+    void projectionChanged(Projection projection);
+    // The user has turned or zoomed the view
+    void cameraChanged();
+    // Forwarded from OrientationTracker::readingReceived()
+    void sensorReadingReceived(qint64 timestamp, double x, double y, double z);
 
 protected:
     void dropEvent(QDropEvent* event) override;
     void dragEnterEvent(QDragEnterEvent* event) override;
     void wheelEvent(QWheelEvent* event) override;
+    void keyPressEvent(QKeyEvent* event) override;
     void mouseMoveEvent(QMouseEvent* event) override;
     void mousePressEvent(QMouseEvent* event) override;
     void mouseReleaseEvent(QMouseEvent* event) override;
@@ -62,7 +266,55 @@ protected:
 private:
     void getViewportSize(); // This function helps avoid messing with HiDPI scaling
     void setupBuffers();
+    void setupStereoMesh(double eyeAspectRatio);
     void setupShaders();
+    void startSensor();
+    void renderFrame();
+    std::unique_ptr<QOpenGLShaderProgram> buildProgram(const QByteArray& defines);
+    QOpenGLShaderProgram* program(Projection projection, bool dualFisheye);
+    QOpenGLShaderProgram* cubeFaceProgram(bool dualFisheye);
+    // Sets the uniforms describing the layout of texture_
+    void setSourceUniforms(QOpenGLShaderProgram& program);
+    void makeCubeMap();
+    // The projection to render when projection is chosen, given what the GPU can do
+    Projection renderedProjection(Projection projection) const;
+    // Renders the view with texture_ into the current viewport, which is the
+    // tile part of the whole view, see viewportTile in the fragment shader
+    void drawView(Projection projection, const Eigen::Matrix3d& rotation, float aspectRatio, const QVector4D& tile);
+    void setColorSpace(const QColorSpace& colorSpace);
+    // The LUT converting colorSpace_ for the display, null if no conversion
+    // is needed or the LUT is still being baked
+    QOpenGLTexture* colorLut();
+    // The largest width and height of the images to load, so that they fit in a texture
+    int maxLoadedSize() const;
+    bool fitsInTexture(const QSize& size) const { return size.width() <= maxTexSize_ && size.height() <= maxTexSize_; }
+    void createTexture(const QSize& size, int mipLevels, QOpenGLTexture::TextureFormat format);
+    // Returns the scale of the resolution to render the current frame at
+    double updateRenderScale(const Eigen::Matrix3d& cameraRotation);
+    void uploadPendingImage();
+    void openVideo(const QString& path);
+    void uploadVideoFrame(QVideoFrame frame);
+    // Makes the mip levels of the video frame that the view samples, if
+    // they haven't been made yet
+    void generateVideoMips();
+    // How many levels of texture_, from the finest, the current view samples
+    int sampledMipLevels() const;
+    void uploadPlane(int index, const QSize& size, QOpenGLTexture::TextureFormat format,
+                     QOpenGLTexture::PixelFormat sourceFormat, const uchar* data,
+                     int bytesPerLine, int bytesPerPixel);
+    void startLoading(const QString& path, int priority);
+    // Hands the image to the canvases waiting for it, or caches it
+    static void handleLoadResult(const QString& path, const LoadedImage& image);
+    void handleLoadedImage(const QString& path, const LoadedImage& image);
+    // Moves the current image, uploaded or not, to the caches
+    void stashCurrentImage();
+    // Shows the texture of the file if another canvas shows it already
+    bool adoptShownTexture(const QString& path);
+    // Lets the other canvases adopt texture_
+    void registerShownTexture();
+    // Registers what the current image takes with MemoryBudget
+    void updateMemoryUsage();
+    void handleMemoryPressure(MemoryBudget::Pressure pressure);
     void setDragMode(DragMode mode, int x=0, int y=0) { dragMode_=mode; prevMouseX_=x; prevMouseY_=y; }
     Eigen::Matrix3d cameraRotation() const;
     Eigen::Vector3d calcViewDir(double screenX, double screenY) const;
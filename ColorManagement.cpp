@@ -0,0 +1,148 @@
+#include "ColorManagement.hpp"
+#include <QDir>
+#include <QFile>
+#include <QDebug>
+#include <QRgba64>
+#include <QSaveFile>
+#include <QFileInfo>
+#include <QElapsedTimer>
+#include <QColorTransform>
+#include <QStandardPaths>
+#include <QCryptographicHash>
+#include <exiv2/exiv2.hpp>
+
+namespace
+{
+
+constexpr char MAGIC[8] = {'4','p','i','C','L','U','T','1'};
+constexpr std::size_t LUT_ENTRIES = std::size_t(ColorManagement::LUT_SIZE) *
+                                    ColorManagement::LUT_SIZE * ColorManagement::LUT_SIZE * 4;
+
+QString cacheFilePath(const QByteArray& key)
+{
+    return QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/color-luts/" +
+           QString::fromLatin1(key.toHex()) + ".lut";
+}
+
+QColorSpace effective(const QColorSpace& space)
+{
+    return space.isValid() ? space : QColorSpace(QColorSpace::SRgb);
+}
+
+std::vector<qfloat16> bake(const QColorSpace& source, const QColorSpace& display)
+{
+    constexpr int N = ColorManagement::LUT_SIZE;
+    const auto transform = source.transformationToColorSpace(display);
+    std::vector<qfloat16> lut(LUT_ENTRIES);
+    auto out = lut.data();
+    const auto gridValue = [](const int n) { return quint16(n * 65535 / (N - 1)); };
+    for(int b = 0; b < N; ++b)
+    {
+        for(int g = 0; g < N; ++g)
+        {
+            for(int r = 0; r < N; ++r)
+            {
+                const auto color = transform.map(QRgba64::fromRgba64(gridValue(r), gridValue(g), gridValue(b), 65535));
+                *out++ = qfloat16(color.red() / 65535.f);
+                *out++ = qfloat16(color.green() / 65535.f);
+                *out++ = qfloat16(color.blue() / 65535.f);
+                *out++ = qfloat16(1.f);
+            }
+        }
+    }
+    return lut;
+}
+
+}
+
+namespace ColorManagement
+{
+
+QColorSpace embeddedColorSpace(const QString& path)
+{
+    try
+    {
+        const auto image = Exiv2::ImageFactory::open(path.toStdString());
+        if(!image.get())
+            return {};
+        image->readMetadata();
+        if(!image->iccProfileDefined())
+            return {};
+        const auto& profile = image->iccProfile();
+        const auto space = QColorSpace::fromIccProfile(QByteArray(reinterpret_cast<const char*>(profile.c_data()),
+                                                                  profile.size()));
+        if(!space.isValid())
+            qWarning() << "Unsupported ICC profile in" << path;
+        return space;
+    }
+    catch(const Exiv2::Error& ex)
+    {
+        qDebug() << "Failed to read the ICC profile of" << path << ":" << ex.what();
+        return {};
+    }
+}
+
+QColorSpace displayColorSpace()
+{
+    static const QColorSpace space = []
+    {
+        QFile file(QStandardPaths::writableLocation(QStandardPaths::AppConfigLocation) + "/display.icc");
+        if(!file.open(QFile::ReadOnly))
+            return QColorSpace(QColorSpace::SRgb);
+        const auto space = QColorSpace::fromIccProfile(file.readAll());
+        if(!space.isValid())
+        {
+            qWarning() << "Unsupported display profile" << file.fileName() << ", assuming sRGB";
+            return QColorSpace(QColorSpace::SRgb);
+        }
+        qDebug() << "Display profile:" << space.description();
+        return space;
+    }();
+    return space;
+}
+
+bool needsConversion(const QColorSpace& source, const QColorSpace& display)
+{
+    return effective(source) != effective(display);
+}
+
+QByteArray lutKey(const QColorSpace& source, const QColorSpace& display)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(effective(source).iccProfile());
+    hash.addData(effective(display).iccProfile());
+    hash.addData(QByteArray::number(LUT_SIZE));
+    return hash.result();
+}
+
+std::vector<qfloat16> lut(const QColorSpace& source, const QColorSpace& display)
+{
+    const auto path = cacheFilePath(lutKey(source, display));
+    const qint64 dataSize = LUT_ENTRIES * sizeof(qfloat16);
+    QFile cached(path);
+    if(cached.open(QFile::ReadOnly) && cached.size() == qint64(sizeof MAGIC) + dataSize &&
+       cached.read(sizeof MAGIC) == QByteArray(MAGIC, sizeof MAGIC))
+    {
+        std::vector<qfloat16> lut(LUT_ENTRIES);
+        if(cached.read(reinterpret_cast<char*>(lut.data()), dataSize) == dataSize)
+            return lut;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    auto lut = bake(effective(source), effective(display));
+    qDebug() << "Color LUT for" << effective(source).description() << "baked in" << timer.elapsed() << "ms";
+
+    QDir().mkpath(QFileInfo(path).absolutePath());
+    QSaveFile file(path);
+    if(file.open(QFile::WriteOnly))
+    {
+        file.write(MAGIC, sizeof MAGIC);
+        file.write(reinterpret_cast<const char*>(lut.data()), dataSize);
+        if(!file.commit())
+            qWarning() << "Failed to write" << path << ":" << file.errorString();
+    }
+    return lut;
+}
+
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <vector>
+#include <QString>
+#include <QFloat16>
+#include <QByteArray>
+#include <QColorSpace>
+
+// Conversion of images from their embedded ICC profiles to the profile of
+// the display. The conversion of each pair of profiles is baked once into a
+// 3D lookup table, which is cached on disk, and Canvas applies it in the
+// fragment shader, so that it costs nothing when loading an image.
+namespace ColorManagement
+{
+
+// Grid points along each axis of a LUT
+constexpr int LUT_SIZE = 33;
+
+// The color space from the ICC profile embedded in the file, invalid if there's none
+QColorSpace embeddedColorSpace(const QString& path);
+// The profile in display.icc in the config location of the app, or sRGB if
+// there's no such file. Qt doesn't tell us the profile of the screen.
+QColorSpace displayColorSpace();
+// Whether images in the source color space need conversion to be shown in
+// the display color space. Images without a profile are taken as sRGB.
+bool needsConversion(const QColorSpace& source, const QColorSpace& display);
+// Identifies the pair of profiles a LUT is made for
+QByteArray lutKey(const QColorSpace& source, const QColorSpace& display);
+
+// LUT_SIZE³ RGBA texels, red varying fastest. Entry (r,g,b) is the display
+// value for the source value (r,g,b)/(LUT_SIZE-1). Loaded from the cache
+// or baked and then stored there. Can be called from any thread.
+std::vector<qfloat16> lut(const QColorSpace& source, const QColorSpace& display);
+
+}
@@ -0,0 +1,385 @@
+#include "CpuRenderer.hpp"
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <algorithm>
+#include <iostream>
+#include <QThreadPool>
+#include <QImageReader>
+#include <QElapsedTimer>
+#include <QTemporaryDir>
+#include <QCoreApplication>
+#include "Utils.hpp"
+#include "Canvas.hpp"
+#include "Downscaler.hpp"
+
+namespace
+{
+
+constexpr int TILE_SIZE = 64;
+constexpr float PI = M_PI;
+
+// The math is done on packets of pixels, which Eigen maps onto SSE/AVX/NEON
+// registers, whichever are enabled for the build.
+constexpr int PACKET_SIZE = 8;
+using Packet = Eigen::Array<float, PACKET_SIZE, 1>;
+using IndexPacket = Eigen::Array<int, PACKET_SIZE, 1>;
+// RGBA of a packet of pixels, a column per pixel
+using TexelPacket = Eigen::Array<float, 4, PACKET_SIZE>;
+
+// Eigen doesn't vectorize atan2 and asin, so we use a polynomial
+// approximation of atan on [0,1] with absolute error below 1e-5, which is
+// well below the size of a texel of any image we can show.
+Packet atan2(const Packet& y, const Packet& x)
+{
+    const Packet absX = x.abs(), absY = y.abs();
+    const Packet ratio = absX.min(absY) / absX.max(absY).max(std::numeric_limits<float>::min());
+    const Packet r2 = ratio.square();
+    Packet angle = ((((( -0.01172120f * r2 + 0.05265332f) * r2
+                        - 0.11643287f) * r2 + 0.19354346f) * r2
+                        - 0.33262347f) * r2 + 0.99997726f) * ratio;
+    angle = (absY > absX).select(PI/2 - angle, angle);
+    angle = (x < 0.f).select(PI - angle, angle);
+    angle = (y < 0.f).select(-angle, angle);
+    return angle;
+}
+
+Packet asin(const Packet& x)
+{
+    return atan2(x, (1.f - x.square()).max(0.f).sqrt());
+}
+
+struct Direction
+{
+    Packet x, y, z;
+};
+
+// Bilinear filtering of the given mip level of each pixel, with GL_REPEAT for
+// s and GL_CLAMP_TO_EDGE for t, as set up for the texture in Canvas. The
+// coordinates, the weights and the blending are computed on packets. The
+// texel loads are done pixel by pixel: the pixels of a packet may hit
+// different levels and rows, and there's no portable gather instruction.
+TexelPacket bilinear(const std::vector<QImage>& levels, const IndexPacket& level,
+                     const Packet& s, const Packet& t)
+{
+    Packet w, h;
+    for(int n = 0; n < PACKET_SIZE; ++n)
+    {
+        w[n] = levels[level[n]].width();
+        h[n] = levels[level[n]].height();
+    }
+    const Packet u = (s - s.floor()) * w - 0.5f;
+    const Packet v = (t * h - 0.5f).max(0.f).min(h - 1.f);
+    const Packet uFloor = u.floor(), vFloor = v.floor();
+    const Packet fu = u - uFloor, fv = v - vFloor;
+    // u is in [-0.5, w-0.5], so only the first column wraps to the left
+    const IndexPacket x0 = (uFloor < 0.f).select(w - 1.f, uFloor).cast<int>();
+    const IndexPacket x1 = (x0 + 1 == w.cast<int>()).select(0, x0 + 1);
+    const IndexPacket y0 = vFloor.cast<int>();
+    const IndexPacket y1 = (y0 + 1).min(h.cast<int>() - 1);
+
+    using Texel = Eigen::Array<uchar, 4, 1>;
+    TexelPacket topLeft, topRight, bottomLeft, bottomRight;
+    for(int n = 0; n < PACKET_SIZE; ++n)
+    {
+        const auto& img = levels[level[n]];
+        const uchar*const row0 = img.constScanLine(y0[n]);
+        const uchar*const row1 = img.constScanLine(y1[n]);
+        topLeft.col(n)     = Eigen::Map<const Texel>(row0 + 4*x0[n]).cast<float>();
+        topRight.col(n)    = Eigen::Map<const Texel>(row0 + 4*x1[n]).cast<float>();
+        bottomLeft.col(n)  = Eigen::Map<const Texel>(row1 + 4*x0[n]).cast<float>();
+        bottomRight.col(n) = Eigen::Map<const Texel>(row1 + 4*x1[n]).cast<float>();
+    }
+    const TexelPacket top = topLeft + (topRight - topLeft).rowwise() * fu.transpose();
+    const TexelPacket bottom = bottomLeft + (bottomRight - bottomLeft).rowwise() * fu.transpose();
+    return top + (bottom - top).rowwise() * fv.transpose();
+}
+
+// Trilinear filtering, GL_LINEAR_MIPMAP_LINEAR, of a packet of pixels. The
+// first count of them are written to out as RGBA8888.
+void sample(const std::vector<QImage>& levels, const Packet& s, const Packet& t, const Packet& lod,
+            uchar*const out, const int count)
+{
+    const Packet levelFloor = lod.floor();
+    const Packet levelFrac = lod - levelFloor;
+    const IndexPacket level0 = levelFloor.cast<int>();
+    TexelPacket result = bilinear(levels, level0, s, t);
+    // Magnified views sample the base level only
+    if((levelFrac > 0.f).any())
+    {
+        const IndexPacket level1 = (level0 + 1).min(int(levels.size()) - 1);
+        result += (bilinear(levels, level1, s, t) - result).rowwise() * levelFrac.transpose();
+    }
+    Eigen::Map<Eigen::Array<uchar, 4, Eigen::Dynamic>>(out, 4, count) =
+        (result + 0.5f).max(0.f).min(255.f).leftCols(count).cast<uchar>();
+}
+
+// The largest difference of the color channels, in 8-bit steps, for each pixel
+std::vector<int> channelDifferences(const QImage& a, const QImage& b)
+{
+    std::vector<int> differences;
+    differences.reserve(qint64(a.width()) * a.height());
+    for(int j = 0; j < a.height(); ++j)
+    {
+        const uchar*const lineA = a.constScanLine(j);
+        const uchar*const lineB = b.constScanLine(j);
+        for(int i = 0; i < a.width(); ++i)
+        {
+            int difference = 0;
+            for(int c = 0; c < 3; ++c)
+                difference = std::max(difference, std::abs(lineA[4*i+c] - lineB[4*i+c]));
+            differences.push_back(difference);
+        }
+    }
+    return differences;
+}
+
+}
+
+struct CpuRenderer::View
+{
+    Eigen::Matrix3f rotation;
+    float camDistToScreen;
+    float fullWidth, fullHeight;
+    QPoint regionOrigin;
+
+    // Mirrors Canvas::calcViewDir and the calcViewDir() of the fragment
+    // shader, for pixel centers at (x+0.5, y+0.5) in the full view.
+    Direction direction(const Packet& x, const float y) const
+    {
+        const Packet posX = (x + 0.5f) / fullWidth * 2.f - 1.f;
+        const float posY = (fullHeight - 2*(y + 0.5f)) / fullWidth;
+        const Packet invNorm = (camDistToScreen*camDistToScreen + posX.square() + posY*posY).rsqrt();
+        const Packet vx = -camDistToScreen * invNorm;
+        const Packet vy = posX * invNorm;
+        const Packet vz = posY * invNorm;
+        const auto& r = rotation;
+        return {r(0,0)*vx + r(0,1)*vy + r(0,2)*vz,
+                r(1,0)*vx + r(1,1)*vy + r(1,2)*vz,
+                r(2,0)*vx + r(2,1)*vy + r(2,2)*vz};
+    }
+};
+
+void CpuRenderer::setImage(const QImage& image)
+{
+    levels_.clear();
+    if(image.isNull()) return;
+    // The same filtering in linear light as for the textures of Canvas
+    levels_ = buildMipChain(image.convertToFormat(QImage::Format_RGBA8888));
+}
+
+void CpuRenderer::renderTile(uchar*const outBits, const qsizetype outBytesPerLine,
+                             const QRect& tile, const View& view) const
+{
+    const float texWidth = levels_[0].width(), texHeight = levels_[0].height();
+    const float maxLod = levels_.size() - 1;
+    Packet offsets;
+    for(int n = 0; n < PACKET_SIZE; ++n)
+        offsets[n] = n;
+
+    for(int j = tile.top(); j <= tile.bottom(); ++j)
+    {
+        uchar*const line = outBits + j * outBytesPerLine;
+        const float y = j + view.regionOrigin.y();
+        for(int i = tile.left(); i <= tile.right(); i += PACKET_SIZE)
+        {
+            const Packet x = offsets + float(i + view.regionOrigin.x());
+            const auto dir = view.direction(x, y);
+            // Neighbors to the right and below stand in for dFdx and dFdy
+            const auto dirDx = view.direction(x + 1.f, y);
+            const auto dirDy = view.direction(x, y + 1);
+
+            const Packet elevation = asin(dir.z.max(-1.f).min(1.f));
+            const Packet azimuth = atan2(dir.y, dir.x);
+            const Packet texS = -azimuth / (2*PI);
+            const Packet texT = -elevation / PI + 0.5f;
+
+            // Same treatment of the atan discontinuity as in the shader, see
+            // the comment there.
+            const Packet gradViewDirXs = dirDx.x - dir.x, gradViewDirXt = dirDy.x - dir.x;
+            const Packet gradViewDirYs = dirDx.y - dir.y, gradViewDirYt = dirDy.y - dir.y;
+            const Packet dirNorm2 = dir.x.square() + dir.y.square() + dir.z.square();
+            const Packet gradLongitudeS = (dir.y*gradViewDirXs - dir.x*gradViewDirYs) / dirNorm2;
+            const Packet gradLongitudeT = (dir.y*gradViewDirXt - dir.x*gradViewDirYt) / dirNorm2;
+            const Packet texTdx = (-asin(dirDx.z.max(-1.f).min(1.f)) / PI + 0.5f) - texT;
+            const Packet texTdy = (-asin(dirDy.z.max(-1.f).min(1.f)) / PI + 0.5f) - texT;
+
+            const Packet texDxS = gradLongitudeS / (2*PI) * texWidth, texDxT = texTdx * texHeight;
+            const Packet texDyS = gradLongitudeT / (2*PI) * texWidth, texDyT = texTdy * texHeight;
+            const Packet rho2 = (texDxS.square() + texDxT.square()).max(texDyS.square() + texDyT.square());
+            // log2(sqrt(rho2))
+            const Packet lod = (rho2.max(1.f).log() * float(0.5 / M_LN2)).min(maxLod);
+
+            sample(levels_, texS, texT, lod, line + 4*i, std::min(PACKET_SIZE, tile.right() + 1 - i));
+        }
+    }
+}
+
+QImage CpuRenderer::render(const QSize& size, const Eigen::Matrix3d& cameraRotation,
+                           const double horizViewAngle) const
+{
+    return render(size, QRect(QPoint(0,0), size), cameraRotation, horizViewAngle);
+}
+
+QImage CpuRenderer::render(const QSize& fullSize, const QRect& region,
+                           const Eigen::Matrix3d& cameraRotation, const double horizViewAngle) const
+{
+    QImage out(region.size(), QImage::Format_RGBA8888);
+    if(levels_.empty())
+    {
+        out.fill(Qt::transparent);
+        return out;
+    }
+
+    View view;
+    view.rotation = cameraRotation.cast<float>();
+    view.camDistToScreen = 1 / std::tan(horizViewAngle / 2);
+    view.fullWidth = fullSize.width();
+    view.fullHeight = fullSize.height();
+    view.regionOrigin = region.topLeft();
+
+    const int tilesX = (region.width() + TILE_SIZE - 1) / TILE_SIZE;
+    const int tilesY = (region.height() + TILE_SIZE - 1) / TILE_SIZE;
+    // Taken once here: scanLine() may detach, which isn't safe from several threads
+    uchar*const outBits = out.bits();
+    const qsizetype outBytesPerLine = out.bytesPerLine();
+    Utils::parallelFor(tilesX * tilesY, [&](const int n)
+    {
+        const QRect tile(n % tilesX * TILE_SIZE, n / tilesX * TILE_SIZE, TILE_SIZE, TILE_SIZE);
+        renderTile(outBits, outBytesPerLine, tile.intersected(out.rect()), view);
+    });
+    return out;
+}
+
+bool CpuRenderer::benchmark(const QString& path)
+{
+    QImageReader reader(path);
+    const auto image = reader.read();
+    if(image.isNull())
+    {
+        std::cerr << "Failed to read the image file \"" << path.toStdString() << "\": "
+                  << reader.errorString().toStdString() << "\n";
+        return false;
+    }
+    CpuRenderer renderer;
+    QElapsedTimer timer;
+    timer.start();
+    renderer.setImage(image);
+    std::cout << "Image " << image.width() << "×" << image.height() << ", mip chain built in "
+              << timer.elapsed() << " ms\n";
+
+    using namespace Eigen;
+    const QSize size(1920, 1080);
+    constexpr int frameCount = 32;
+    const auto pool = QThreadPool::globalInstance();
+    const int maxThreads = pool->maxThreadCount();
+    for(const int threads : {1, maxThreads})
+    {
+        pool->setMaxThreadCount(threads);
+        timer.start();
+        for(int n = 0; n < frameCount; ++n)
+        {
+            const double yaw = 2 * M_PI * n / frameCount;
+            const double pitch = M_PI / 3 * std::sin(yaw);
+            const Matrix3d rotation = (AngleAxisd(yaw, Vector3d::UnitZ()) *
+                                       AngleAxisd(pitch, -Vector3d::UnitY())).toRotationMatrix();
+            renderer.render(size, rotation, 60 * M_PI / 180);
+        }
+        const double seconds = timer.nsecsElapsed() * 1e-9;
+        const double megapixelsPerSecond = double(size.width()) * size.height() * frameCount / seconds / 1e6;
+        std::cout << threads << " thread(s): " << megapixelsPerSecond << " MP/s, "
+                  << megapixelsPerSecond / threads << " MP/s per core\n";
+        if(maxThreads == 1) break;
+    }
+    pool->setMaxThreadCount(maxThreads);
+    return true;
+}
+
+bool CpuRenderer::compareWithGpu(const QString& path)
+{
+    QImageReader reader(path);
+    const auto image = reader.read();
+    if(image.isNull())
+    {
+        std::cerr << "Failed to read the image file \"" << path.toStdString() << "\": "
+                  << reader.errorString().toStdString() << "\n";
+        return false;
+    }
+    const QTemporaryDir dir;
+    if(!dir.isValid())
+    {
+        std::cerr << "Failed to create a temporary directory: " << dir.errorString().toStdString() << "\n";
+        return false;
+    }
+    CpuRenderer renderer;
+    renderer.setImage(image);
+
+    const QSize size(1280, 720);
+    Canvas canvas;
+    canvas.setAttribute(Qt::WA_DontShowOnScreen);
+    // Keeps the sensor from turning the view
+    canvas.setReplayTime(0);
+    canvas.resize(size);
+    canvas.show();
+    canvas.setImage(image);
+    // The mip chain is built on the pool, and then handed to the canvas
+    QThreadPool::globalInstance()->waitForDone();
+    QCoreApplication::processEvents();
+    // Uploads the texture
+    canvas.grabFramebuffer();
+    if(canvas.maxTexSize() < std::max(image.width(), image.height()))
+        std::cout << "The image exceeds GL_MAX_TEXTURE_SIZE, expect differences from downscaling\n";
+
+    using namespace Eigen;
+    struct Case
+    {
+        double yaw, pitch, horizViewAngle;
+    };
+    // Looking at the horizon, the seam, a pole, and zoomed out and in
+    constexpr double degree = M_PI / 180;
+    const Case cases[] = {{0, 0, 60 * degree},
+                          {180 * degree, 10 * degree, 60 * degree},
+                          {30 * degree, 80 * degree, 90 * degree},
+                          {90 * degree, -30 * degree, 150 * degree},
+                          {45 * degree, 20 * degree, 5 * degree}};
+    double worstMean = 0;
+    for(const auto& c : cases)
+    {
+        canvas.setCamera({c.yaw, c.pitch, c.horizViewAngle});
+        const auto gpuPath = dir.filePath("gpu.png");
+        QString error;
+        if(!canvas.exportView(gpuPath, size, error))
+        {
+            std::cerr << "Failed to render on the GPU: " << error.toStdString() << "\n";
+            return false;
+        }
+        const auto gpu = QImage(gpuPath).convertToFormat(QImage::Format_RGBA8888);
+        const Matrix3d rotation = (AngleAxisd(c.yaw, Vector3d::UnitZ()) *
+                                   AngleAxisd(c.pitch, -Vector3d::UnitY())).toRotationMatrix();
+        const auto cpu = renderer.render(size, rotation, c.horizViewAngle);
+        if(gpu.size() != cpu.size())
+        {
+            std::cerr << "Failed to read back the GPU rendering\n";
+            return false;
+        }
+
+        auto differences = channelDifferences(cpu, gpu);
+        const double mean = std::accumulate(differences.begin(), differences.end(), 0.) / differences.size();
+        const auto p99 = differences.begin() + differences.size() * 99 / 100;
+        std::nth_element(differences.begin(), p99, differences.end());
+        const int max = *std::max_element(p99, differences.end());
+        std::cout << "yaw " << c.yaw / degree << "°, pitch " << c.pitch / degree << "°, view angle "
+                  << c.horizViewAngle / degree << "°: mean difference " << mean << ", 99th percentile "
+                  << *p99 << ", max " << max << "\n";
+        worstMean = std::max(worstMean, mean);
+    }
+    // Rounding and the approximations of atan and of the derivatives make
+    // for small differences, a wrong mapping or filter for large ones
+    constexpr double maxMeanDifference = 1;
+    if(worstMean > maxMeanDifference)
+    {
+        std::cout << "The CPU renderer doesn't match the GPU\n";
+        return false;
+    }
+    return true;
+}
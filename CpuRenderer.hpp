@@ -0,0 +1,44 @@
+#pragma once
+
+#include <vector>
+#include <QRect>
+#include <QImage>
+#include <Eigen/Dense>
+
+// CPU implementation of the projection that the fragment shader of Canvas
+// does: an equirectangular image is reprojected into a rectilinear view with
+// the same seam-aware choice of mip level. For now it serves as a reference
+// for the GPU path, see compareWithGpu(), and as a measure of what the CPU
+// can do, see benchmark(); nothing in the viewer renders with it.
+class CpuRenderer
+{
+public:
+    void setImage(const QImage& image);
+    bool hasImage() const { return !levels_.empty(); }
+    void clear() { levels_.clear(); }
+
+    // Renders the whole view of the given size.
+    QImage render(const QSize& size, const Eigen::Matrix3d& cameraRotation,
+                  double horizViewAngle) const;
+    // Renders the part of a view of size fullSize that is covered by region.
+    // The result has the size of the region.
+    QImage render(const QSize& fullSize, const QRect& region,
+                  const Eigen::Matrix3d& cameraRotation, double horizViewAngle) const;
+
+    // Renders a series of frames from the image at path, first on a single
+    // thread and then on all the threads of the global pool, and prints the
+    // throughput to stdout. Returns false if the image couldn't be read.
+    static bool benchmark(const QString& path);
+    // Renders views of the image at path with a hidden Canvas and with the
+    // CPU renderer, and prints how much they differ. Returns false if they
+    // differ by more than rounding and approximations explain, or if the
+    // comparison couldn't be done. Meant for sRGB images, as Canvas converts
+    // other color spaces for the display and the CPU renderer doesn't.
+    static bool compareWithGpu(const QString& path);
+
+private:
+    struct View;
+    void renderTile(uchar* outBits, qsizetype outBytesPerLine, const QRect& tile, const View& view) const;
+
+    std::vector<QImage> levels_; // Format_RGBA8888, level 0 is the full-resolution image
+};
@@ -0,0 +1,397 @@
+#include "Downscaler.hpp"
+#include <cmath>
+#include <array>
+#include <memory>
+#include <cassert>
+#include <iostream>
+#include <Eigen/Dense>
+#include <QThreadPool>
+#include "Utils.hpp"
+
+namespace
+{
+
+constexpr int LINEAR_TO_SRGB_TABLE_SIZE = 16384;
+
+float srgbToLinear(const float v)
+{
+    return v <= 0.04045f ? v / 12.92f : std::pow((v + 0.055f) / 1.055f, 2.4f);
+}
+
+float linearToSrgb(const float v)
+{
+    return v <= 0.0031308f ? v * 12.92f : 1.055f * std::pow(v, 1 / 2.4f) - 0.055f;
+}
+
+const std::array<float, 256>& srgbToLinearTable()
+{
+    static const auto table = []
+    {
+        std::array<float, 256> table;
+        for(int n = 0; n < 256; ++n)
+            table[n] = srgbToLinear(n / 255.f);
+        return table;
+    }();
+    return table;
+}
+
+const std::vector<uchar>& linearToSrgbTable()
+{
+    static const auto table = []
+    {
+        std::vector<uchar> table(LINEAR_TO_SRGB_TABLE_SIZE);
+        for(int n = 0; n < LINEAR_TO_SRGB_TABLE_SIZE; ++n)
+            table[n] = std::lround(255 * linearToSrgb((n + 0.5f) / LINEAR_TO_SRGB_TABLE_SIZE));
+        return table;
+    }();
+    return table;
+}
+
+int channelCount(const QImage::Format format)
+{
+    switch(format)
+    {
+    case QImage::Format_Grayscale8:
+        return 1;
+    case QImage::Format_RGB888:
+        return 3;
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+    case QImage::Format_RGBX8888:
+    case QImage::Format_RGBA8888:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+int alphaChannel(const QImage::Format format)
+{
+    switch(format)
+    {
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+        // These are stored as 32-bit words 0xAARRGGBB
+        return Q_BYTE_ORDER == Q_LITTLE_ENDIAN ? 3 : 0;
+    case QImage::Format_RGBX8888:
+    case QImage::Format_RGBA8888:
+        return 3;
+    default:
+        return -1;
+    }
+}
+
+// Makes the next level of the mip chain of an equirectangular image.
+// Vertically, each destination row is the area average of the source rows it
+// covers. Along a parallel at latitude φ, a texel subtends only cos φ of the
+// angle it does at the equator, so the horizontal averaging window is widened
+// by 1/cos φ, up to the whole row at the poles. The window wraps around the
+// 0/360° seam, as the texture does.
+QImage halveEquirect(const QImage& src)
+{
+    const int channels = channelCount(src.format());
+    const int alpha = alphaChannel(src.format());
+    const int srcWidth = src.width(), srcHeight = src.height();
+    QImage dst(std::max(1, srcWidth / 2), std::max(1, srcHeight / 2), src.format());
+    if(dst.isNull()) return dst;
+    dst.setColorSpace(src.colorSpace());
+    const int dstWidth = dst.width(), dstHeight = dst.height();
+    const double scaleX = double(srcWidth) / dstWidth, scaleY = double(srcHeight) / dstHeight;
+    const int srcRowSize = srcWidth * channels, dstRowSize = dstWidth * channels;
+    const auto& toLinear = srgbToLinearTable();
+    const auto& toSrgb = linearToSrgbTable();
+    // Taken once here: scanLine() may detach, which isn't safe from several threads
+    uchar*const dstBits = dst.bits();
+    const qsizetype dstBytesPerLine = dst.bytesPerLine();
+
+    constexpr int rowsPerTask = 8;
+    Utils::parallelFor((dstHeight + rowsPerTask - 1) / rowsPerTask, [&](const int task)
+    {
+        using Block = Eigen::Array<float, Eigen::Dynamic, Eigen::Dynamic>;
+        std::vector<float> linearRow(srcRowSize), column(srcRowSize), reduced(dstRowSize);
+        std::vector<double> integral((srcWidth + 1) * channels);
+        Eigen::Map<Eigen::ArrayXf> columnArray(column.data(), srcRowSize);
+        const Eigen::Map<const Eigen::ArrayXf> linearArray(linearRow.data(), srcRowSize);
+        for(int y = task * rowsPerTask; y < std::min(dstHeight, (task + 1) * rowsPerTask); ++y)
+        {
+            const double top = y * scaleY, bottom = (y + 1) * scaleY;
+            columnArray.setZero();
+            for(int row = int(top); row < std::min<int>(srcHeight, std::ceil(bottom)); ++row)
+            {
+                const float weight = (std::min<double>(row + 1, bottom) - std::max<double>(row, top)) / scaleY;
+                if(weight <= 0) continue;
+                const uchar*const line = src.constScanLine(row);
+                for(int n = 0; n < srcRowSize; ++n)
+                    linearRow[n] = toLinear[line[n]];
+                if(alpha >= 0)
+                {
+                    for(int n = alpha; n < srcRowSize; n += channels)
+                        linearRow[n] = line[n] * (1.f / 255);
+                }
+                columnArray += weight * linearArray;
+            }
+
+            const double cosLatitude = std::sin(M_PI * (y + 0.5) / dstHeight);
+            const double window = std::min<double>(srcWidth, scaleX / std::max(cosLatitude, 1e-6));
+            if(srcWidth == 2 * dstWidth && window < 2.002)
+            {
+                // The rows near the equator: a plain 2×2 box
+                const Eigen::Map<const Block> pairs(column.data(), 2 * channels, dstWidth);
+                Eigen::Map<Block>(reduced.data(), channels, dstWidth) =
+                    0.5f * (pairs.topRows(channels) + pairs.bottomRows(channels));
+            }
+            else
+            {
+                // With the integral of the row, any window costs two lookups
+                for(int n = 0; n < srcRowSize; ++n)
+                    integral[n + channels] = integral[n] + column[n];
+                const auto integralAt = [&](double pos, const int channel)
+                {
+                    const double turns = std::floor(pos / srcWidth);
+                    pos -= turns * srcWidth;
+                    const int col = std::min(int(pos), srcWidth - 1);
+                    return turns * integral[srcRowSize + channel] + integral[col * channels + channel] +
+                           (pos - col) * column[col * channels + channel];
+                };
+                for(int x = 0; x < dstWidth; ++x)
+                {
+                    const double center = (x + 0.5) * scaleX;
+                    for(int c = 0; c < channels; ++c)
+                    {
+                        reduced[x * channels + c] = (integralAt(center + window / 2, c) -
+                                                     integralAt(center - window / 2, c)) / window;
+                    }
+                }
+            }
+
+            uchar*const out = dstBits + y * dstBytesPerLine;
+            for(int n = 0; n < dstRowSize; ++n)
+            {
+                const float v = std::clamp(reduced[n], 0.f, 1.f);
+                out[n] = toSrgb[std::min(int(v * LINEAR_TO_SRGB_TABLE_SIZE), LINEAR_TO_SRGB_TABLE_SIZE - 1)];
+            }
+            if(alpha >= 0)
+            {
+                for(int n = alpha; n < dstRowSize; n += channels)
+                    out[n] = std::lround(std::clamp(reduced[n], 0.f, 1.f) * 255);
+            }
+        }
+    });
+    return dst;
+}
+
+}
+
+bool StreamingDownscaler::isFormatSupported(const QImage::Format format)
+{
+    return channelCount(format) != 0;
+}
+
+StreamingDownscaler::StreamingDownscaler(const QSize& srcSize, QImage& dst,
+                                         const int firstDstRow, const int dstRowCount)
+    : dstBits_(dst.bits())
+    , dstBytesPerLine_(dst.bytesPerLine())
+    , channels_(channelCount(dst.format()))
+    , alphaChannel_(alphaChannel(dst.format()))
+    , srcWidth_(srcSize.width())
+    , scaleY_(double(srcSize.height()) / dst.height())
+    , firstDstRow_(firstDstRow)
+    , dstRowEnd_(dstRowCount < 0 ? dst.height() : std::min(dst.height(), firstDstRow + dstRowCount))
+    , accumRow_(firstDstRow)
+{
+    assert(channels_ != 0);
+    assert(dst.width() <= srcSize.width() && dst.height() <= srcSize.height());
+
+    // Tolerance for boundaries that should fall exactly on integers
+    const double eps = 1e-9 * std::max(srcSize.width(), srcSize.height());
+    firstSrcRow_ = std::floor(firstDstRow_ * scaleY_ + eps);
+    srcRowEnd_ = std::min<int>(srcSize.height(), std::ceil(dstRowEnd_ * scaleY_ - eps));
+    nextSrcRow_ = firstSrcRow_;
+
+    const double scaleX = double(srcWidth_) / dst.width();
+    columns_.resize(dst.width());
+    for(int x = 0; x < dst.width(); ++x)
+    {
+        const double begin = x * scaleX, end = (x + 1) * scaleX;
+        auto& col = columns_[x];
+        col.firstSrcCol = std::floor(begin + eps);
+        const int srcColEnd = std::min<int>(srcWidth_, std::ceil(end - eps));
+        for(int i = col.firstSrcCol; i < srcColEnd; ++i)
+            col.weights.push_back((std::min<double>(i + 1, end) - std::max<double>(i, begin)) / scaleX);
+    }
+
+    linearRow_.resize(srcWidth_ * channels_);
+    reducedRow_.resize(dst.width() * channels_);
+    for(auto& accum : accum_)
+        accum.assign(reducedRow_.size(), 0.f);
+}
+
+template<int Channels>
+void StreamingDownscaler::reduceRow()
+{
+    using Pixel = Eigen::Array<float, Channels, 1>;
+    for(unsigned x = 0; x < columns_.size(); ++x)
+    {
+        const auto& col = columns_[x];
+        const float* src = &linearRow_[col.firstSrcCol * Channels];
+        Pixel sum = Pixel::Zero();
+        for(const float weight : col.weights)
+        {
+            sum += weight * Eigen::Map<const Pixel>(src);
+            src += Channels;
+        }
+        Eigen::Map<Pixel>{&reducedRow_[x * Channels]} = sum;
+    }
+}
+
+void StreamingDownscaler::addRow(const uchar*const row)
+{
+    assert(!done());
+    const int srcRow = nextSrcRow_++;
+
+    const auto& toLinear = srgbToLinearTable();
+    for(int n = 0; n < srcWidth_ * channels_; ++n)
+        linearRow_[n] = toLinear[row[n]];
+    if(alphaChannel_ >= 0)
+    {
+        for(int n = alphaChannel_; n < srcWidth_ * channels_; n += channels_)
+            linearRow_[n] = row[n] * (1.f / 255);
+    }
+
+    switch(channels_)
+    {
+    case 1: reduceRow<1>(); break;
+    case 3: reduceRow<3>(); break;
+    case 4: reduceRow<4>(); break;
+    }
+
+    const double eps = 1e-9 * srcRowEnd_;
+    // Starting from floor(srcRow / scaleY_) instead could go back to a row
+    // finished within eps by the previous source row
+    for(int dstRow = accumRow_;
+        dstRow < dstRowEnd_ && dstRow * scaleY_ < srcRow + 1 - eps;
+        ++dstRow)
+    {
+        const double top = std::max<double>(srcRow, dstRow * scaleY_);
+        const double bottom = std::min<double>(srcRow + 1, (dstRow + 1) * scaleY_);
+        accumulate(dstRow, (bottom - top) / scaleY_);
+        if((dstRow + 1) * scaleY_ <= srcRow + 1 + eps)
+            finishRow(dstRow);
+    }
+}
+
+void StreamingDownscaler::accumulate(const int dstRow, const float weight)
+{
+    const int index = dstRow - accumRow_;
+    assert(index == 0 || index == 1);
+    Eigen::Map<Eigen::ArrayXf>(accum_[index].data(), accum_[index].size()) +=
+        weight * Eigen::Map<const Eigen::ArrayXf>(reducedRow_.data(), reducedRow_.size());
+}
+
+void StreamingDownscaler::finishRow(const int dstRow)
+{
+    assert(dstRow == accumRow_);
+    const auto& toSrgb = linearToSrgbTable();
+    auto& accum = accum_[0];
+    uchar*const out = dstBits_ + dstRow * dstBytesPerLine_;
+    for(unsigned n = 0; n < accum.size(); ++n)
+    {
+        const float v = std::clamp(accum[n], 0.f, 1.f);
+        out[n] = toSrgb[std::min(int(v * LINEAR_TO_SRGB_TABLE_SIZE), LINEAR_TO_SRGB_TABLE_SIZE - 1)];
+    }
+    if(alphaChannel_ >= 0)
+    {
+        for(unsigned n = alphaChannel_; n < accum.size(); n += channels_)
+            out[n] = std::lround(std::clamp(accum[n], 0.f, 1.f) * 255);
+    }
+
+    std::swap(accum_[0], accum_[1]);
+    std::fill(accum_[1].begin(), accum_[1].end(), 0.f);
+    ++accumRow_;
+}
+
+QImage downscale(const QImage& image, const QSize& dstSize)
+{
+    const auto src = StreamingDownscaler::isFormatSupported(image.format())
+                                ? image : image.convertToFormat(QImage::Format_RGBA8888);
+    QImage dst(dstSize, src.format());
+    if(dst.isNull()) return dst;
+    dst.setColorSpace(src.colorSpace());
+
+    // Each strip re-reads the source rows that straddle its boundaries, so
+    // strips shouldn't be too thin.
+    constexpr int minRowsPerStrip = 16;
+    const int stripCount = std::clamp(dstSize.height() / minRowsPerStrip, 1,
+                                      4 * QThreadPool::globalInstance()->maxThreadCount());
+    const int rowsPerStrip = (dstSize.height() + stripCount - 1) / stripCount;
+    // Constructed here rather than in the strips, as each takes the pixels of dst
+    std::vector<std::unique_ptr<StreamingDownscaler>> downscalers;
+    for(int strip = 0; strip * rowsPerStrip < dstSize.height(); ++strip)
+        downscalers.emplace_back(std::make_unique<StreamingDownscaler>(src.size(), dst, strip * rowsPerStrip, rowsPerStrip));
+    Utils::parallelFor(int(downscalers.size()), [&](const int strip)
+    {
+        auto& downscaler = *downscalers[strip];
+        for(int row = downscaler.firstSrcRow(); row < downscaler.srcRowEnd(); ++row)
+            downscaler.addRow(src.constScanLine(row));
+    });
+    return dst;
+}
+
+std::vector<QImage> buildMipChain(const QImage& base, const bool equirect)
+{
+    std::vector<QImage> levels{StreamingDownscaler::isFormatSupported(base.format())
+                                    ? base : base.convertToFormat(QImage::Format_RGBA8888)};
+    while(levels.back().width() > 1 || levels.back().height() > 1)
+    {
+        const auto& prev = levels.back();
+        auto level = equirect ? halveEquirect(prev)
+                              : downscale(prev, QSize(std::max(1, prev.width() / 2), std::max(1, prev.height() / 2)));
+        if(level.isNull())
+            break;
+        levels.push_back(std::move(level));
+    }
+    return levels;
+}
+
+bool checkDownscaler(const int maxSize)
+{
+    // A uniform source must come out as the same uniform image, with each
+    // destination row written once, whatever the sizes and the strips are
+    constexpr uchar value = 200;
+    int failures = 0;
+    for(int srcSize = 1; srcSize <= maxSize; ++srcSize)
+    {
+        for(int dstSize = 1; dstSize <= srcSize; ++dstSize)
+        {
+            for(const bool vertical : {true, false})
+            {
+                const QSize src = vertical ? QSize(2, srcSize) : QSize(srcSize, 2);
+                QImage dst(vertical ? QSize(1, dstSize) : QSize(dstSize, 1), QImage::Format_Grayscale8);
+                dst.fill(0);
+                const std::vector<uchar> row(src.width(), value);
+                const int rowsPerStrip = std::max(1, dst.height() / 3);
+                bool ok = true;
+                for(int firstRow = 0; firstRow < dst.height(); firstRow += rowsPerStrip)
+                {
+                    StreamingDownscaler downscaler(src, dst, firstRow, rowsPerStrip);
+                    for(int n = downscaler.firstSrcRow(); n < downscaler.srcRowEnd(); ++n)
+                        downscaler.addRow(row.data());
+                    ok = ok && downscaler.done();
+                }
+                for(int y = 0; y < dst.height(); ++y)
+                {
+                    const uchar*const line = dst.constScanLine(y);
+                    for(int x = 0; x < dst.width(); ++x)
+                        ok = ok && std::abs(line[x] - value) <= 1;
+                }
+                if(!ok && ++failures <= 10)
+                {
+                    std::cerr << "Downscaling " << src.width() << "×" << src.height() << " to "
+                              << dst.width() << "×" << dst.height() << " is wrong\n";
+                }
+            }
+        }
+    }
+    std::cout << "Downscaler checked for sizes up to " << maxSize << ", " << failures << " failure(s)\n";
+    return failures == 0;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <vector>
+#include <QImage>
+
+// Area-averaging (box filter) downscaler working in linear light. Source rows
+// are fed one at a time and in order, so a decoder can stream its output
+// right into it, and the full-resolution image never has to exist in memory.
+//
+// Every destination pixel is the average of exactly the source area it
+// covers, and the columns partition the source width without overlap or
+// clamping, so the left and right edges of an equirectangular image stay
+// consistent with each other and the 0/360° seam doesn't appear.
+class StreamingDownscaler
+{
+public:
+    // Writes rows [firstDstRow, firstDstRow+dstRowCount) of dst, which must be
+    // allocated by the caller with one of the formats supported by
+    // isFormatSupported(). Source rows must have the same format as dst.
+    // A negative dstRowCount means all the rows till the end of dst.
+    // The pixels of dst are taken here, so the downscalers of the strips of
+    // one image should be constructed before feeding them from many threads.
+    StreamingDownscaler(const QSize& srcSize, QImage& dst, int firstDstRow = 0, int dstRowCount = -1);
+
+    // The range of source rows that contribute to the destination rows
+    // handled by this downscaler. addRow() must be called for each of them.
+    int firstSrcRow() const { return firstSrcRow_; }
+    int srcRowEnd() const { return srcRowEnd_; }
+    void addRow(const uchar* row);
+    bool done() const { return nextSrcRow_ >= srcRowEnd_; }
+
+    static bool isFormatSupported(QImage::Format format);
+
+private:
+    struct Contribution
+    {
+        int firstSrcCol;
+        std::vector<float> weights;
+    };
+    template<int Channels> void reduceRow();
+    void accumulate(int dstRow, float weight);
+    void finishRow(int dstRow);
+
+    uchar* dstBits_;
+    qsizetype dstBytesPerLine_;
+    int channels_;
+    int alphaChannel_; // -1 if none
+    int srcWidth_;
+    double scaleY_;
+    int firstDstRow_, dstRowEnd_;
+    int firstSrcRow_, srcRowEnd_;
+    int nextSrcRow_;
+    std::vector<Contribution> columns_;
+    std::vector<float> linearRow_;
+    std::vector<float> reducedRow_;
+    // Accumulators for the two destination rows a source row can overlap
+    std::vector<float> accum_[2];
+    int accumRow_;
+};
+
+// Downscales the image to the given size, splitting the work in strips
+// between the threads of the global pool. Formats not supported by
+// StreamingDownscaler are converted to RGBA8888 first.
+QImage downscale(const QImage& src, const QSize& dstSize);
+// Builds a mip chain of an equirectangular image: each next level is half the
+// size of the previous one (rounded down, but not below 1), the last one is
+// 1×1. Filtering is done in linear light, wraps horizontally, and widens
+// towards the poles in proportion to the horizontal oversampling there.
+// The base image, converted to RGBA8888 if it's in a format not supported
+// by StreamingDownscaler, is the first element of the result.
+// Images that aren't equirectangular, like dual-fisheye frames, get plain
+// area averaging instead.
+std::vector<QImage> buildMipChain(const QImage& base, bool equirect = true);
+// Runs StreamingDownscaler over all the pairs of source and destination
+// heights and widths up to maxSize, in strips, checking that the result is
+// right. Prints the failures and returns false if there were any.
+bool checkDownscaler(int maxSize = 512);
@@ -0,0 +1,99 @@
+#include "DualFisheye.hpp"
+#include <cmath>
+#include <algorithm>
+#include <QSettings>
+#include <QFileInfo>
+#include <QStandardPaths>
+
+namespace
+{
+
+constexpr double DEGREE = M_PI / 180;
+constexpr int DARK_LEVEL = 16;
+constexpr int BRIGHT_LEVEL = 48;
+
+// Mean gray level of a small patch around (x,y), given in fractions of the image size
+int patchLevel(const QImage& image, const double x, const double y)
+{
+    const int radius = std::clamp(image.height() / 64, 1, 4);
+    const int cx = std::clamp(int(x * image.width()), radius, image.width() - 1 - radius);
+    const int cy = std::clamp(int(y * image.height()), radius, image.height() - 1 - radius);
+    int sum = 0, count = 0;
+    for(int py = cy - radius; py <= cy + radius; ++py)
+    {
+        for(int px = cx - radius; px <= cx + radius; ++px)
+        {
+            sum += qGray(image.pixel(px, py));
+            ++count;
+        }
+    }
+    return sum / count;
+}
+
+}
+
+namespace DualFisheye
+{
+
+Calibration calibration()
+{
+    Calibration calibration{{{{0.5, 0.5, 0.5, 195 * DEGREE, 0},
+                               {1.5, 0.5, 0.5, 195 * DEGREE, 0}}},
+                            5 * DEGREE};
+    const auto path = QStandardPaths::writableLocation(QStandardPaths::AppConfigLocation) + "/dual-fisheye.ini";
+    if(!QFileInfo::exists(path))
+        return calibration;
+
+    QSettings settings(path, QSettings::IniFormat);
+    const char*const groups[2] = {"front", "back"};
+    for(int n = 0; n < 2; ++n)
+    {
+        auto& lens = calibration.lenses[n];
+        settings.beginGroup(groups[n]);
+        lens.centerX = settings.value("centerX", lens.centerX).toDouble();
+        lens.centerY = settings.value("centerY", lens.centerY).toDouble();
+        lens.radius = settings.value("radius", lens.radius).toDouble();
+        lens.fieldOfView = settings.value("fieldOfView", lens.fieldOfView / DEGREE).toDouble() * DEGREE;
+        lens.roll = settings.value("roll", lens.roll / DEGREE).toDouble() * DEGREE;
+        settings.endGroup();
+    }
+    calibration.seamWidth = settings.value("seamWidth", calibration.seamWidth / DEGREE).toDouble() * DEGREE;
+    return calibration;
+}
+
+bool detect(const QString& path)
+{
+    return QFileInfo(path).suffix().compare("insp", Qt::CaseInsensitive) == 0;
+}
+
+bool detect(const QString& path, const QImage& image)
+{
+    if(detect(path))
+        return true;
+    if(image.isNull() || image.width() != image.height() * 2 || image.height() < 16)
+        return false;
+
+    // The corners of both halves are outside of the circles
+    for(const double x : {0., 0.5, 1.})
+    {
+        for(const double y : {0., 1.})
+        {
+            if(patchLevel(image, x, y) > DARK_LEVEL)
+                return false;
+        }
+    }
+    // Near the top and bottom of the circles, where the same rows of an
+    // equirectangular image would be almost uniform, there's something
+    int bright = 0;
+    for(const double x : {0.25, 0.75})
+    {
+        for(const double y : {0.05, 0.95})
+        {
+            if(patchLevel(image, x, y) > BRIGHT_LEVEL)
+                ++bright;
+        }
+    }
+    return bright >= 2;
+}
+
+}
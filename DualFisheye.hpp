@@ -0,0 +1,43 @@
+#pragma once
+
+#include <array>
+#include <QImage>
+#include <QString>
+
+// Frames of consumer 360° cameras as they come out of the camera: two
+// fisheye circles side by side, the front lens on the left and the back one
+// on the right. Canvas samples them directly, without stitching to an
+// equirectangular image first.
+namespace DualFisheye
+{
+
+struct LensCalibration
+{
+    // Center and radius of the image circle in units of the image height
+    double centerX;
+    double centerY;
+    double radius;
+    double fieldOfView; // radians, the whole angle seen by the lens
+    double roll;        // radians, rotation of the circle about its center
+};
+
+struct Calibration
+{
+    std::array<LensCalibration, 2> lenses;
+    // Angular width of the band around the horizon of the lenses where the
+    // two images are blended, radians
+    double seamWidth;
+};
+
+// The calibration for a typical camera with ~195° lenses, with the values
+// found in dual-fisheye.ini in the config location of the app taking priority
+Calibration calibration();
+
+// Whether the file is a dual-fisheye frame. Files with the .insp extension
+// are, others are recognized by image, which may be a downscaled version of
+// the file: a 2:1 frame with dark gaps around the two circles.
+bool detect(const QString& path, const QImage& image);
+// Whether the file is a dual-fisheye frame judging by the name only
+bool detect(const QString& path);
+
+}
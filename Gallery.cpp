@@ -1,4 +1,5 @@
 #include "Gallery.hpp"
+#include <QDebug>
 #include <QTimer>
 #include <QPainter>
 #include <QScroller>
@@ -6,6 +7,7 @@
 #include <QFontMetrics>
 #include "Utils.hpp"
 #include "ImageFinder.hpp"
+#include "GallerySnapshot.hpp"
 
 namespace
 {
@@ -17,11 +19,19 @@ constexpr int BASE_ICON_SIZE = 192;
 #endif
 
 constexpr int ICON_SPACING = 2;
+constexpr int DRAIN_PERIOD = 1000 / 30; // ms
+// Decoded thumbnails taken per drain, to keep the UI responsive
+constexpr int MAX_THUMBNAILS_PER_DRAIN = 16;
+// Enough thumbnails and date icons for the first few screens of the gallery
+constexpr qint64 MAX_SNAPSHOT_IMAGE_BYTES = 16 << 20;
+constexpr unsigned long FINDER_STOP_TIMEOUT = 1000; // ms
 
 enum
 {
     FilePathRole = Qt::UserRole,
     ImageDateTimeRole,
+    ModificationTimeRole,
+    FileSizeRole,
 };
 
 QDateTime dateTime(const QListWidgetItem*const item)
@@ -30,7 +40,7 @@ QDateTime dateTime(const QListWidgetItem*const item)
     return item->data(ImageDateTimeRole).toDateTime();
 }
 
-QIcon createDateIcon(const QDate& date, const int width, const int height, const double scale)
+QImage createDateImage(const QDate& date, const int width, const int height, const double scale)
 {
     QImage img(width * scale, height * scale, QImage::Format_RGBA8888);
     img.fill(Qt::transparent);
@@ -46,7 +56,12 @@ QIcon createDateIcon(const QDate& date, const int width, const int height, const
         p.setPen(Qt::white);
     p.drawText(img.rect(), Qt::AlignLeft | Qt::AlignVCenter, string);
     img.setDevicePixelRatio(scale);
-    return QIcon(QPixmap::fromImage(img));
+    return img;
+}
+
+QIcon createDateIcon(const QDate& date, const int width, const int height, const double scale)
+{
+    return QIcon(QPixmap::fromImage(createDateImage(date, width, height, scale)));
 }
 
 int compare(const QListWidgetItem*const a, const QListWidgetItem*const b)
@@ -87,6 +102,7 @@ Gallery::Gallery(QWidget* parent)
     , thumbnailWidth_(BASE_ICON_SIZE * devicePixelRatio())
     , imageFinder_(new ImageFinder(thumbnailWidth_, this))
     , layout_(new QGridLayout)
+    , thumbnailMemory_(MemoryBudget::Category::Thumbnails, 0)
 {
     QScroller::grabGesture(this, QScroller::LeftMouseButtonGesture);
     setViewMode(QListView::IconMode);
@@ -103,9 +119,15 @@ Gallery::Gallery(QWidget* parent)
     empty = empty.scaled(thumbnailWidth_, thumbnailWidth_ / 2);
     emptyIcon_ = QIcon(QPixmap::fromImage(empty));
 
-    connect(imageFinder_, &ImageFinder::imageFound, this, &Gallery::addImage, Qt::QueuedConnection);
-    connect(imageFinder_, &ImageFinder::thumbnailReady, this, &Gallery::updateThumbnail, Qt::QueuedConnection);
-    imageFinder_->start();
+    restoreSnapshot();
+
+    connect(&drainTimer_, &QTimer::timeout, this, &Gallery::drainImageFinder);
+    // Let the window appear before the scan competes with it for the CPU and storage
+    QTimer::singleShot(0, this, [this]
+    {
+        imageFinder_->start(QThread::LowPriority);
+        drainTimer_.start(DRAIN_PERIOD);
+    });
 }
 
 // This function tries to make sure that the items are sorted by datetime in descending order.
@@ -132,41 +154,229 @@ int Gallery::findRowForItem(const QListWidgetItem*const newItem) const
     return left;
 }
 
-void Gallery::addImage(const ImageInfo& info)
+QListWidgetItem* Gallery::createImageItem(const ImageInfo& info, const QIcon& icon)
 {
     const auto item = new QListWidgetItem;
-    item->setIcon(emptyIcon_);
+    item->setIcon(icon);
     item->setData(FilePathRole, info.path);
     item->setData(ImageDateTimeRole, info.dateTime);
+    item->setData(ModificationTimeRole, info.modificationTime);
+    item->setData(FileSizeRole, info.fileSize);
     item->setFlags(item->flags() & ~Qt::ItemIsSelectable);
-    const int row = findRowForItem(item);
-    insertItem(row, item);
     pathMap_[info.path] = item;
     itemMap_[item] = info.path;
+    return item;
+}
+
+QListWidgetItem* Gallery::createDateItem(const QDateTime& dateTime, const QIcon& icon)
+{
+    const auto dateItem = new QListWidgetItem;
+    dateItem->setIcon(icon);
+    dateItem->setData(ImageDateTimeRole, dateTime);
+    dateItem->setFlags(dateItem->flags() & ~Qt::ItemIsSelectable);
+    datesDesignated_[dateTime.date()] = dateItem;
+    return dateItem;
+}
+
+void Gallery::addImage(const ImageInfo& info)
+{
+    // The snapshot may already have the image. Then only a change of its
+    // date matters, which needs the item to be moved.
+    unconfirmed_.erase(info.path);
+    const auto existing = pathMap_.find(info.path);
+    if(existing != pathMap_.end())
+    {
+        existing->second->setData(ModificationTimeRole, info.modificationTime);
+        existing->second->setData(FileSizeRole, info.fileSize);
+        if(dateTime(existing->second) == info.dateTime)
+            return;
+        removeImage(info.path);
+    }
+
+    const auto item = createImageItem(info, emptyIcon_);
+    const int row = findRowForItem(item);
+    insertItem(row, item);
 
     const auto date = info.dateTime.date();
     if(datesDesignated_.find(date) == datesDesignated_.end())
     {
-        const auto dateItem = new QListWidgetItem;
         const auto icon = createDateIcon(date, iconSize().width(),
                                          iconSize().height(), devicePixelRatio());
-        dateItem->setIcon(icon);
-        dateItem->setData(ImageDateTimeRole, info.dateTime);
-        dateItem->setFlags(item->flags() & ~Qt::ItemIsSelectable);
-        datesDesignated_[date] = dateItem;
-        insertItem(row, dateItem);
+        insertItem(row, createDateItem(info.dateTime, icon));
     }
+}
+
+void Gallery::drainImageFinder()
+{
+    // The flags are read before draining, so that whatever was pushed before
+    // they were set is drained now
+    const bool scanFinished = imageFinder_->scanFinished();
+    const bool finderFinished = imageFinder_->isFinished();
 
+    bool added = false;
+    while(auto info = imageFinder_->foundImages().tryPop())
+    {
+        addImage(*info);
+        added = true;
+    }
+    if(added)
+        updateLayout();
+    if(scanFinished && !scanFinished_)
+        handleScanFinished();
+
+    for(int n = 0; n < MAX_THUMBNAILS_PER_DRAIN; ++n)
+    {
+        const auto thumbnail = imageFinder_->thumbnails().tryPop();
+        if(!thumbnail) break;
+        updateThumbnail(thumbnail->path, thumbnail->image);
+    }
+
+    if(finderFinished && imageFinder_->thumbnails().empty())
+    {
+        drainTimer_.stop();
+        if(scanFinished_)
+            storeSnapshot();
+    }
+}
+
+void Gallery::removeImage(const QString& path)
+{
+    const auto itemIt = pathMap_.find(path);
+    if(itemIt == pathMap_.end()) return;
+    const auto item = itemIt->second;
+    const int row = this->row(item);
+    thumbnailCount_ -= item->icon().cacheKey() != emptyIcon_.cacheKey();
+    delete takeItem(row);
+    pathMap_.erase(itemIt);
+    itemMap_.erase(item);
+    snapshotThumbnails_.erase(path);
+    updateThumbnailMemory();
+
+    // The date header goes away with the last image of its date
+    if(row == 0) return;
+    const auto dateIt = datesDesignated_.find(dateTime(this->item(row - 1)).date());
+    if(dateIt != datesDesignated_.end() && dateIt->second == this->item(row - 1) &&
+       (row == count() || !this->item(row)->data(FilePathRole).isValid()))
+    {
+        delete takeItem(row - 1);
+        datesDesignated_.erase(dateIt);
+    }
+}
+
+void Gallery::handleScanFinished()
+{
+    scanFinished_ = true;
+    if(unconfirmed_.empty()) return;
+    qDebug() << unconfirmed_.size() << "images from the gallery snapshot are gone";
+    for(const auto& path : unconfirmed_)
+        removeImage(path);
+    unconfirmed_.clear();
     updateLayout();
 }
 
+void Gallery::restoreSnapshot()
+{
+    const QSize imageSize(thumbnailWidth_, thumbnailWidth_ / 2);
+    auto snapshot = GallerySnapshot::load(imageSize, Utils::isDarkMode());
+    if(!snapshot) return;
+
+    std::map<QDate, QIcon> sectionIcons;
+    for(const auto& section : snapshot->sections)
+    {
+        auto icon = section.icon;
+        icon.setDevicePixelRatio(devicePixelRatio());
+        sectionIcons[section.date] = QIcon(QPixmap::fromImage(icon));
+    }
+
+    // The entries are already in the gallery order
+    std::unordered_map<QString, ImageFinder::KnownImage> knownImages;
+    bool dateIconsMissing = false;
+    for(const auto& entry : snapshot->entries)
+    {
+        const ImageInfo info{entry.path, entry.dateTime, entry.modificationTime, entry.fileSize};
+        const auto date = entry.dateTime.date();
+        if(datesDesignated_.find(date) == datesDesignated_.end())
+        {
+            const auto icon = sectionIcons.find(date);
+            dateIconsMissing |= icon == sectionIcons.end();
+            addItem(createDateItem(entry.dateTime, icon != sectionIcons.end() ? icon->second : QIcon()));
+        }
+        const bool hasThumbnail = !entry.thumbnail.isNull();
+        addItem(createImageItem(info, hasThumbnail ? QIcon(QPixmap::fromImage(entry.thumbnail)) : emptyIcon_));
+        if(hasThumbnail)
+        {
+            snapshotThumbnails_[entry.path] = entry.thumbnail.copy();
+            ++thumbnailCount_;
+        }
+        unconfirmed_.insert(entry.path);
+        knownImages[entry.path] = {info, hasThumbnail};
+    }
+    imageFinder_->setKnownImages(std::move(knownImages));
+    updateThumbnailMemory();
+    updateLayout();
+    qDebug() << "Restored" << snapshot->entries.size() << "images from the gallery snapshot";
+
+    // Rendering text is slow, so the headers that are further down get their
+    // icons after the gallery is on the screen
+    if(dateIconsMissing)
+        QTimer::singleShot(0, this, &Gallery::renderMissingDateIcons);
+}
+
+void Gallery::renderMissingDateIcons()
+{
+    for(const auto& [date, item] : datesDesignated_)
+    {
+        if(item->icon().isNull())
+            item->setIcon(createDateIcon(date, iconSize().width(), iconSize().height(), devicePixelRatio()));
+    }
+}
+
+void Gallery::storeSnapshot()
+{
+    const QSize imageSize(thumbnailWidth_, thumbnailWidth_ / 2);
+    int imagesLeft = MAX_SNAPSHOT_IMAGE_BYTES / (qint64(imageSize.width()) * imageSize.height() * 4);
+    GallerySnapshot::Snapshot snapshot;
+    for(int n = 0; n < count(); ++n)
+    {
+        const auto currItem = item(n);
+        const auto path = currItem->data(FilePathRole);
+        if(!path.isValid())
+        {
+            if(imagesLeft-- > 0)
+                snapshot.sections.push_back({dateTime(currItem).date(),
+                                             createDateImage(dateTime(currItem).date(), imageSize.width(),
+                                                             imageSize.height(), 1)});
+            continue;
+        }
+        QImage thumbnail;
+        const auto thumbnailIt = snapshotThumbnails_.find(path.toString());
+        if(thumbnailIt != snapshotThumbnails_.end() && imagesLeft-- > 0)
+            thumbnail = thumbnailIt->second;
+        snapshot.entries.push_back({path.toString(), dateTime(currItem),
+                                    currItem->data(ModificationTimeRole).toLongLong(),
+                                    currItem->data(FileSizeRole).toLongLong(), thumbnail});
+    }
+    GallerySnapshot::store(snapshot, imageSize, Utils::isDarkMode());
+}
+
 void Gallery::updateThumbnail(const QString& path, const QImage& thumbnail)
 {
     const auto itemIt = pathMap_.find(path);
     if(itemIt == pathMap_.end()) return;
     const auto item = itemIt->second;
     assert(item->data(FilePathRole).toString() == path);
+    thumbnailCount_ += item->icon().cacheKey() == emptyIcon_.cacheKey();
     item->setIcon(QIcon(QPixmap::fromImage(thumbnail)));
+    // Thumbnails arrive newest first, so these are the first screens
+    if(qint64(snapshotThumbnails_.size()) * thumbnail.sizeInBytes() < MAX_SNAPSHOT_IMAGE_BYTES)
+        snapshotThumbnails_[path] = thumbnail;
+    updateThumbnailMemory();
+}
+
+void Gallery::updateThumbnailMemory()
+{
+    const qint64 thumbnailBytes = qint64(thumbnailWidth_) * (thumbnailWidth_ / 2) * 4;
+    thumbnailMemory_.resize((thumbnailCount_ + qint64(snapshotThumbnails_.size())) * thumbnailBytes);
 }
 
 void Gallery::handleItemClick(const QListWidgetItem* item)
@@ -175,6 +385,20 @@ void Gallery::handleItemClick(const QListWidgetItem* item)
         emit openFileRequest(item->data(FilePathRole).toString());
 }
 
+QString Gallery::adjacentPath(const QString& path, const int step) const
+{
+    const auto it = pathMap_.find(path);
+    if(it == pathMap_.end()) return {};
+    // Skip the date items
+    for(int n = row(it->second) + step; n >= 0 && n < count(); n += step)
+    {
+        const auto itemPath = item(n)->data(FilePathRole);
+        if(itemPath.isValid())
+            return itemPath.toString();
+    }
+    return {};
+}
+
 void Gallery::resizeEvent(QResizeEvent*)
 {
     updateLayout();
@@ -223,5 +447,17 @@ void Gallery::updateLayout()
 Gallery::~Gallery()
 {
     imageFinder_->stop();
-    imageFinder_->wait();
+    // The finder checks for the stop between chunks of file data and rows of
+    // HDR images, but a read from a stalled file system, like a network
+    // mount that went away, can block it for as long as the system wants.
+    // It doesn't touch the gallery, so then it's left to finish on its own.
+    if(!imageFinder_->wait(FINDER_STOP_TIMEOUT))
+    {
+        qWarning() << "Image finder didn't stop in time, leaving it behind";
+        imageFinder_->setParent(nullptr);
+        connect(imageFinder_, &QThread::finished, imageFinder_, &QObject::deleteLater);
+        // In case it finished before the connection was made
+        if(imageFinder_->isFinished())
+            imageFinder_->deleteLater();
+    }
 }
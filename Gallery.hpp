@@ -2,8 +2,11 @@
 
 #include <map>
 #include <vector>
+#include <unordered_set>
 #include <QDate>
+#include <QTimer>
 #include <QListWidget>
+#include "MemoryBudget.hpp"
 
 struct ImageInfo;
 class QGridLayout;
@@ -15,13 +18,25 @@ class Gallery : public QListWidget
 public:
     Gallery(QWidget* parent = nullptr);
     ~Gallery();
+    // The file step items away from path in the gallery order (newest first),
+    // or an empty string if there's none or path isn't in the gallery
+    QString adjacentPath(const QString& path, int step) const;
 
 protected:
     void resizeEvent(QResizeEvent* event) override;
 
 private:
+    QListWidgetItem* createImageItem(const ImageInfo& info, const QIcon& icon);
+    QListWidgetItem* createDateItem(const QDateTime& dateTime, const QIcon& icon);
     void addImage(const ImageInfo& info);
+    void removeImage(const QString& path);
+    void drainImageFinder();
+    void handleScanFinished();
+    void restoreSnapshot();
+    void storeSnapshot();
+    void renderMissingDateIcons();
     void updateThumbnail(const QString& path, const QImage& thumbnail);
+    void updateThumbnailMemory();
     void handleItemClick(const QListWidgetItem* item);
     int findRowForItem(const QListWidgetItem*const item) const;
     void updateLayout();
@@ -43,4 +58,13 @@ private:
     std::unordered_map<QListWidgetItem*, QString/*path*/> itemMap_;
     QIcon emptyIcon_;
     std::map<QDate, QListWidgetItem*> datesDesignated_;
+    // Images restored from the snapshot that the scan hasn't found yet
+    std::unordered_set<QString> unconfirmed_;
+    // Thumbnails of the first screens, to be put into the next snapshot
+    std::unordered_map<QString, QImage> snapshotThumbnails_;
+    // Items whose icon is a thumbnail rather than emptyIcon_
+    qint64 thumbnailCount_ = 0;
+    MemoryBudget::Allocation thumbnailMemory_;
+    bool scanFinished_ = false;
+    QTimer drainTimer_;
 };
@@ -0,0 +1,201 @@
+#include "GallerySnapshot.hpp"
+#include <limits>
+#include <cstring>
+#include <QDir>
+#include <QDebug>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+namespace
+{
+
+constexpr char MAGIC[8] = {'4','p','i','G','a','l','S','n'};
+constexpr quint32 VERSION = 1;
+constexpr qint64 DATA_ALIGNMENT = 4096;
+constexpr qint64 INVALID_DATE_TIME = std::numeric_limits<qint64>::min();
+
+struct FileHeader
+{
+    char magic[8];
+    quint32 version;
+    quint32 imageWidth;
+    quint32 imageHeight;
+    quint32 darkMode;
+    quint32 entryCount;
+    quint32 sectionCount;
+    quint32 imageCount;
+    quint32 reserved;
+    quint64 stringsOffset;
+    quint64 imagesOffset;
+};
+
+struct EntryRecord
+{
+    qint64 dateTime; // ms since epoch
+    qint64 modificationTime;
+    qint64 fileSize;
+    quint64 pathOffset;
+    quint32 pathLength; // UTF-16 code units
+    qint32 thumbnail;   // index in the image strip, or -1
+};
+
+struct SectionRecord
+{
+    qint64 julianDay;
+    qint32 icon;
+    qint32 reserved;
+};
+
+QString snapshotDir()
+{
+    return QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+}
+
+QString snapshotPath()
+{
+    return snapshotDir() + "/gallery.snapshot";
+}
+
+qint64 alignUp(const qint64 value, const qint64 alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+}
+
+namespace GallerySnapshot
+{
+
+std::optional<Snapshot> load(const QSize& imageSize, const bool darkMode)
+{
+    auto file = std::make_shared<QFile>(snapshotPath());
+    if(!file->open(QFile::ReadOnly))
+        return std::nullopt;
+    const qint64 fileSize = file->size();
+    const uchar*const data = file->map(0, fileSize);
+    if(!data || fileSize < qint64(sizeof(FileHeader)))
+        return std::nullopt;
+
+    FileHeader header;
+    std::memcpy(&header, data, sizeof header);
+    if(std::memcmp(header.magic, MAGIC, sizeof MAGIC) || header.version != VERSION)
+        return std::nullopt;
+    const qint64 recordsEnd = sizeof header + qint64(header.entryCount) * sizeof(EntryRecord) +
+                                              qint64(header.sectionCount) * sizeof(SectionRecord);
+    const qint64 imageBytes = qint64(header.imageWidth) * header.imageHeight * 4;
+    if(recordsEnd > fileSize || qint64(header.stringsOffset) > fileSize ||
+       qint64(header.imagesOffset) + header.imageCount * imageBytes > fileSize)
+    {
+        qWarning() << "Gallery snapshot is truncated";
+        return std::nullopt;
+    }
+
+    const bool imagesUsable = QSize(header.imageWidth, header.imageHeight) == imageSize;
+    const auto image = [&](const qint32 index, const QImage::Format format)
+    {
+        if(!imagesUsable || index < 0 || quint32(index) >= header.imageCount)
+            return QImage();
+        return QImage(data + header.imagesOffset + index * imageBytes, imageSize.width(),
+                      imageSize.height(), imageSize.width() * 4, format);
+    };
+
+    Snapshot snapshot;
+    snapshot.entries.reserve(header.entryCount);
+    const uchar* records = data + sizeof header;
+    for(quint32 n = 0; n < header.entryCount; ++n, records += sizeof(EntryRecord))
+    {
+        EntryRecord record;
+        std::memcpy(&record, records, sizeof record);
+        if(header.stringsOffset + (record.pathOffset + record.pathLength) * sizeof(char16_t) > quint64(fileSize))
+            return std::nullopt;
+        QString path(record.pathLength, Qt::Uninitialized);
+        std::memcpy(path.data(), data + header.stringsOffset + record.pathOffset * sizeof(char16_t),
+                    record.pathLength * sizeof(char16_t));
+        snapshot.entries.push_back({std::move(path),
+                                    record.dateTime == INVALID_DATE_TIME ? QDateTime()
+                                                                         : QDateTime::fromMSecsSinceEpoch(record.dateTime),
+                                    record.modificationTime, record.fileSize,
+                                    image(record.thumbnail, QImage::Format_RGB32)});
+    }
+    for(quint32 n = 0; n < header.sectionCount; ++n, records += sizeof(SectionRecord))
+    {
+        SectionRecord record;
+        std::memcpy(&record, records, sizeof record);
+        if(bool(header.darkMode) != darkMode)
+            continue;
+        const auto icon = image(record.icon, QImage::Format_ARGB32_Premultiplied);
+        if(!icon.isNull())
+            snapshot.sections.push_back({QDate::fromJulianDay(record.julianDay), icon});
+    }
+    snapshot.mapping = std::move(file);
+    return snapshot;
+}
+
+bool store(const Snapshot& snapshot, const QSize& imageSize, const bool darkMode)
+{
+    std::vector<EntryRecord> entries;
+    std::vector<SectionRecord> sections;
+    std::vector<std::pair<const QImage*, QImage::Format>> images;
+    QString strings;
+    for(const auto& entry : snapshot.entries)
+    {
+        const bool hasThumbnail = entry.thumbnail.size() == imageSize;
+        entries.push_back({entry.dateTime.isValid() ? entry.dateTime.toMSecsSinceEpoch() : INVALID_DATE_TIME,
+                           entry.modificationTime, entry.fileSize, quint64(strings.size()),
+                           quint32(entry.path.size()), hasThumbnail ? qint32(images.size()) : -1});
+        strings += entry.path;
+        if(hasThumbnail)
+            images.push_back({&entry.thumbnail, QImage::Format_RGB32});
+    }
+    for(const auto& section : snapshot.sections)
+    {
+        if(section.icon.size() != imageSize) continue;
+        sections.push_back({section.date.toJulianDay(), qint32(images.size()), 0});
+        images.push_back({&section.icon, QImage::Format_ARGB32_Premultiplied});
+    }
+
+    if(!QDir().mkpath(snapshotDir()))
+        return false;
+    QSaveFile file(snapshotPath());
+    if(!file.open(QFile::WriteOnly))
+    {
+        qWarning() << "Failed to open gallery snapshot for writing:" << file.errorString();
+        return false;
+    }
+
+    FileHeader header = {};
+    std::memcpy(header.magic, MAGIC, sizeof MAGIC);
+    header.version = VERSION;
+    header.imageWidth = imageSize.width();
+    header.imageHeight = imageSize.height();
+    header.darkMode = darkMode;
+    header.entryCount = entries.size();
+    header.sectionCount = sections.size();
+    header.imageCount = images.size();
+    header.stringsOffset = sizeof header + entries.size() * sizeof(EntryRecord) +
+                                           sections.size() * sizeof(SectionRecord);
+    header.imagesOffset = alignUp(header.stringsOffset + strings.size() * sizeof(char16_t), DATA_ALIGNMENT);
+    file.write(reinterpret_cast<const char*>(&header), sizeof header);
+    file.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(EntryRecord));
+    file.write(reinterpret_cast<const char*>(sections.data()), sections.size() * sizeof(SectionRecord));
+    file.write(reinterpret_cast<const char*>(strings.constData()), strings.size() * sizeof(char16_t));
+    file.write(QByteArray(header.imagesOffset - file.pos(), 0));
+
+    // Thumbnails are opaque, date icons aren't; both are stored in the
+    // format QPixmap uses for them, so that no conversion is needed on load
+    for(const auto& [image, format] : images)
+    {
+        const auto converted = image->convertToFormat(format);
+        for(int y = 0; y < converted.height(); ++y)
+            file.write(reinterpret_cast<const char*>(converted.constScanLine(y)), converted.width() * 4);
+    }
+    if(!file.commit())
+    {
+        qWarning() << "Failed to write gallery snapshot:" << file.errorString();
+        return false;
+    }
+    qDebug() << "Stored gallery snapshot with" << entries.size() << "entries and" << images.size() << "images";
+    return true;
+}
+
+}
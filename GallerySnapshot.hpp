@@ -0,0 +1,47 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <optional>
+#include <QFile>
+#include <QImage>
+#include <QDateTime>
+
+// The state of the gallery as it was last seen, so that the next launch can
+// show it populated in the first frame while the scan of the storage runs.
+// The file is memory-mapped, and the images of the snapshot point into the
+// mapping: they are only valid while the Snapshot exists.
+namespace GallerySnapshot
+{
+
+struct Entry
+{
+    QString path;
+    QDateTime dateTime;
+    qint64 modificationTime; // ms since epoch
+    qint64 fileSize;
+    QImage thumbnail;        // Format_RGB32 if present
+};
+
+struct Section
+{
+    QDate date;
+    QImage icon;             // Format_ARGB32_Premultiplied if present
+};
+
+struct Snapshot
+{
+    std::vector<Entry> entries;     // in gallery order, newest first
+    std::vector<Section> sections;  // in gallery order, only those having an icon
+    std::shared_ptr<QFile> mapping;
+};
+
+// All images of the snapshot have the same size, imageSize. Thumbnails and
+// icons stored with another size are dropped, as are the date icons rendered
+// for the other color scheme.
+std::optional<Snapshot> load(const QSize& imageSize, bool darkMode);
+// Writes the snapshot, replacing the previous one. The images that are
+// present must have size imageSize.
+bool store(const Snapshot& snapshot, const QSize& imageSize, bool darkMode);
+
+}
@@ -0,0 +1,561 @@
+#include "HdrImage.hpp"
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <QFile>
+#include <QDebug>
+#include <QObject>
+#include <QFileInfo>
+#include <QColorSpace>
+#include <QImageReader>
+#ifdef HAVE_OPENEXR
+# include <ImfRgbaFile.h>
+#endif
+#include "StoppableFile.hpp"
+
+namespace
+{
+
+// Largest value representable in RGB9E5
+constexpr float RGB9E5_MAX = 65408;
+// Rows read from an EXR file at once, a multiple of the usual chunk heights
+constexpr int EXR_ROWS_PER_READ = 32;
+// Middle gray the automatic exposure of thumbnails maps the mean to
+constexpr float KEY_VALUE = 0.18f;
+
+// Gives the image rows as linear RGB floats, from top to bottom
+class RowReader
+{
+public:
+    virtual ~RowReader() = default;
+    QSize size() const { return size_; }
+    QString errorString() const { return errorString_; }
+    virtual bool readRow(float* rgb) = 0;
+
+protected:
+    QSize size_;
+    QString errorString_;
+};
+
+class RadianceReader : public RowReader
+{
+    FILE* file_ = nullptr;
+    // Each pixel is R, G, B mantissas and a shared exponent
+    std::vector<uchar> rgbe_;
+    float scale_ = 1;
+
+public:
+    bool open(const QString& path)
+    {
+        file_ = std::fopen(QFile::encodeName(path).constData(), "rb");
+        if(!file_)
+        {
+            errorString_ = QObject::tr("Failed to open the file");
+            return false;
+        }
+        char line[512];
+        if(!std::fgets(line, sizeof line, file_) || std::strncmp(line, "#?", 2) != 0)
+        {
+            errorString_ = QObject::tr("Not a Radiance file");
+            return false;
+        }
+        while(std::fgets(line, sizeof line, file_) && line[0] != '\n')
+        {
+            if(std::strncmp(line, "FORMAT=", 7) == 0 && std::strncmp(line + 7, "32-bit_rle_rgbe", 15) != 0)
+            {
+                errorString_ = QObject::tr("Unsupported Radiance pixel format: %1").arg(QString(line + 7).trimmed());
+                return false;
+            }
+            // The pixels have been multiplied by the exposure after capture
+            if(std::strncmp(line, "EXPOSURE=", 9) == 0)
+            {
+                const double exposure = std::atof(line + 9);
+                if(exposure > 0)
+                    scale_ /= exposure;
+            }
+        }
+        int width = 0, height = 0;
+        if(!std::fgets(line, sizeof line, file_) || std::sscanf(line, "-Y %d +X %d", &height, &width) != 2 ||
+           width <= 0 || height <= 0)
+        {
+            errorString_ = QObject::tr("Unsupported Radiance image orientation or size");
+            return false;
+        }
+        size_ = QSize(width, height);
+        rgbe_.resize(std::size_t(width) * 4);
+        return true;
+    }
+
+    ~RadianceReader()
+    {
+        if(file_)
+            std::fclose(file_);
+    }
+
+    bool readRow(float*const rgb) override
+    {
+        if(!readScanline())
+        {
+            if(errorString_.isEmpty())
+                errorString_ = QObject::tr("Unexpected end of file");
+            return false;
+        }
+        for(int x = 0; x < size_.width(); ++x)
+        {
+            const uchar*const p = &rgbe_[x * 4];
+            const float f = p[3] ? std::ldexp(scale_, p[3] - (128 + 8)) : 0.f;
+            rgb[x * 3 + 0] = (p[0] + 0.5f) * f;
+            rgb[x * 3 + 1] = (p[1] + 0.5f) * f;
+            rgb[x * 3 + 2] = (p[2] + 0.5f) * f;
+        }
+        return true;
+    }
+
+private:
+    bool readScanline()
+    {
+        const int width = size_.width();
+        uchar head[4];
+        if(std::fread(head, 1, 4, file_) != 4)
+            return false;
+        if(width < 8 || width > 0x7fff || head[0] != 2 || head[1] != 2 || (head[2] & 0x80))
+            return readFlatScanline(head);
+        if((head[2] << 8 | head[3]) != width)
+        {
+            errorString_ = QObject::tr("Corrupt run-length encoded scanline");
+            return false;
+        }
+        // Each channel is run-length encoded separately
+        for(int channel = 0; channel < 4; ++channel)
+        {
+            for(int x = 0; x < width;)
+            {
+                int count = std::getc(file_);
+                if(count == EOF) return false;
+                const bool run = count > 128;
+                if(run)
+                    count -= 128;
+                if(count == 0 || x + count > width)
+                {
+                    errorString_ = QObject::tr("Corrupt run-length encoded scanline");
+                    return false;
+                }
+                int value = run ? std::getc(file_) : 0;
+                for(const int end = x + count; x < end; ++x)
+                {
+                    if(!run)
+                        value = std::getc(file_);
+                    if(value == EOF) return false;
+                    rgbe_[x * 4 + channel] = value;
+                }
+            }
+        }
+        return true;
+    }
+
+    // Uncompressed pixels, possibly with the old-style runs, where (1,1,1,n)
+    // repeats the previous pixel, with consecutive runs making larger counts
+    bool readFlatScanline(const uchar*const head)
+    {
+        const int width = size_.width();
+        std::copy_n(head, 4, rgbe_.data());
+        int shift = 0;
+        for(int x = 1; x < width;)
+        {
+            uchar* const p = &rgbe_[x * 4];
+            if(std::fread(p, 1, 4, file_) != 4)
+                return false;
+            if(p[0] == 1 && p[1] == 1 && p[2] == 1)
+            {
+                const int count = std::min(p[3] << shift, width - x);
+                for(int n = 0; n < count; ++n, ++x)
+                    std::copy_n(&rgbe_[(x - 1) * 4], 4, &rgbe_[x * 4]);
+                shift += 8;
+            }
+            else
+            {
+                shift = 0;
+                ++x;
+            }
+        }
+        return true;
+    }
+};
+
+#ifdef HAVE_OPENEXR
+class ExrReader : public RowReader
+{
+    std::unique_ptr<Imf::RgbaInputFile> file_;
+    Imath::Box2i dataWindow_;
+    std::vector<Imf::Rgba> buffer_;
+    int bufferFirstRow_ = 0, bufferRows_ = 0;
+    int nextRow_ = 0;
+
+public:
+    bool open(const QString& path)
+    {
+        try
+        {
+            file_ = std::make_unique<Imf::RgbaInputFile>(QFile::encodeName(path).constData());
+        }
+        catch(const std::exception& ex)
+        {
+            errorString_ = ex.what();
+            return false;
+        }
+        dataWindow_ = file_->dataWindow();
+        size_ = QSize(dataWindow_.max.x - dataWindow_.min.x + 1, dataWindow_.max.y - dataWindow_.min.y + 1);
+        buffer_.resize(std::size_t(size_.width()) * EXR_ROWS_PER_READ);
+        return true;
+    }
+
+    bool readRow(float*const rgb) override
+    {
+        const int width = size_.width();
+        if(nextRow_ == bufferFirstRow_ + bufferRows_)
+        {
+            // The library decodes whole chunks of rows, so rows are read in batches
+            bufferFirstRow_ = nextRow_;
+            bufferRows_ = std::min(EXR_ROWS_PER_READ, size_.height() - nextRow_);
+            const int y = dataWindow_.min.y + bufferFirstRow_;
+            try
+            {
+                file_->setFrameBuffer(buffer_.data() - dataWindow_.min.x - std::ptrdiff_t(y) * width, 1, width);
+                file_->readPixels(y, y + bufferRows_ - 1);
+            }
+            catch(const std::exception& ex)
+            {
+                errorString_ = ex.what();
+                return false;
+            }
+        }
+        const Imf::Rgba*const pixels = &buffer_[std::size_t(nextRow_ - bufferFirstRow_) * width];
+        for(int x = 0; x < width; ++x)
+        {
+            rgb[x * 3 + 0] = pixels[x].r;
+            rgb[x * 3 + 1] = pixels[x].g;
+            rgb[x * 3 + 2] = pixels[x].b;
+        }
+        ++nextRow_;
+        return true;
+    }
+};
+#endif
+
+// Whatever Qt's image plugins can read, decoded as a whole
+class QImageReaderReader : public RowReader
+{
+    QImage image_;
+    int nextRow_ = 0;
+
+public:
+    bool open(const QString& path, const std::atomic_bool*const mustStop, const bool headerOnly)
+    {
+        StoppableFile file(path, mustStop);
+        if(!file.open(QIODevice::ReadOnly))
+        {
+            errorString_ = file.errorString();
+            return false;
+        }
+        QImageReader reader(&file);
+        if(headerOnly)
+        {
+            size_ = reader.size();
+            if(!size_.isValid())
+                errorString_ = reader.errorString();
+            return size_.isValid();
+        }
+        image_ = reader.read();
+        if(image_.isNull())
+        {
+            errorString_ = reader.errorString();
+            return false;
+        }
+        // Plugins give linear data in float formats, and sRGB in the rest
+        if(QImage::toPixelFormat(image_.format()).typeInterpretation() != QPixelFormat::FloatingPoint)
+        {
+            if(!image_.colorSpace().isValid())
+                image_.setColorSpace(QColorSpace::SRgb);
+            image_.convertToColorSpace(QColorSpace::SRgbLinear);
+        }
+        image_ = image_.convertToFormat(QImage::Format_RGBX32FPx4);
+        size_ = image_.size();
+        return true;
+    }
+
+    bool readRow(float*const rgb) override
+    {
+        const auto pixels = reinterpret_cast<const float*>(image_.constScanLine(nextRow_++));
+        for(int x = 0; x < size_.width(); ++x)
+        {
+            rgb[x * 3 + 0] = pixels[x * 4 + 0];
+            rgb[x * 3 + 1] = pixels[x * 4 + 1];
+            rgb[x * 3 + 2] = pixels[x * 4 + 2];
+        }
+        return true;
+    }
+};
+
+template<typename Reader, typename... Args>
+std::unique_ptr<RowReader> tryOpen(const QString& path, QString& errorString, const Args&... args)
+{
+    auto reader = std::make_unique<Reader>();
+    if(!reader->open(path, args...))
+    {
+        errorString = reader->errorString();
+        return nullptr;
+    }
+    return reader;
+}
+
+// The readers of Radiance and OpenEXR files read only the header on opening.
+// The fallback reads the whole image, unless headerOnly is set, in which case
+// it can only tell the size.
+std::unique_ptr<RowReader> openReader(const QString& path, QString& errorString,
+                                      const std::atomic_bool*const mustStop = nullptr,
+                                      const bool headerOnly = false)
+{
+    QFile file(path);
+    if(!file.open(QFile::ReadOnly))
+    {
+        errorString = file.errorString();
+        return nullptr;
+    }
+    const auto magic = file.read(4);
+    file.close();
+
+    if(magic.startsWith("#?"))
+        return tryOpen<RadianceReader>(path, errorString);
+#ifdef HAVE_OPENEXR
+    if(magic == QByteArray("\x76\x2f\x31\x01", 4))
+        return tryOpen<ExrReader>(path, errorString);
+#endif
+    return tryOpen<QImageReaderReader>(path, errorString, mustStop, headerOnly);
+}
+
+// Area-averaging downscaler for RGB float rows. Each source pixel goes to
+// the destination pixel it falls into, and a destination row is passed on
+// as soon as its last source row has been added.
+class RowDownscaler
+{
+public:
+    using RowHandler = std::function<void(int row, const float* rgb)>;
+
+    RowDownscaler(const QSize& srcSize, const QSize& dstSize, RowHandler handler)
+        : srcSize_(srcSize)
+        , dstSize_(dstSize)
+        , handler_(std::move(handler))
+        , dstColumns_(srcSize.width())
+        , columnCounts_(dstSize.width())
+        , sum_(std::size_t(dstSize.width()) * 3)
+    {
+        for(int x = 0; x < srcSize.width(); ++x)
+        {
+            dstColumns_[x] = dstColumn(x);
+            ++columnCounts_[dstColumns_[x]];
+        }
+    }
+
+    void addRow(const float*const rgb)
+    {
+        for(int x = 0; x < srcSize_.width(); ++x)
+        {
+            float*const sum = &sum_[dstColumns_[x] * 3];
+            sum[0] += rgb[x * 3 + 0];
+            sum[1] += rgb[x * 3 + 1];
+            sum[2] += rgb[x * 3 + 2];
+        }
+        ++rowsInSum_;
+        ++srcRow_;
+        if(srcRow_ < srcSize_.height() && dstRow(srcRow_) == dstRow_)
+            return;
+
+        for(int x = 0; x < dstSize_.width(); ++x)
+        {
+            const float norm = 1.f / (columnCounts_[x] * rowsInSum_);
+            for(int c = 0; c < 3; ++c)
+                sum_[x * 3 + c] *= norm;
+        }
+        handler_(dstRow_, sum_.data());
+        std::fill(sum_.begin(), sum_.end(), 0.f);
+        rowsInSum_ = 0;
+        ++dstRow_;
+    }
+
+private:
+    int dstColumn(const int x) const { return qint64(x) * dstSize_.width() / srcSize_.width(); }
+    int dstRow(const int y) const { return qint64(y) * dstSize_.height() / srcSize_.height(); }
+
+    QSize srcSize_, dstSize_;
+    RowHandler handler_;
+    std::vector<int> dstColumns_;
+    std::vector<int> columnCounts_;
+    std::vector<float> sum_;
+    int rowsInSum_ = 0;
+    int srcRow_ = 0;
+    int dstRow_ = 0;
+};
+
+// ACES filmic curve fit by K. Narkowicz, then sRGB encoding. Mirrors
+// toneMap() in the fragment shader of Canvas.
+float toneMap(float v)
+{
+    v = std::clamp(v * (2.51f * v + 0.03f) / (v * (2.43f * v + 0.59f) + 0.14f), 0.f, 1.f);
+    return v <= 0.0031308f ? 12.92f * v : 1.055f * std::pow(v, 1 / 2.4f) - 0.055f;
+}
+
+}
+
+namespace Hdr
+{
+
+bool isHdrFile(const QString& path)
+{
+    const auto suffix = QFileInfo(path).suffix().toLower();
+    return suffix == "hdr" || suffix == "exr";
+}
+
+QSize imageSize(const QString& path, QString& errorString, const std::atomic_bool*const mustStop)
+{
+    const auto reader = openReader(path, errorString, mustStop, true);
+    return reader ? reader->size() : QSize();
+}
+
+quint32 packRGB9E5(float r, float g, float b)
+{
+    // See the EXT_texture_shared_exponent spec. Written so that NaNs become 0.
+    r = r > 0 ? std::min(r, RGB9E5_MAX) : 0;
+    g = g > 0 ? std::min(g, RGB9E5_MAX) : 0;
+    b = b > 0 ? std::min(b, RGB9E5_MAX) : 0;
+    const float maxComponent = std::max({r, g, b});
+    if(maxComponent == 0)
+        return 0;
+    int exponent;
+    std::frexp(maxComponent, &exponent);
+    // Biased by 15, with 9 bits of mantissa
+    int sharedExponent = std::max(0, exponent + 15);
+    if(std::floor(maxComponent * std::ldexp(1.f, 24 - sharedExponent) + 0.5f) == 512)
+        ++sharedExponent;
+    const float scale = std::ldexp(1.f, 24 - sharedExponent);
+    const auto mantissa = [scale](const float v) { return quint32(std::floor(v * scale + 0.5f)); };
+    return mantissa(r) | mantissa(g) << 9 | mantissa(b) << 18 | quint32(sharedExponent) << 27;
+}
+
+void unpackRGB9E5(const quint32 texel, float rgb[3])
+{
+    const float scale = std::ldexp(1.f, int(texel >> 27) - 24);
+    rgb[0] = (texel & 511) * scale;
+    rgb[1] = (texel >> 9 & 511) * scale;
+    rgb[2] = (texel >> 18 & 511) * scale;
+}
+
+std::vector<QImage> decodeLevels(const QString& path, const int maxSize, QString& errorString)
+{
+    const auto reader = openReader(path, errorString);
+    if(!reader) return {};
+    const auto sourceSize = reader->size();
+
+    std::vector<QImage> levels;
+    for(auto size = sourceSize.boundedTo(QSize(maxSize, maxSize));; size = QSize(size.width() / 2, size.height() / 2).expandedTo(QSize(1,1)))
+    {
+        auto& level = levels.emplace_back(size, QImage::Format_RGB32);
+        if(level.isNull())
+        {
+            errorString = QObject::tr("Failed to allocate an image of %1×%2 pixels")
+                                .arg(size.width()).arg(size.height());
+            return {};
+        }
+        if(size == QSize(1,1))
+            break;
+    }
+
+    // Each level is made from the float rows of the previous one as they are
+    // finished, so the whole chain is built in a single pass over the source,
+    // without rounding to RGB9E5 in between.
+    std::vector<std::unique_ptr<RowDownscaler>> downscalers(levels.size());
+    for(int n = levels.size() - 1; n >= 0; --n)
+    {
+        const auto srcSize = n == 0 ? sourceSize : levels[n - 1].size();
+        downscalers[n] = std::make_unique<RowDownscaler>(srcSize, levels[n].size(),
+            [&levels, &downscalers, n](const int row, const float*const rgb)
+            {
+                auto& level = levels[n];
+                const auto texels = reinterpret_cast<quint32*>(level.scanLine(row));
+                for(int x = 0; x < level.width(); ++x)
+                    texels[x] = packRGB9E5(rgb[x * 3 + 0], rgb[x * 3 + 1], rgb[x * 3 + 2]);
+                if(n + 1 < int(downscalers.size()))
+                    downscalers[n + 1]->addRow(rgb);
+            });
+    }
+    if(sourceSize != levels[0].size())
+    {
+        qDebug().nospace() << "HDR image resolution of " << sourceSize.width() << "×" << sourceSize.height()
+                           << " exceeds " << maxSize << "×" << maxSize << ", will downscale while decoding";
+    }
+
+    std::vector<float> row(std::size_t(sourceSize.width()) * 3);
+    for(int y = 0; y < sourceSize.height(); ++y)
+    {
+        if(!reader->readRow(row.data()))
+        {
+            errorString = reader->errorString();
+            return {};
+        }
+        downscalers[0]->addRow(row.data());
+    }
+    return levels;
+}
+
+QImage decodeThumbnail(const QString& path, const QSize& size, QString& errorString,
+                       const std::atomic_bool*const mustStop)
+{
+    const auto reader = openReader(path, errorString, mustStop);
+    if(!reader) return {};
+    const auto sourceSize = reader->size();
+    const auto thumbSize = size.boundedTo(sourceSize);
+
+    std::vector<float> pixels(std::size_t(thumbSize.width()) * thumbSize.height() * 3);
+    RowDownscaler downscaler(sourceSize, thumbSize, [&](const int row, const float*const rgb)
+    {
+        std::copy_n(rgb, thumbSize.width() * 3, &pixels[std::size_t(row) * thumbSize.width() * 3]);
+    });
+    std::vector<float> row(std::size_t(sourceSize.width()) * 3);
+    for(int y = 0; y < sourceSize.height(); ++y)
+    {
+        if(mustStop && *mustStop)
+        {
+            errorString = QObject::tr("Reading stopped");
+            return {};
+        }
+        if(!reader->readRow(row.data()))
+        {
+            errorString = reader->errorString();
+            return {};
+        }
+        downscaler.addRow(row.data());
+    }
+
+    // Exposure maps the geometric mean of luminance to middle gray
+    double logSum = 0;
+    for(std::size_t n = 0; n < pixels.size(); n += 3)
+    {
+        const double luminance = 0.2126 * pixels[n] + 0.7152 * pixels[n + 1] + 0.0722 * pixels[n + 2];
+        logSum += std::log(std::max(luminance, 1e-6));
+    }
+    const float exposure = KEY_VALUE / std::exp(logSum / (pixels.size() / 3));
+
+    QImage image(thumbSize, QImage::Format_RGB888);
+    for(int y = 0; y < thumbSize.height(); ++y)
+    {
+        const float*const src = &pixels[std::size_t(y) * thumbSize.width() * 3];
+        uchar*const dst = image.scanLine(y);
+        for(int n = 0; n < thumbSize.width() * 3; ++n)
+            dst[n] = std::lround(255 * toneMap(src[n] * exposure));
+    }
+    return image;
+}
+
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <QImage>
+#include <QString>
+
+// High dynamic range panoramas: Radiance RGBE (.hdr), and OpenEXR, which is
+// read by the OpenEXR library if it was found at build time, and by Qt's
+// image plugins otherwise. Rows are streamed from the decoder through the
+// downscaler, and the result is kept in the shared-exponent RGB9E5 format,
+// which takes 4 bytes per pixel, as much as the LDR images do. Canvas
+// samples it as is and tone-maps the result.
+namespace Hdr
+{
+
+// Whether the file should be opened as HDR, judging by the name
+bool isHdrFile(const QString& path);
+// Size of the image, read from the header. Invalid on error, or if mustStop
+// was set while reading.
+QSize imageSize(const QString& path, QString& errorString, const std::atomic_bool* mustStop = nullptr);
+
+// RGB9E5 texels, as expected by GL for GL_UNSIGNED_INT_5_9_9_9_REV
+quint32 packRGB9E5(float r, float g, float b);
+void unpackRGB9E5(quint32 texel, float rgb[3]);
+
+// Decodes the image, downscaled to fit in maxSize×maxSize, and builds its mip
+// chain down to 1×1 in the same pass. The levels are QImage::Format_RGB32
+// images holding RGB9E5 texels in linear light, not displayable as they are.
+std::vector<QImage> decodeLevels(const QString& path, int maxSize, QString& errorString);
+// Decodes the image downscaled to size, tone-mapped with an automatic exposure.
+// Gives up, returning a null image, as soon as mustStop is set.
+QImage decodeThumbnail(const QString& path, const QSize& size, QString& errorString,
+                       const std::atomic_bool* mustStop = nullptr);
+
+}
@@ -0,0 +1,940 @@
+#include "ImageDecoder.hpp"
+#include <cmath>
+#include <mutex>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <csetjmp>
+#include <algorithm>
+#include <QFile>
+#include <QDebug>
+#include <QObject>
+#include <QtEndian>
+#include <QSemaphore>
+#include <QThreadPool>
+#include <QImageReader>
+#include "Utils.hpp"
+#include "Downscaler.hpp"
+#include "MemoryBudget.hpp"
+#ifdef HAVE_LIBJPEG
+# include <jpeglib.h>
+// Decoding parts of a JPEG independently needs jpeg_mem_src()
+# if JPEG_LIB_VERSION >= 80 || defined(MEM_SRCDST_SUPPORTED)
+#  define HAVE_JPEG_MEM_SRC
+# endif
+#endif
+#ifdef HAVE_LIBPNG
+# include <png.h>
+#endif
+#ifdef HAVE_LIBTIFF
+# include <tiffio.h>
+#endif
+
+namespace
+{
+
+// Strips per thread of the global pool for ImageDecoder::readStrips(), so
+// that threads that finish early can take more work
+constexpr int STRIPS_PER_THREAD = 2;
+// When the decoder can't be split, it runs in a thread of its own, passing
+// bands of rows of about this size to the thread handling them
+constexpr qint64 PIPELINE_BAND_BYTES = 4 << 20;
+constexpr int PIPELINE_BANDS = 3;
+
+int bytesPerPixel(const QImage::Format format)
+{
+    switch(format)
+    {
+    case QImage::Format_Grayscale8: return 1;
+    case QImage::Format_RGB888:     return 3;
+    default:                        return 4;
+    }
+}
+
+#ifdef HAVE_LIBJPEG
+class JpegDecoder : public ImageDecoder
+{
+    struct ErrorManager
+    {
+        jpeg_error_mgr pub;
+        std::jmp_buf jump;
+        char message[JMSG_LENGTH_MAX];
+    };
+
+    // The first MCU row after a point in the entropy-coded data where
+    // decoding can start, and the offset of that point in the file
+    struct RestartPoint
+    {
+        int mcuRow;
+        qint64 offset;
+    };
+
+    FILE* file_ = nullptr;
+    jpeg_decompress_struct cinfo_;
+    ErrorManager err_;
+    bool created_ = false;
+
+    QFile mappedFile_;
+    const uchar* data_ = nullptr;
+    qint64 sofOffset_ = -1;
+    qint64 scanStart_ = -1;
+    qint64 scanEnd_ = -1;
+    int mcuHeight_ = 0;
+    int mcuRows_ = 0;
+    std::vector<RestartPoint> restartPoints_;
+
+    static void errorExit(j_common_ptr cinfo)
+    {
+        const auto err = reinterpret_cast<ErrorManager*>(cinfo->err);
+        err->pub.format_message(cinfo, err->message);
+        std::longjmp(err->jump, 1);
+    }
+    static void outputMessage(j_common_ptr cinfo)
+    {
+        char message[JMSG_LENGTH_MAX];
+        cinfo->err->format_message(cinfo, message);
+        qWarning() << "libjpeg:" << message;
+    }
+
+public:
+    // Returns false if the file should be handled by another decoder
+    bool open(const QString& path)
+    {
+        mappedFile_.setFileName(path);
+        file_ = std::fopen(QFile::encodeName(path).constData(), "rb");
+        if(!file_) return false;
+
+        cinfo_.err = jpeg_std_error(&err_.pub);
+        err_.pub.error_exit = errorExit;
+        err_.pub.output_message = outputMessage;
+        if(setjmp(err_.jump))
+            return false;
+        jpeg_create_decompress(&cinfo_);
+        created_ = true;
+        jpeg_stdio_src(&cinfo_, file_);
+        jpeg_read_header(&cinfo_, true);
+
+        switch(cinfo_.jpeg_color_space)
+        {
+        case JCS_GRAYSCALE:
+            cinfo_.out_color_space = JCS_GRAYSCALE;
+            format_ = QImage::Format_Grayscale8;
+            break;
+        case JCS_CMYK:
+        case JCS_YCCK:
+            // libjpeg can't convert these to RGB, leave them to Qt
+            return false;
+        default:
+            cinfo_.out_color_space = JCS_RGB;
+            format_ = QImage::Format_RGB888;
+            break;
+        }
+        jpeg_calc_output_dimensions(&cinfo_);
+        sourceSize_ = QSize(cinfo_.image_width, cinfo_.image_height);
+        size_ = sourceSize_;
+        return true;
+    }
+
+    ~JpegDecoder()
+    {
+        if(created_)
+            jpeg_destroy_decompress(&cinfo_);
+        if(file_)
+            std::fclose(file_);
+    }
+
+    void setMinimumSize(const QSize& minSize) override
+    {
+        // IDCT scaling gives 1/2, 1/4 and 1/8 of the size at a fraction of
+        // the full decoding cost.
+        const auto scaledDim = [](const int dim, const int denom) { return (dim + denom - 1) / denom; };
+        for(const int denom : {8, 4, 2, 1})
+        {
+            if(scaledDim(sourceSize_.width(), denom) >= minSize.width() &&
+               scaledDim(sourceSize_.height(), denom) >= minSize.height())
+            {
+                cinfo_.scale_num = 1;
+                cinfo_.scale_denom = denom;
+                break;
+            }
+        }
+        if(setjmp(err_.jump))
+            return;
+        jpeg_calc_output_dimensions(&cinfo_);
+        size_ = QSize(cinfo_.output_width, cinfo_.output_height);
+    }
+
+    bool read(const QRect& rect, const RowHandler& handler) override
+    {
+        // Allocated before setjmp(), so that it's in a defined state after a longjmp()
+        std::vector<uchar> buffer(std::size_t(cinfo_.output_width) * cinfo_.output_components);
+        if(setjmp(err_.jump))
+        {
+            errorString_ = err_.message;
+            return false;
+        }
+        jpeg_start_decompress(&cinfo_);
+
+        JDIMENSION firstColumn = rect.x(), width = rect.width();
+#ifdef LIBJPEG_TURBO_VERSION
+        // Only decode the iMCU columns covering the rect, and skip the rows above it
+        if(firstColumn != 0 || width != cinfo_.output_width)
+            jpeg_crop_scanline(&cinfo_, &firstColumn, &width);
+        if(rect.top() > 0)
+            jpeg_skip_scanlines(&cinfo_, rect.top());
+#else
+        firstColumn = 0;
+#endif
+        const int offset = (rect.x() - int(firstColumn)) * cinfo_.output_components;
+        bool stopped = false;
+        while(cinfo_.output_scanline <= JDIMENSION(rect.bottom()))
+        {
+            const int row = cinfo_.output_scanline;
+            JSAMPROW rowPointer = buffer.data();
+            jpeg_read_scanlines(&cinfo_, &rowPointer, 1);
+            if(row < rect.top()) continue;
+            if(!handler(row, buffer.data() + offset))
+            {
+                stopped = true;
+                break;
+            }
+        }
+        if(!stopped && cinfo_.output_scanline == cinfo_.output_height)
+            jpeg_finish_decompress(&cinfo_);
+        else
+            jpeg_abort_decompress(&cinfo_);
+        return true;
+    }
+
+#ifdef HAVE_JPEG_MEM_SRC
+    bool canReadStrips() override
+    {
+        if(cinfo_.progressive_mode || cinfo_.restart_interval == 0)
+            return false;
+        if(!mappedFile_.open(QFile::ReadOnly))
+            return false;
+        data_ = mappedFile_.map(0, mappedFile_.size());
+        if(!data_ || !findRestartPoints(mappedFile_.size()))
+            return false;
+        // Strips can't be split finer than this, so there's nothing to gain without at least two
+        return restartPoints_.size() >= 2;
+    }
+
+    bool readStrips(const std::vector<Strip>& strips) override
+    {
+        std::mutex mutex;
+        std::atomic_bool failed{false};
+        Utils::parallelFor(int(strips.size()), [&](const int n)
+        {
+            if(failed) return;
+            QString error;
+            if(readStrip(strips[n], failed, error))
+                return;
+            failed = true;
+            const std::lock_guard lock(mutex);
+            if(errorString_.isEmpty())
+                errorString_ = error;
+        });
+        return !failed;
+    }
+
+private:
+    // Parses the markers of the file for the layout of its only scan, and
+    // collects the restart markers that fall on MCU row boundaries.
+    bool findRestartPoints(const qint64 size)
+    {
+        qint64 pos = 2; // after SOI
+        while(true)
+        {
+            // Markers may be padded with any number of 0xFF
+            while(pos + 1 < size && data_[pos] == 0xFF && data_[pos + 1] == 0xFF)
+                ++pos;
+            if(pos + 4 > size || data_[pos] != 0xFF)
+                return false;
+            const int marker = data_[pos + 1];
+            const qint64 segmentEnd = pos + 2 + (data_[pos + 2] << 8 | data_[pos + 3]);
+            // Only Huffman-coded sequential frames, which have the height at
+            // offset 5, and which we can rely on not being 0 (set by DNL)
+            if(marker == 0xC0 || marker == 0xC1)
+                sofOffset_ = pos;
+            if(marker == 0xDA)
+            {
+                scanStart_ = segmentEnd;
+                break;
+            }
+            pos = segmentEnd;
+        }
+        if(sofOffset_ < 0 || scanStart_ > size)
+            return false;
+
+        // Interleaved scans have MCUs of one block per sample of each
+        // component, a scan of one component has MCUs of a single block
+        int mcuWidth = DCTSIZE * cinfo_.max_h_samp_factor;
+        mcuHeight_ = DCTSIZE * cinfo_.max_v_samp_factor;
+        if(cinfo_.comps_in_scan == 1)
+        {
+            mcuWidth /= cinfo_.cur_comp_info[0]->h_samp_factor;
+            mcuHeight_ /= cinfo_.cur_comp_info[0]->v_samp_factor;
+        }
+        const qint64 mcusPerRow = (cinfo_.image_width + mcuWidth - 1) / mcuWidth;
+        mcuRows_ = (cinfo_.image_height + mcuHeight_ - 1) / mcuHeight_;
+
+        restartPoints_ = {{0, scanStart_}};
+        qint64 restarts = 0;
+        for(qint64 i = scanStart_; i + 1 < size; ++i)
+        {
+            const auto found = static_cast<const uchar*>(std::memchr(data_ + i, 0xFF, size - 1 - i));
+            if(!found) break;
+            i = found - data_;
+            const int next = data_[i + 1];
+            // Stuffed zero bytes and fill bytes aren't markers
+            if(next == 0x00 || next == 0xFF) continue;
+            if(next < 0xD0 || next > 0xD7)
+            {
+                // Anything but EOI means more scans follow, which we don't handle
+                if(next != 0xD9)
+                    return false;
+                scanEnd_ = i;
+                break;
+            }
+            const qint64 mcu = ++restarts * cinfo_.restart_interval;
+            if(mcu % mcusPerRow == 0 && mcu / mcusPerRow < mcuRows_)
+                restartPoints_.push_back({int(mcu / mcusPerRow), i + 2});
+            ++i;
+        }
+        return scanEnd_ >= 0;
+    }
+
+    // Decodes the MCU rows covering the strip as a JPEG of its own, made of
+    // the headers of the file, with the height patched, and the part of the
+    // entropy-coded data between two restart points, with the restart
+    // markers renumbered to start from 0.
+    bool readStrip(const Strip& strip, const std::atomic_bool& failed, QString& errorString) const
+    {
+        const int outRowsPerMcuRow = mcuHeight_ * cinfo_.scale_num / cinfo_.scale_denom;
+        // Fancy upsampling of chroma reads the neighbouring MCU rows, so we
+        // decode one more on each side to get the same pixels as a full decode.
+        const int firstMcuRow = std::max(0, strip.firstRow / outRowsPerMcuRow - 1);
+        const int mcuRowEnd = (strip.rowEnd + outRowsPerMcuRow - 1) / outRowsPerMcuRow + 1;
+        const auto start = std::prev(std::upper_bound(restartPoints_.begin(), restartPoints_.end(), firstMcuRow,
+                                                      [](const int row, const RestartPoint& p) { return row < p.mcuRow; }));
+        const auto end = std::lower_bound(start, restartPoints_.end(), mcuRowEnd,
+                                          [](const RestartPoint& p, const int row) { return p.mcuRow < row; });
+        // The data ends before the RST marker leading to the end point
+        const qint64 dataEnd = end == restartPoints_.end() ? scanEnd_ : end->offset - 2;
+        const int endMcuRow = end == restartPoints_.end() ? mcuRows_ : end->mcuRow;
+        const int height = std::min<int>(endMcuRow * mcuHeight_, cinfo_.image_height) - start->mcuRow * mcuHeight_;
+
+        std::vector<uchar> stream(data_, data_ + scanStart_);
+        stream[sofOffset_ + 5] = height >> 8;
+        stream[sofOffset_ + 6] = height & 0xFF;
+        const std::size_t entropyStart = stream.size();
+        stream.insert(stream.end(), data_ + start->offset, data_ + dataEnd);
+        int restartNumber = 0;
+        for(std::size_t i = entropyStart; i + 1 < stream.size(); ++i)
+        {
+            if(stream[i] != 0xFF) continue;
+            if(stream[i + 1] >= 0xD0 && stream[i + 1] <= 0xD7)
+                stream[i + 1] = 0xD0 + (restartNumber++ & 7);
+            ++i;
+        }
+        stream.insert(stream.end(), {0xFF, 0xD9});
+
+        const int firstOutRow = start->mcuRow * outRowsPerMcuRow;
+        std::vector<uchar> buffer(std::size_t(cinfo_.output_width) * cinfo_.output_components);
+        jpeg_decompress_struct cinfo{};
+        ErrorManager err;
+        cinfo.err = jpeg_std_error(&err.pub);
+        err.pub.error_exit = errorExit;
+        err.pub.output_message = outputMessage;
+        if(setjmp(err.jump))
+        {
+            jpeg_destroy_decompress(&cinfo);
+            errorString = err.message;
+            return false;
+        }
+        jpeg_create_decompress(&cinfo);
+        jpeg_mem_src(&cinfo, stream.data(), stream.size());
+        jpeg_read_header(&cinfo, true);
+        cinfo.out_color_space = cinfo_.out_color_space;
+        cinfo.scale_num = cinfo_.scale_num;
+        cinfo.scale_denom = cinfo_.scale_denom;
+        jpeg_start_decompress(&cinfo);
+#ifdef LIBJPEG_TURBO_VERSION
+        if(strip.firstRow > firstOutRow)
+            jpeg_skip_scanlines(&cinfo, strip.firstRow - firstOutRow);
+#endif
+        while(cinfo.output_scanline < cinfo.output_height && !failed)
+        {
+            const int row = firstOutRow + cinfo.output_scanline;
+            if(row >= strip.rowEnd) break;
+            JSAMPROW rowPointer = buffer.data();
+            jpeg_read_scanlines(&cinfo, &rowPointer, 1);
+            if(row < strip.firstRow) continue;
+            if(!strip.handler(row, buffer.data()))
+                break;
+        }
+        jpeg_destroy_decompress(&cinfo);
+        return true;
+    }
+#endif
+};
+#endif
+
+#ifdef HAVE_LIBPNG
+class PngDecoder : public ImageDecoder
+{
+    FILE* file_ = nullptr;
+    png_structp png_ = nullptr;
+    png_infop info_ = nullptr;
+
+    static void errorHandler(png_structp png, const png_const_charp message)
+    {
+        auto& errorString = *static_cast<QString*>(png_get_error_ptr(png));
+        errorString = message;
+        png_longjmp(png, 1);
+    }
+    static void warningHandler(png_structp, const png_const_charp message)
+    {
+        qWarning() << "libpng:" << message;
+    }
+
+public:
+    bool open(const QString& path)
+    {
+        file_ = std::fopen(QFile::encodeName(path).constData(), "rb");
+        if(!file_) return false;
+        png_ = png_create_read_struct(PNG_LIBPNG_VER_STRING, &errorString_,
+                                      errorHandler, warningHandler);
+        if(!png_) return false;
+        info_ = png_create_info_struct(png_);
+        if(!info_) return false;
+        if(setjmp(png_jmpbuf(png_)))
+            return false;
+        // The data must be usable as the whole image doesn't fit in memory,
+        // don't let the default limits get in the way.
+        png_set_user_limits(png_, 0x7fffffff, 0x7fffffff);
+        png_init_io(png_, file_);
+        png_read_info(png_, info_);
+
+        // Interlaced images only have complete rows after the last pass
+        if(png_get_interlace_type(png_, info_) != PNG_INTERLACE_NONE)
+            return false;
+
+        const auto colorType = png_get_color_type(png_, info_);
+        const bool hasAlpha = (colorType & PNG_COLOR_MASK_ALPHA) ||
+                              png_get_valid(png_, info_, PNG_INFO_tRNS);
+        png_set_expand(png_);
+        png_set_strip_16(png_);
+        if(hasAlpha)
+        {
+            png_set_gray_to_rgb(png_);
+            format_ = QImage::Format_RGBA8888;
+        }
+        else if(colorType == PNG_COLOR_TYPE_GRAY)
+        {
+            format_ = QImage::Format_Grayscale8;
+        }
+        else
+        {
+            format_ = QImage::Format_RGB888;
+        }
+        png_read_update_info(png_, info_);
+
+        sourceSize_ = QSize(png_get_image_width(png_, info_), png_get_image_height(png_, info_));
+        size_ = sourceSize_;
+        return true;
+    }
+
+    ~PngDecoder()
+    {
+        if(png_)
+            png_destroy_read_struct(&png_, info_ ? &info_ : nullptr, nullptr);
+        if(file_)
+            std::fclose(file_);
+    }
+
+    bool read(const QRect& rect, const RowHandler& handler) override
+    {
+        std::vector<uchar> buffer(png_get_rowbytes(png_, info_));
+        if(setjmp(png_jmpbuf(png_)))
+            return false;
+        const int offset = rect.x() * bytesPerPixel(format_);
+        for(int row = 0; row <= rect.bottom(); ++row)
+        {
+            png_read_row(png_, buffer.data(), nullptr);
+            if(row < rect.top()) continue;
+            if(!handler(row, buffer.data() + offset))
+                break;
+        }
+        return true;
+    }
+};
+#endif
+
+#ifdef HAVE_LIBTIFF
+class TiffDecoder : public ImageDecoder
+{
+    TIFF* tiff_ = nullptr;
+
+public:
+    bool open(const QString& path)
+    {
+        TIFFSetWarningHandler(nullptr);
+        tiff_ = TIFFOpen(QFile::encodeName(path).constData(), "r");
+        if(!tiff_) return false;
+        char message[1024];
+        if(!TIFFRGBAImageOK(tiff_, message))
+        {
+            qDebug() << "libtiff can't read" << path << "as RGBA:" << message;
+            return false;
+        }
+        // TIFFReadRGBATile and TIFFReadRGBAStrip ignore the orientation, and
+        // blocks can't be transposed row by row, so the rest go to Qt
+        uint16_t orientation = ORIENTATION_TOPLEFT;
+        TIFFGetFieldDefaulted(tiff_, TIFFTAG_ORIENTATION, &orientation);
+        if(orientation != ORIENTATION_TOPLEFT)
+        {
+            qDebug() << "Leaving" << path << "with orientation" << orientation << "to Qt";
+            return false;
+        }
+        uint32_t width = 0, height = 0;
+        TIFFGetField(tiff_, TIFFTAG_IMAGEWIDTH, &width);
+        TIFFGetField(tiff_, TIFFTAG_IMAGELENGTH, &height);
+        sourceSize_ = QSize(width, height);
+        size_ = sourceSize_;
+        // The RGBA interface handles all the photometric interpretations for
+        // us. It packs pixels as A<<24|B<<16|G<<8|R, which is RGBA in memory
+        // on little-endian hosts, see toRgbaBytes().
+        format_ = QImage::Format_RGBA8888;
+        return true;
+    }
+
+    ~TiffDecoder()
+    {
+        if(tiff_)
+            TIFFClose(tiff_);
+    }
+
+    bool read(const QRect& rect, const RowHandler& handler) override
+    {
+        return TIFFIsTiled(tiff_) ? readTiles(rect, handler) : readStrips(rect, handler);
+    }
+
+private:
+    static void toRgbaBytes(std::vector<uint32_t>& pixels)
+    {
+        if constexpr(Q_BYTE_ORDER == Q_BIG_ENDIAN)
+            qToLittleEndian<quint32>(pixels.data(), pixels.size(), pixels.data());
+    }
+
+    // The RGBA interface returns each block bottom-up, so we flip the rows back.
+    bool readTiles(const QRect& rect, const RowHandler& handler)
+    {
+        uint32_t tileWidth = 0, tileHeight = 0;
+        TIFFGetField(tiff_, TIFFTAG_TILEWIDTH, &tileWidth);
+        TIFFGetField(tiff_, TIFFTAG_TILELENGTH, &tileHeight);
+        const int firstTileX = rect.left() / tileWidth * tileWidth;
+        const int lastTileX = rect.right() / tileWidth * tileWidth;
+        const int bandWidth = lastTileX + tileWidth - firstTileX;
+        // Only the tiles intersecting the rect are decoded, a row of tiles at a time
+        std::vector<uint32_t> tile(std::size_t(tileWidth) * tileHeight);
+        std::vector<uint32_t> band(std::size_t(bandWidth) * tileHeight);
+        for(int tileY = rect.top() / tileHeight * tileHeight; tileY <= rect.bottom(); tileY += tileHeight)
+        {
+            for(int tileX = firstTileX; tileX <= lastTileX; tileX += tileWidth)
+            {
+                if(!TIFFReadRGBATile(tiff_, tileX, tileY, tile.data()))
+                {
+                    errorString_ = QObject::tr("Failed to read tile at (%1,%2)").arg(tileX).arg(tileY);
+                    return false;
+                }
+                toRgbaBytes(tile);
+                for(unsigned r = 0; r < tileHeight; ++r)
+                    std::copy_n(&tile[(tileHeight - 1 - r) * tileWidth], tileWidth,
+                                &band[r * bandWidth + tileX - firstTileX]);
+            }
+            const int bandEnd = std::min<int>(tileY + tileHeight, rect.bottom() + 1);
+            for(int row = std::max(tileY, rect.top()); row < bandEnd; ++row)
+            {
+                const auto pixels = &band[(row - tileY) * bandWidth + rect.left() - firstTileX];
+                if(!handler(row, reinterpret_cast<const uchar*>(pixels)))
+                    return true;
+            }
+        }
+        return true;
+    }
+
+    bool readStrips(const QRect& rect, const RowHandler& handler)
+    {
+        uint32_t rowsPerStrip = 0;
+        TIFFGetFieldDefaulted(tiff_, TIFFTAG_ROWSPERSTRIP, &rowsPerStrip);
+        rowsPerStrip = std::min<uint32_t>(rowsPerStrip, size_.height());
+        std::vector<uint32_t> strip(std::size_t(size_.width()) * rowsPerStrip);
+        for(int stripY = rect.top() / rowsPerStrip * rowsPerStrip; stripY <= rect.bottom(); stripY += rowsPerStrip)
+        {
+            if(!TIFFReadRGBAStrip(tiff_, stripY, strip.data()))
+            {
+                errorString_ = QObject::tr("Failed to read strip at row %1").arg(stripY);
+                return false;
+            }
+            toRgbaBytes(strip);
+            const int stripRows = std::min<int>(rowsPerStrip, size_.height() - stripY);
+            const int stripEnd = std::min(stripY + stripRows, rect.bottom() + 1);
+            for(int row = std::max(stripY, rect.top()); row < stripEnd; ++row)
+            {
+                const auto pixels = &strip[(stripRows - 1 - (row - stripY)) * size_.width() + rect.left()];
+                if(!handler(row, reinterpret_cast<const uchar*>(pixels)))
+                    return true;
+            }
+        }
+        return true;
+    }
+};
+#endif
+
+class QImageReaderDecoder : public ImageDecoder
+{
+    QImageReader reader_;
+
+public:
+    bool open(const QString& path)
+    {
+        reader_.setFileName(path);
+        sourceSize_ = reader_.size();
+        if(!sourceSize_.isValid())
+        {
+            errorString_ = reader_.errorString();
+            return false;
+        }
+        size_ = sourceSize_;
+        const auto nativeFormat = reader_.imageFormat();
+        if(nativeFormat == QImage::Format_Grayscale8)
+            format_ = QImage::Format_Grayscale8;
+        else if(QImage::toPixelFormat(nativeFormat).alphaUsage() == QPixelFormat::UsesAlpha)
+            format_ = QImage::Format_RGBA8888;
+        else
+            format_ = QImage::Format_RGB888;
+        return true;
+    }
+
+    void setMinimumSize(const QSize& minSize) override
+    {
+        if(!reader_.supportsOption(QImageIOHandler::ScaledSize))
+            return;
+        // The handlers that support this option scale while decoding
+        size_ = sourceSize_.scaled(minSize.expandedTo(QSize(1,1)), Qt::KeepAspectRatioByExpanding)
+                           .boundedTo(sourceSize_);
+        reader_.setScaledSize(size_);
+    }
+
+    bool read(const QRect& rect, const RowHandler& handler) override
+    {
+        reader_.setScaledClipRect(rect);
+        const auto image = reader_.read().convertToFormat(format_);
+        if(image.isNull())
+        {
+            errorString_ = reader_.errorString();
+            return false;
+        }
+        for(int row = 0; row < image.height(); ++row)
+        {
+            if(!handler(rect.top() + row, image.constScanLine(row)))
+                break;
+        }
+        return true;
+    }
+};
+
+template<typename Decoder>
+std::unique_ptr<ImageDecoder> tryOpen(const QString& path)
+{
+    auto decoder = std::make_unique<Decoder>();
+    if(!decoder->open(path))
+        return nullptr;
+    return decoder;
+}
+
+// Runs the decoder in a thread of the global pool, while the calling thread
+// passes the rows to the handler, so that decoding the next rows overlaps with
+// the work on the previous ones, like downscaling. This is for decoders that
+// can't be split with readStrips().
+bool readPipelined(ImageDecoder& decoder, const QRect& rect, const ImageDecoder::RowHandler& handler)
+{
+    const qint64 rowBytes = qint64(rect.width()) * bytesPerPixel(decoder.format());
+    const int bandRows = std::clamp<qint64>(PIPELINE_BAND_BYTES / rowBytes, 1, rect.height());
+    struct Band
+    {
+        int firstRow = 0;
+        int rowCount = 0;
+        std::vector<uchar> pixels;
+    };
+    std::vector<Band> bands(PIPELINE_BANDS);
+    QSemaphore freeBands(PIPELINE_BANDS), fullBands;
+    std::atomic_bool stopped{false};
+    bool ok = true;
+
+    const auto produce = [&]
+    {
+        int next = 0;
+        Band* band = nullptr;
+        const auto publish = [&]
+        {
+            fullBands.release();
+            band = nullptr;
+            ++next;
+        };
+        ok = decoder.read(rect, [&](const int row, const uchar*const pixels)
+                                {
+                                    if(stopped) return false;
+                                    if(!band)
+                                    {
+                                        freeBands.acquire();
+                                        band = &bands[next % PIPELINE_BANDS];
+                                        band->firstRow = row;
+                                        band->rowCount = 0;
+                                        band->pixels.resize(bandRows * rowBytes);
+                                    }
+                                    std::copy_n(pixels, rowBytes, &band->pixels[band->rowCount * rowBytes]);
+                                    if(++band->rowCount == bandRows)
+                                        publish();
+                                    return true;
+                                });
+        if(band) publish();
+        // An empty band marks the end
+        freeBands.acquire();
+        bands[next % PIPELINE_BANDS].rowCount = 0;
+        fullBands.release();
+    };
+    if(!QThreadPool::globalInstance()->tryStart(produce))
+        return decoder.read(rect, handler);
+
+    for(int next = 0;; ++next)
+    {
+        fullBands.acquire();
+        const auto& band = bands[next % PIPELINE_BANDS];
+        if(band.rowCount == 0) break;
+        // After the handler stops, the remaining bands are only drained, so that the producer can finish
+        for(int n = 0; n < band.rowCount && !stopped; ++n)
+        {
+            if(!handler(band.firstRow + n, &band.pixels[n * rowBytes]))
+                stopped = true;
+        }
+        freeBands.release();
+    }
+    return ok;
+}
+
+}
+
+std::unique_ptr<ImageDecoder> ImageDecoder::open(const QString& path, QString& errorString)
+{
+    QFile file(path);
+    if(!file.open(QFile::ReadOnly))
+    {
+        errorString = file.errorString();
+        return nullptr;
+    }
+    const auto magic = file.read(4);
+    file.close();
+
+    std::unique_ptr<ImageDecoder> decoder;
+#ifdef HAVE_LIBJPEG
+    if(magic.startsWith("\xff\xd8\xff"))
+        decoder = tryOpen<JpegDecoder>(path);
+#endif
+#ifdef HAVE_LIBPNG
+    if(magic.startsWith("\x89PNG"))
+        decoder = tryOpen<PngDecoder>(path);
+#endif
+#ifdef HAVE_LIBTIFF
+    if(magic.startsWith("II*") || magic.startsWith(QByteArray("MM\0*", 4)))
+        decoder = tryOpen<TiffDecoder>(path);
+#endif
+    if(decoder)
+        return decoder;
+
+    auto fallback = std::make_unique<QImageReaderDecoder>();
+    if(!fallback->open(path))
+    {
+        errorString = fallback->errorString();
+        return nullptr;
+    }
+    return fallback;
+}
+
+std::vector<QImage> decodeImageLevels(const QString& path, const std::vector<QSize>& sizes,
+                                      QString& errorString)
+{
+    const auto decoder = ImageDecoder::open(path, errorString);
+    if(!decoder) return {};
+
+    QSize largest(1, 1);
+    for(const auto& size : sizes)
+        largest = largest.expandedTo(size);
+    decoder->setMinimumSize(largest);
+
+    std::vector<QImage> levels;
+    std::vector<std::unique_ptr<StreamingDownscaler>> downscalers;
+    for(const auto& size : sizes)
+    {
+        auto& level = levels.emplace_back(size.boundedTo(decoder->size()), decoder->format());
+        if(level.isNull())
+        {
+            errorString = QObject::tr("Failed to allocate an image of %1×%2 pixels")
+                                .arg(size.width()).arg(size.height());
+            return {};
+        }
+    }
+    // The levels aren't copied or reallocated from here on, so the pixels
+    // taken by the downscalers stay valid.
+    for(auto& level : levels)
+        downscalers.emplace_back(std::make_unique<StreamingDownscaler>(decoder->size(), level));
+
+    const bool ok = readPipelined(*decoder, QRect(QPoint(0,0), decoder->size()),
+                                  [&](int, const uchar*const pixels)
+                                  {
+                                      for(const auto& downscaler : downscalers)
+                                          downscaler->addRow(pixels);
+                                      return true;
+                                  });
+    if(!ok)
+    {
+        errorString = decoder->errorString();
+        return {};
+    }
+    return levels;
+}
+
+QImage decodeImage(const QString& path, const QSize& maxSize, QString& errorString,
+                   QSize*const sourceSize)
+{
+    const auto decoder = ImageDecoder::open(path, errorString);
+    if(!decoder) return {};
+    if(sourceSize)
+        *sourceSize = decoder->sourceSize();
+    const auto size = decoder->sourceSize().boundedTo(maxSize);
+    if(size != decoder->sourceSize())
+    {
+        qDebug().nospace() << "Image resolution of " << decoder->sourceSize().width() << "×"
+                           << decoder->sourceSize().height() << " exceeds " << maxSize.width()
+                           << "×" << maxSize.height() << ", will downscale while decoding";
+    }
+    decoder->setMinimumSize(size);
+
+    QImage image(size.boundedTo(decoder->size()), decoder->format());
+    if(image.isNull())
+    {
+        errorString = QObject::tr("Failed to allocate an image of %1×%2 pixels")
+                            .arg(size.width()).arg(size.height());
+        return {};
+    }
+    // Once returned, the image is accounted for by whoever keeps it
+    const MemoryBudget::Allocation decoding(MemoryBudget::Category::Decoding, image.sizeInBytes());
+    const QRect rect(QPoint(0,0), decoder->size());
+    const bool direct = image.size() == decoder->size();
+    bool ok;
+    if(decoder->canReadStrips())
+    {
+        // Each strip of the image is decoded right into its place, or into
+        // its own downscaler, in parallel with the others
+        const int stripCount = std::min(image.height(), STRIPS_PER_THREAD * QThreadPool::globalInstance()->maxThreadCount());
+        const int rowsPerStrip = (image.height() + stripCount - 1) / stripCount;
+        uchar*const bits = image.bits();
+        const qint64 bytesPerLine = image.bytesPerLine();
+        const int rowBytes = image.width() * bytesPerPixel(image.format());
+        std::vector<std::unique_ptr<StreamingDownscaler>> downscalers;
+        std::vector<ImageDecoder::Strip> strips;
+        for(int firstRow = 0; firstRow < image.height(); firstRow += rowsPerStrip)
+        {
+            if(direct)
+            {
+                strips.push_back({firstRow, std::min(firstRow + rowsPerStrip, image.height()),
+                                  [=](const int row, const uchar*const pixels)
+                                  {
+                                      std::copy_n(pixels, rowBytes, bits + row * bytesPerLine);
+                                      return true;
+                                  }});
+                continue;
+            }
+            const auto& downscaler = downscalers.emplace_back(
+                std::make_unique<StreamingDownscaler>(decoder->size(), image, firstRow, rowsPerStrip));
+            strips.push_back({downscaler->firstSrcRow(), downscaler->srcRowEnd(),
+                              [downscaler = downscaler.get()](int, const uchar*const pixels)
+                              {
+                                  downscaler->addRow(pixels);
+                                  return true;
+                              }});
+        }
+        qDebug() << "Decoding in" << strips.size() << "strips";
+        ok = decoder->readStrips(strips);
+    }
+    else if(direct)
+    {
+        const int rowBytes = image.width() * bytesPerPixel(image.format());
+        ok = decoder->read(rect, [&](const int row, const uchar*const pixels)
+                                 {
+                                     std::copy_n(pixels, rowBytes, image.scanLine(row));
+                                     return true;
+                                 });
+    }
+    else
+    {
+        StreamingDownscaler downscaler(decoder->size(), image);
+        ok = readPipelined(*decoder, rect, [&](int, const uchar*const pixels)
+                                           {
+                                               downscaler.addRow(pixels);
+                                               return true;
+                                           });
+    }
+    if(!ok)
+    {
+        errorString = decoder->errorString();
+        return {};
+    }
+    return image;
+}
+
+QImage decodeRegion(const QString& path, const QRect& region, const QSize& outSize,
+                    QString& errorString)
+{
+    const auto decoder = ImageDecoder::open(path, errorString);
+    if(!decoder) return {};
+    const auto srcRect = region.intersected(QRect(QPoint(0,0), decoder->sourceSize()));
+    if(srcRect.isEmpty())
+    {
+        errorString = QObject::tr("The region is outside of the image");
+        return {};
+    }
+
+    // Let the decoder downscale as long as the region still has enough pixels
+    const auto sourceSize = decoder->sourceSize();
+    decoder->setMinimumSize(QSize(std::ceil(double(outSize.width()) * sourceSize.width() / srcRect.width()),
+                                  std::ceil(double(outSize.height()) * sourceSize.height() / srcRect.height())));
+    const double scaleX = double(decoder->size().width()) / sourceSize.width();
+    const double scaleY = double(decoder->size().height()) / sourceSize.height();
+    const QRect rect = QRect(QPoint(std::floor(srcRect.left() * scaleX), std::floor(srcRect.top() * scaleY)),
+                             QPoint(std::ceil((srcRect.right() + 1) * scaleX) - 1,
+                                    std::ceil((srcRect.bottom() + 1) * scaleY) - 1))
+                                .intersected(QRect(QPoint(0,0), decoder->size()));
+
+    QImage image(outSize.boundedTo(rect.size()), decoder->format());
+    if(image.isNull())
+    {
+        errorString = QObject::tr("Failed to allocate an image of %1×%2 pixels")
+                            .arg(outSize.width()).arg(outSize.height());
+        return {};
+    }
+    StreamingDownscaler downscaler(rect.size(), image);
+    const bool ok = decoder->read(rect, [&](int, const uchar*const pixels)
+                                        {
+                                            downscaler.addRow(pixels);
+                                            return true;
+                                        });
+    if(!ok)
+    {
+        errorString = decoder->errorString();
+        return {};
+    }
+    return image;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <functional>
+#include <QRect>
+#include <QImage>
+#include <QString>
+
+// Decodes images row by row, so that memory use doesn't depend on the
+// resolution of the source. JPEG, PNG and TIFF (including tiled TIFF) are
+// streamed through their libraries if these were found at build time. Other
+// formats, as well as the variants the streaming decoders don't handle, fall
+// back to QImageReader, which decodes the whole image at once.
+class ImageDecoder
+{
+public:
+    // Called for each decoded row, from top to bottom. Returning false stops decoding.
+    using RowHandler = std::function<bool(int row, const uchar* pixels)>;
+    // Full-width rows [firstRow, rowEnd), in terms of size(), and the handler
+    // receiving them
+    struct Strip
+    {
+        int firstRow;
+        int rowEnd;
+        RowHandler handler;
+    };
+
+    static std::unique_ptr<ImageDecoder> open(const QString& path, QString& errorString);
+    virtual ~ImageDecoder() = default;
+
+    // Size of the image as stored in the file
+    QSize sourceSize() const { return sourceSize_; }
+    // Size of the image as it will be decoded, see setMinimumSize()
+    QSize size() const { return size_; }
+    // One of Grayscale8, RGB888, RGBA8888
+    QImage::Format format() const { return format_; }
+    QString errorString() const { return errorString_; }
+
+    // Lets the decoder reduce the resolution at the source, as JPEG can do
+    // almost for free, as long as size() stays at least minSize. Must be
+    // called before read().
+    virtual void setMinimumSize(const QSize& minSize) { Q_UNUSED(minSize); }
+    // Decodes the part of the image inside rect (in terms of size()), giving
+    // the handler rows of rect.width() pixels. Can only be called once.
+    virtual bool read(const QRect& rect, const RowHandler& handler) = 0;
+    // Whether readStrips() can be used for this image, which is the case when
+    // parts of it can be decoded independently, like a JPEG with restart
+    // markers. Must be called after setMinimumSize().
+    virtual bool canReadStrips() { return false; }
+    // Decodes the strips concurrently, in the threads of the global pool. Each
+    // handler is called from one thread at a time, but different handlers run
+    // in parallel. Strips may overlap. Can only be called once, instead of read().
+    virtual bool readStrips(const std::vector<Strip>& strips) { Q_UNUSED(strips); return false; }
+
+protected:
+    QSize sourceSize_;
+    QSize size_;
+    QImage::Format format_ = QImage::Format_Invalid;
+    QString errorString_;
+};
+
+// Decodes the image into several downscaled versions in a single pass. None
+// of the sizes may exceed the size of the source. Peak memory use is the
+// total size of the results plus a few rows of the source.
+std::vector<QImage> decodeImageLevels(const QString& path, const std::vector<QSize>& sizes,
+                                      QString& errorString);
+// Decodes the image, downscaling it if needed to fit in maxSize. The
+// dimensions are limited independently, without keeping the aspect ratio.
+// If sourceSize isn't null, the size of the image in the file is stored there.
+QImage decodeImage(const QString& path, const QSize& maxSize, QString& errorString,
+                   QSize* sourceSize = nullptr);
+// Decodes the region of the image (in terms of its source size), downscaled to outSize.
+QImage decodeRegion(const QString& path, const QRect& region, const QSize& outSize,
+                    QString& errorString);
@@ -0,0 +1,259 @@
+#include "ImageEncoder.hpp"
+#include <cstdio>
+#include <vector>
+#include <csetjmp>
+#include <algorithm>
+#include <QFile>
+#include <QDebug>
+#include <QObject>
+#include <QFileInfo>
+#include <QImageWriter>
+#ifdef HAVE_LIBPNG
+# include <png.h>
+#endif
+#ifdef HAVE_LIBTIFF
+# include <tiffio.h>
+#endif
+
+namespace
+{
+
+// Also the smallest GL_MAX_TEXTURE_SIZE of GLES 3.0, so tiles fit in an FBO anywhere
+constexpr int MAX_TILE_SIZE = 2048;
+// PNG rows are buffered in bands of about this size
+constexpr qint64 PNG_BAND_BYTES = 16 << 20;
+constexpr int TIFF_TILE_SIZE = 512;
+
+// Copies the RGB of the tile's pixels to dst, with dstStride bytes per row
+void copyRGB(const QImage& tile, uchar*const dst, const qint64 dstStride)
+{
+    for(int y = 0; y < tile.height(); ++y)
+    {
+        const uchar*const src = tile.constScanLine(y);
+        uchar*const out = dst + y * dstStride;
+        for(int x = 0; x < tile.width(); ++x)
+            std::copy_n(src + x * 4, 3, out + x * 3);
+    }
+}
+
+#ifdef HAVE_LIBPNG
+class PngEncoder : public ImageEncoder
+{
+    FILE* file_ = nullptr;
+    png_structp png_ = nullptr;
+    png_infop info_ = nullptr;
+    std::vector<uchar> band_;
+
+    static void errorHandler(png_structp png, const png_const_charp message)
+    {
+        auto& errorString = *static_cast<QString*>(png_get_error_ptr(png));
+        errorString = message;
+        png_longjmp(png, 1);
+    }
+    static void warningHandler(png_structp, const png_const_charp message)
+    {
+        qWarning() << "libpng:" << message;
+    }
+
+public:
+    bool open(const QString& path, const QSize& size)
+    {
+        size_ = size;
+        const int bandRows = std::clamp<qint64>(PNG_BAND_BYTES / (qint64(size.width()) * 3), 16, MAX_TILE_SIZE);
+        tileSize_ = QSize(std::min(size.width(), MAX_TILE_SIZE), std::min(size.height(), bandRows));
+        file_ = std::fopen(QFile::encodeName(path).constData(), "wb");
+        if(!file_)
+        {
+            errorString_ = QObject::tr("Failed to open the file for writing");
+            return false;
+        }
+        png_ = png_create_write_struct(PNG_LIBPNG_VER_STRING, &errorString_, errorHandler, warningHandler);
+        if(!png_) return false;
+        info_ = png_create_info_struct(png_);
+        if(!info_) return false;
+        if(setjmp(png_jmpbuf(png_)))
+            return false;
+        png_init_io(png_, file_);
+        png_set_IHDR(png_, info_, size.width(), size.height(), 8, PNG_COLOR_TYPE_RGB,
+                     PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+        png_write_info(png_, info_);
+        band_.resize(std::size_t(size.width()) * 3 * tileSize_.height());
+        return true;
+    }
+
+    ~PngEncoder()
+    {
+        if(png_)
+            png_destroy_write_struct(&png_, info_ ? &info_ : nullptr);
+        if(file_)
+            std::fclose(file_);
+    }
+
+    bool writeTile(const QPoint& pos, const QImage& tile) override
+    {
+        const qint64 stride = qint64(size_.width()) * 3;
+        copyRGB(tile, &band_[pos.x() * 3], stride);
+        // The band is written out when its last tile arrives
+        if(pos.x() + tile.width() < size_.width())
+            return true;
+        if(setjmp(png_jmpbuf(png_)))
+            return false;
+        for(int y = 0; y < tile.height(); ++y)
+            png_write_row(png_, &band_[y * stride]);
+        return true;
+    }
+
+    bool finish() override
+    {
+        if(setjmp(png_jmpbuf(png_)))
+            return false;
+        png_write_end(png_, info_);
+        if(std::fclose(file_) != 0)
+        {
+            file_ = nullptr;
+            errorString_ = QObject::tr("Failed to write the file");
+            return false;
+        }
+        file_ = nullptr;
+        return true;
+    }
+};
+#endif
+
+#ifdef HAVE_LIBTIFF
+class TiffEncoder : public ImageEncoder
+{
+    TIFF* tiff_ = nullptr;
+    std::vector<uchar> tile_;
+
+public:
+    bool open(const QString& path, const QSize& size)
+    {
+        size_ = size;
+        tileSize_ = QSize(TIFF_TILE_SIZE, TIFF_TILE_SIZE);
+        // Classic TIFF offsets are 32-bit
+        const bool big = qint64(size.width()) * size.height() * 3 > (qint64(1) << 31);
+        tiff_ = TIFFOpen(QFile::encodeName(path).constData(), big ? "w8" : "w");
+        if(!tiff_)
+        {
+            errorString_ = QObject::tr("Failed to open the file for writing");
+            return false;
+        }
+        TIFFSetField(tiff_, TIFFTAG_IMAGEWIDTH, uint32_t(size.width()));
+        TIFFSetField(tiff_, TIFFTAG_IMAGELENGTH, uint32_t(size.height()));
+        TIFFSetField(tiff_, TIFFTAG_BITSPERSAMPLE, 8);
+        TIFFSetField(tiff_, TIFFTAG_SAMPLESPERPIXEL, 3);
+        TIFFSetField(tiff_, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+        TIFFSetField(tiff_, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+        TIFFSetField(tiff_, TIFFTAG_COMPRESSION, COMPRESSION_ADOBE_DEFLATE);
+        TIFFSetField(tiff_, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL);
+        TIFFSetField(tiff_, TIFFTAG_TILEWIDTH, uint32_t(TIFF_TILE_SIZE));
+        TIFFSetField(tiff_, TIFFTAG_TILELENGTH, uint32_t(TIFF_TILE_SIZE));
+        tile_.resize(std::size_t(TIFF_TILE_SIZE) * TIFF_TILE_SIZE * 3);
+        return true;
+    }
+
+    ~TiffEncoder()
+    {
+        if(tiff_)
+            TIFFClose(tiff_);
+    }
+
+    bool writeTile(const QPoint& pos, const QImage& tile) override
+    {
+        // Edge tiles are stored whole, padded
+        if(tile.size() != tileSize_)
+            std::fill(tile_.begin(), tile_.end(), 0);
+        copyRGB(tile, tile_.data(), TIFF_TILE_SIZE * 3);
+        if(TIFFWriteTile(tiff_, tile_.data(), pos.x(), pos.y(), 0, 0) < 0)
+        {
+            errorString_ = QObject::tr("Failed to write tile at (%1,%2)").arg(pos.x()).arg(pos.y());
+            return false;
+        }
+        return true;
+    }
+
+    bool finish() override
+    {
+        const bool ok = TIFFFlush(tiff_);
+        TIFFClose(tiff_);
+        tiff_ = nullptr;
+        if(!ok)
+            errorString_ = QObject::tr("Failed to write the file");
+        return ok;
+    }
+};
+#endif
+
+class QImageWriterEncoder : public ImageEncoder
+{
+    QString path_;
+    QImage image_;
+
+public:
+    bool open(const QString& path, const QSize& size)
+    {
+        path_ = path;
+        size_ = size;
+        tileSize_ = size.boundedTo(QSize(MAX_TILE_SIZE, MAX_TILE_SIZE));
+        image_ = QImage(size, QImage::Format_RGB888);
+        if(image_.isNull())
+        {
+            errorString_ = QObject::tr("Failed to allocate an image of %1×%2 pixels")
+                                .arg(size.width()).arg(size.height());
+            return false;
+        }
+        return true;
+    }
+
+    bool writeTile(const QPoint& pos, const QImage& tile) override
+    {
+        copyRGB(tile, image_.scanLine(pos.y()) + pos.x() * 3, image_.bytesPerLine());
+        return true;
+    }
+
+    bool finish() override
+    {
+        QImageWriter writer(path_);
+        if(!writer.write(image_))
+        {
+            errorString_ = writer.errorString();
+            return false;
+        }
+        return true;
+    }
+};
+
+template<typename Encoder>
+std::unique_ptr<ImageEncoder> tryCreate(const QString& path, const QSize& size, QString& errorString)
+{
+    auto encoder = std::make_unique<Encoder>();
+    if(!encoder->open(path, size))
+    {
+        errorString = encoder->errorString();
+        return nullptr;
+    }
+    return encoder;
+}
+
+}
+
+std::unique_ptr<ImageEncoder> ImageEncoder::create(const QString& path, const QSize& size, QString& errorString)
+{
+    if(size.isEmpty())
+    {
+        errorString = QObject::tr("Invalid image size");
+        return nullptr;
+    }
+    [[maybe_unused]] const auto suffix = QFileInfo(path).suffix().toLower();
+#ifdef HAVE_LIBPNG
+    if(suffix == "png")
+        return tryCreate<PngEncoder>(path, size, errorString);
+#endif
+#ifdef HAVE_LIBTIFF
+    if(suffix == "tif" || suffix == "tiff")
+        return tryCreate<TiffEncoder>(path, size, errorString);
+#endif
+    qDebug() << "No streaming encoder for" << path << ", the whole image will be kept in memory";
+    return tryCreate<QImageWriterEncoder>(path, size, errorString);
+}
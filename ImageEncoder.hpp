@@ -0,0 +1,35 @@
+#pragma once
+
+#include <memory>
+#include <QImage>
+#include <QString>
+
+// Encodes images that arrive tile by tile, so that memory use doesn't depend
+// on the resolution of the result. TIFF is written tiled, keeping a single
+// tile in memory, and PNG is written in bands of rows, if their libraries
+// were found at build time. Other formats, as well as PNG and TIFF without
+// the libraries, are assembled as a whole and written by QImageWriter.
+class ImageEncoder
+{
+public:
+    // The format is chosen by the suffix of path
+    static std::unique_ptr<ImageEncoder> create(const QString& path, const QSize& size, QString& errorString);
+    virtual ~ImageEncoder() = default;
+
+    QSize size() const { return size_; }
+    // Tiles must be this size, except at the right and bottom edges, where
+    // they are cut by the image
+    QSize tileSize() const { return tileSize_; }
+    QString errorString() const { return errorString_; }
+
+    // Takes tiles in RGBA8888 or RGBX8888, in row-major order, each at a
+    // multiple of tileSize(). Alpha is dropped.
+    virtual bool writeTile(const QPoint& pos, const QImage& tile) = 0;
+    // Must be called after the last tile
+    virtual bool finish() = 0;
+
+protected:
+    QSize size_;
+    QSize tileSize_;
+    QString errorString_;
+};
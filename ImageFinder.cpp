@@ -1,17 +1,43 @@
 #include "ImageFinder.hpp"
+#include <algorithm>
 #include <vector>
+#include <cstring>
 #include <QDir>
+#include <QBuffer>
+#include <QSaveFile>
 #include <QFileInfo>
+#include <QDataStream>
 #include <QDirIterator>
 #include <QImageReader>
+#include <QElapsedTimer>
 #include <QStandardPaths>
 #ifdef Q_OS_ANDROID
 #include <QtCore/private/qandroidextras_p.h>
 #endif
 #include <exiv2/exiv2.hpp>
+#include "HdrImage.hpp"
+#include "StoppableFile.hpp"
 
 namespace
 {
+constexpr size_t FOUND_QUEUE_CAPACITY = 256;
+// Thumbnails are big, this bounds the memory they take while in flight
+constexpr size_t THUMBNAIL_QUEUE_CAPACITY = 32;
+constexpr unsigned long FULL_QUEUE_WAIT = 4; // ms
+// INSP are dual-fisheye JPEGs from Insta360 cameras, HDR and EXR are HDR panoramas
+const QStringList IMAGE_SUFFIXES = {"JPG", "PNG", "INSP", "HDR", "EXR"};
+// Enough for the dimensions and the metadata of nearly any JPEG or PNG;
+// for the files that don't have the dimensions in it, the reader streams on
+constexpr qint64 HEADER_READ_SIZE = 256 << 10;
+constexpr qint64 CHECKPOINT_PERIOD = 5'000; // ms
+constexpr char CHECKPOINT_MAGIC[8] = {'4','p','i','S','c','a','n','C'};
+constexpr quint32 CHECKPOINT_VERSION = 1;
+
+QString checkpointPath()
+{
+    return QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/scan.checkpoint";
+}
+
 QDateTime getFallbackDateTime(const QString& path)
 {
     qWarning() << "Resorting to file date-time for" << path;
@@ -22,16 +48,28 @@ QDateTime getFallbackDateTime(const QString& path)
     return dateTime;
 }
 
-QDateTime getDateTime(const QString& path)
+// The metadata are parsed from the head of the file, which has already been
+// read, so that no I/O happens here that stop() couldn't interrupt
+QDateTime getDateTime(const QString& path, const QByteArray& head)
 {
-    const auto image = Exiv2::ImageFactory::open(path.toStdString());
-    if(!image.get())
+    Exiv2::ExifData exif;
+    try
     {
-        qWarning() << "exiv2 read failed for" << path;
+        const auto image = Exiv2::ImageFactory::open(reinterpret_cast<const Exiv2::byte*>(head.constData()),
+                                                     head.size());
+        if(!image.get())
+        {
+            qWarning() << "exiv2 read failed for" << path;
+            return getFallbackDateTime(path);
+        }
+        image->readMetadata();
+        exif = image->exifData();
+    }
+    catch(const Exiv2::Error& ex)
+    {
+        qWarning() << "exiv2 read failed for" << path << ":" << ex.what();
         return getFallbackDateTime(path);
     }
-    image->readMetadata();
-    const auto& exif = image->exifData();
 
     QString date;
     for(const auto& key : {"Exif.Photo.DateTimeOriginal",
@@ -94,9 +132,22 @@ QDateTime getDateTime(const QString& path)
 ImageFinder::ImageFinder(const int thumbnailWidth, QObject* parent)
     : QThread(parent)
     , thumbnailWidth_(thumbnailWidth)
+    , foundImages_(FOUND_QUEUE_CAPACITY)
+    , thumbnails_(THUMBNAIL_QUEUE_CAPACITY)
 {
 }
 
+template<typename T>
+bool ImageFinder::enqueue(SpscQueue<T>& queue, T value)
+{
+    while(!queue.tryPush(value))
+    {
+        if(mustStop_) return false;
+        msleep(FULL_QUEUE_WAIT);
+    }
+    return true;
+}
+
 void ImageFinder::findAllImages()
 {
 #ifdef Q_OS_ANDROID
@@ -122,49 +173,256 @@ void ImageFinder::findAllImages()
 #endif
 
     imageInfos_.clear();
-    for(const auto& dataPath : dataPaths)
+    // Directories are visited depth-first from this stack, whose contents
+    // make the cursor of the scan for the checkpoints
+    std::vector<QString> pendingDirs;
+    std::vector<ImageInfo> checkpointImages;
+    if(restoreCheckpoint(dataPaths, pendingDirs, checkpointImages))
     {
-        QDirIterator it(dataPath, {"*.JPG", "*.PNG"}, QDir::Files, QDirIterator::Subdirectories);
-        while(it.hasNext())
+        qDebug() << "Resuming the interrupted scan with" << checkpointImages.size() << "images found and"
+                 << pendingDirs.size() << "directories left";
+        // They are rechecked like the images of the snapshot: unless the
+        // file has changed, its metadata aren't read again
+        for(const auto& info : checkpointImages)
+            knownImages_.try_emplace(info.path, KnownImage{info, false});
+        for(const auto& info : checkpointImages)
         {
             if(mustStop_) return;
+            const QFileInfo fileInfo(info.path);
+            if(fileInfo.exists() && !addFoundImage(info.path, fileInfo))
+                return;
+        }
+    }
+    else
+    {
+        pendingDirs.assign(dataPaths.rbegin(), dataPaths.rend());
+    }
 
+    QElapsedTimer sinceCheckpoint;
+    sinceCheckpoint.start();
+    while(!pendingDirs.empty())
+    {
+        // At this point, the images found so far are all those of the directories done
+        if(sinceCheckpoint.hasExpired(CHECKPOINT_PERIOD))
+        {
+            storeCheckpoint(dataPaths, pendingDirs, imageInfos_.size());
+            sinceCheckpoint.restart();
+        }
+        const auto dirPath = pendingDirs.back();
+        const auto imagesBefore = imageInfos_.size();
+        std::vector<QString> subdirs;
+        QDirIterator it(dirPath, QDir::Files | QDir::Dirs | QDir::NoDotAndDotDot);
+        while(it.hasNext() && !mustStop_)
+        {
             const auto path = it.next();
-            QImageReader reader(path);
-            const auto size = reader.size();
-            if(size.width() != size.height() * 2)
+            const auto fileInfo = it.fileInfo();
+            if(fileInfo.isDir())
+            {
+                // Like QDirIterator::Subdirectories, don't follow links, which could make loops
+                if(!fileInfo.isSymLink())
+                    subdirs.push_back(path);
                 continue;
+            }
+            if(IMAGE_SUFFIXES.contains(fileInfo.suffix(), Qt::CaseInsensitive) &&
+               !addFoundImage(path, fileInfo))
+                break;
+        }
+        if(mustStop_)
+        {
+            // This directory will be scanned again from its start
+            storeCheckpoint(dataPaths, pendingDirs, imagesBefore);
+            return;
+        }
+        pendingDirs.pop_back();
+        pendingDirs.insert(pendingDirs.end(), subdirs.rbegin(), subdirs.rend());
+    }
+    QFile::remove(checkpointPath());
+}
 
-            const auto dateTime = getDateTime(path);
+bool ImageFinder::addFoundImage(const QString& path, const QFileInfo& fileInfo)
+{
+    const qint64 modificationTime = fileInfo.lastModified().toMSecsSinceEpoch();
+    const auto known = knownImages_.find(path);
+    if(known != knownImages_.end() &&
+       known->second.info.modificationTime == modificationTime &&
+       known->second.info.fileSize == fileInfo.size())
+    {
+        imageInfos_.push_back(known->second.info);
+        return enqueue(foundImages_, imageInfos_.back());
+    }
+    if(known != knownImages_.end())
+        knownImages_.erase(known);
 
-            imageInfos_.push_back({path, dateTime});
-            emit imageFound(imageInfos_.back());
+    QDateTime dateTime;
+    if(Hdr::isHdrFile(path))
+    {
+        QString error;
+        const auto size = Hdr::imageSize(path, error, &mustStop_);
+        if(mustStop_)
+            return false;
+        if(size.width() != size.height() * 2)
+            return true;
+        // HDR files carry no EXIF
+        dateTime = getFallbackDateTime(path);
+    }
+    else
+    {
+        auto head = readFile(path, HEADER_READ_SIZE);
+        if(!head)
+            return !mustStop_;
+        QBuffer buffer(&*head);
+        auto size = QImageReader(&buffer).size();
+        if(!size.isValid() && head->size() == HEADER_READ_SIZE)
+        {
+            StoppableFile file(path, &mustStop_);
+            if(!file.open(QIODevice::ReadOnly))
+                return true;
+            size = QImageReader(&file).size();
+            if(mustStop_)
+                return false;
         }
+        if(size.width() != size.height() * 2)
+            return true;
+        dateTime = getDateTime(path, *head);
     }
+
+    imageInfos_.push_back({path, dateTime, modificationTime, fileInfo.size()});
+    return enqueue(foundImages_, imageInfos_.back());
+}
+
+std::optional<QByteArray> ImageFinder::readFile(const QString& path, const qint64 maxBytes) const
+{
+    QFile file(path);
+    if(!file.open(QFile::ReadOnly))
+    {
+        qWarning() << "Failed to open" << path << ":" << file.errorString();
+        return std::nullopt;
+    }
+    QByteArray data(std::min(maxBytes, file.size()), Qt::Uninitialized);
+    for(qint64 done = 0; done < data.size();)
+    {
+        if(mustStop_)
+            return std::nullopt;
+        const qint64 bytesRead = file.read(data.data() + done, std::min<qint64>(StoppableFile::CHUNK_SIZE, data.size() - done));
+        if(bytesRead <= 0)
+        {
+            qWarning() << "Failed to read" << path << ":" << file.errorString();
+            return std::nullopt;
+        }
+        done += bytesRead;
+    }
+    return data;
+}
+
+void ImageFinder::storeCheckpoint(const QStringList& roots, const std::vector<QString>& pendingDirs,
+                                  const std::size_t imageCount) const
+{
+    const auto path = checkpointPath();
+    QDir().mkpath(QFileInfo(path).absolutePath());
+    QSaveFile file(path);
+    if(!file.open(QFile::WriteOnly))
+    {
+        qWarning() << "Failed to open scan checkpoint for writing:" << file.errorString();
+        return;
+    }
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_6_0);
+    stream.writeRawData(CHECKPOINT_MAGIC, sizeof CHECKPOINT_MAGIC);
+    stream << CHECKPOINT_VERSION << roots << QStringList(pendingDirs.begin(), pendingDirs.end())
+           << quint64(imageCount);
+    for(std::size_t n = 0; n < imageCount; ++n)
+    {
+        const auto& info = imageInfos_[n];
+        stream << info.path << info.dateTime << info.modificationTime << info.fileSize;
+    }
+    if(!file.commit())
+        qWarning() << "Failed to write scan checkpoint:" << file.errorString();
+}
+
+bool ImageFinder::restoreCheckpoint(const QStringList& roots, std::vector<QString>& pendingDirs,
+                                    std::vector<ImageInfo>& images) const
+{
+    QFile file(checkpointPath());
+    if(!file.open(QFile::ReadOnly))
+        return false;
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_6_0);
+    char magic[sizeof CHECKPOINT_MAGIC];
+    if(stream.readRawData(magic, sizeof magic) != sizeof magic || std::memcmp(magic, CHECKPOINT_MAGIC, sizeof magic))
+        return false;
+    quint32 version = 0;
+    QStringList storedRoots, dirs;
+    quint64 imageCount = 0;
+    stream >> version >> storedRoots >> dirs >> imageCount;
+    // A checkpoint of another set of roots would give a partial scan of the current ones
+    if(version != CHECKPOINT_VERSION || storedRoots != roots)
+        return false;
+    for(quint64 n = 0; n < imageCount && stream.status() == QDataStream::Ok; ++n)
+    {
+        ImageInfo info;
+        stream >> info.path >> info.dateTime >> info.modificationTime >> info.fileSize;
+        images.push_back(std::move(info));
+    }
+    if(stream.status() != QDataStream::Ok)
+    {
+        qWarning() << "Scan checkpoint is corrupt, scanning from the start";
+        images.clear();
+        return false;
+    }
+    pendingDirs.assign(dirs.begin(), dirs.end());
+    return true;
 }
 
 void ImageFinder::loadThumbnails()
 {
-    std::vector<QImage> images;
     for(const auto& info : imageInfos_)
     {
         if(mustStop_) return;
+        const auto known = knownImages_.find(info.path);
+        if(known != knownImages_.end() && known->second.hasThumbnail)
+            continue;
 
-        QImageReader reader(info.path);
-        reader.setScaledSize(QSize(thumbnailWidth_, thumbnailWidth_ / 2));
-        const auto& img = images.emplace_back(reader.read());
+        const QSize size(thumbnailWidth_, thumbnailWidth_ / 2);
+        QString error;
+        QImage img;
+        if(Hdr::isHdrFile(info.path))
+        {
+            img = Hdr::decodeThumbnail(info.path, size, error, &mustStop_);
+        }
+        else
+        {
+            // Streamed in chunks, so that stop() can interrupt it between them
+            StoppableFile file(info.path, &mustStop_);
+            if(!file.open(QIODevice::ReadOnly))
+            {
+                qWarning() << "Failed to open" << info.path << ":" << file.errorString();
+                continue;
+            }
+            QImageReader reader(&file);
+            reader.setScaledSize(size);
+            img = reader.read();
+            error = reader.errorString();
+        }
+        if(mustStop_) return;
         if(img.isNull())
         {
-            qDebug().noquote().nospace() << "Failed to read \"" << info.path << "\":" << reader.errorString();
+            qDebug().noquote().nospace() << "Failed to read \"" << info.path << "\":" << error;
             continue;
         }
-        emit thumbnailReady(info.path, img);
+        if(!enqueue(thumbnails_, Thumbnail{info.path, std::move(img)})) return;
     }
 }
 
+void ImageFinder::setKnownImages(std::unordered_map<QString, KnownImage> images)
+{
+    knownImages_ = std::move(images);
+}
+
 void ImageFinder::run()
 {
     findAllImages();
+    if(mustStop_) return;
+    scanFinished_ = true;
     std::sort(imageInfos_.begin(), imageInfos_.end(),
               [](const auto& a, const auto& b) { return a.dateTime > b.dateTime; });
     loadThumbnails();
@@ -1,37 +1,79 @@
 #pragma once
 
 #include <atomic>
+#include <optional>
+#include <unordered_map>
 #include <QThread>
 #include <QDateTime>
 #include <QStringList>
+#include "SpscQueue.hpp"
 
 struct ImageInfo
 {
     QString path;
     QDateTime dateTime;
+    qint64 modificationTime = 0; // ms since epoch
+    qint64 fileSize = 0;
 };
 
+class QFileInfo;
 class ImageFinder : public QThread
 {
     Q_OBJECT
 
 public:
+    struct KnownImage
+    {
+        ImageInfo info;
+        bool hasThumbnail;
+    };
+    struct Thumbnail
+    {
+        QString path;
+        QImage image;
+    };
     ImageFinder(int thumbnailWidth, QObject* parent = nullptr);
+    // Images that are already in the gallery, e.g. from a snapshot. If the
+    // file hasn't changed, its metadata isn't read again, and if it has a
+    // thumbnail, the thumbnail isn't loaded. Must be called before start().
+    void setKnownImages(std::unordered_map<QString/*path*/, KnownImage> images);
+    // Makes the thread finish soon: the finder checks for it between files,
+    // directory entries and chunks of file data. A read from a stalled file
+    // system still blocks it until the read returns, so don't wait for it
+    // without a timeout.
     void stop();
 
+    // The results are passed to the GUI thread through bounded queues, which
+    // the GUI drains at its own pace. When a queue is full, the finder waits.
+    SpscQueue<ImageInfo>& foundImages() { return foundImages_; }
+    SpscQueue<Thumbnail>& thumbnails() { return thumbnails_; }
+    // All the images have been found and pushed to foundImages(), known or not
+    bool scanFinished() const { return scanFinished_; }
+
 protected:
     void run() override;
 
 private:
     void findAllImages();
+    // Returns false if the scan must stop
+    bool addFoundImage(const QString& path, const QFileInfo& fileInfo);
     void loadThumbnails();
-
-signals:
-    void imageFound(ImageInfo info);
-    void thumbnailReady(QString path, QImage thumbnail);
+    std::optional<QByteArray> readFile(const QString& path, qint64 maxBytes) const;
+    // The checkpoint is the list of directories yet to be scanned, and the
+    // images found in those that have been scanned, for the given roots
+    void storeCheckpoint(const QStringList& roots, const std::vector<QString>& pendingDirs,
+                         std::size_t imageCount) const;
+    bool restoreCheckpoint(const QStringList& roots, std::vector<QString>& pendingDirs,
+                           std::vector<ImageInfo>& images) const;
+    template<typename T>
+    bool enqueue(SpscQueue<T>& queue, T value);
 
 private:
     std::vector<ImageInfo> imageInfos_;
+    std::unordered_map<QString, KnownImage> knownImages_;
     int thumbnailWidth_;
+    SpscQueue<ImageInfo> foundImages_;
+    SpscQueue<Thumbnail> thumbnails_;
+    std::atomic_bool scanFinished_{false};
     std::atomic_bool mustStop_{false};
 };
@@ -0,0 +1,264 @@
+#include "InputTrace.hpp"
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <QTimer>
+#include <QEvent>
+#include <QKeyEvent>
+#include <QFileInfo>
+#include <QEventLoop>
+#include <QWheelEvent>
+#include <QMouseEvent>
+#include <QCoreApplication>
+#include <QCryptographicHash>
+#include "Canvas.hpp"
+
+namespace
+{
+
+constexpr char TRACE_HEADER[] = "4piview-trace 1";
+constexpr int LOAD_TIMEOUT = 60'000; // ms
+
+// Round-trips exactly, so that the replay gets the recorded values
+QString number(const double value)
+{
+    return QString::number(value, 'g', QLocale::FloatingPointShortest);
+}
+
+// Replays opening the file. The trace has the time when the file was shown,
+// not when its loading started, so the replay stops the clock until then.
+bool openFile(Canvas& canvas, const QString& path)
+{
+    if(!QFileInfo::exists(path))
+    {
+        std::cerr << "File \"" << path.toStdString() << "\" from the trace doesn't exist\n";
+        return false;
+    }
+    QEventLoop loop;
+    QObject::connect(&canvas, &Canvas::newImageLoaded, &loop, &QEventLoop::quit);
+    QTimer::singleShot(LOAD_TIMEOUT, &loop, &QEventLoop::quit);
+    canvas.openFile(path);
+    if(!canvas.fileOpened())
+        loop.exec();
+    if(!canvas.fileOpened())
+    {
+        std::cerr << "Timed out loading \"" << path.toStdString() << "\"\n";
+        return false;
+    }
+    return true;
+}
+
+double percentile(std::vector<double> values, const double fraction)
+{
+    if(values.empty()) return -1;
+    const auto nth = values.begin() + std::lround(fraction * (values.size() - 1));
+    std::nth_element(values.begin(), nth, values.end());
+    return *nth;
+}
+
+void printSummary(const char*const name, const std::vector<double>& times)
+{
+    if(times.empty()) return;
+    std::cout << name << " time per frame: median " << percentile(times, 0.5) << " ms, 95th percentile "
+              << percentile(times, 0.95) << " ms, max " << percentile(times, 1) << " ms\n";
+}
+
+}
+
+namespace InputTrace
+{
+
+Recorder::Recorder(Canvas*const canvas, const QString& path)
+    : QObject(canvas)
+    , canvas_(canvas)
+    , file_(path)
+{
+    if(!file_.open(QFile::WriteOnly | QFile::Truncate | QFile::Text))
+    {
+        qWarning().noquote() << "Failed to open" << path << "to record the trace:" << file_.errorString();
+        return;
+    }
+    stream_.setDevice(&file_);
+    stream_ << TRACE_HEADER << "\n";
+    clock_.start();
+    write(QString("size %1 %2").arg(canvas->width()).arg(canvas->height()));
+    if(!canvas->currentFile().isEmpty())
+        write("open " + canvas->currentFile());
+
+    canvas->installEventFilter(this);
+    connect(canvas, &Canvas::newImageLoaded, this, [this]
+            { write("open " + canvas_->currentFile()); });
+    connect(canvas, &Canvas::sensorReadingReceived, this,
+            [this](const qint64 timestamp, const double x, const double y, const double z)
+            { write(QString("sensor %1 %2 %3 %4").arg(timestamp).arg(number(x), number(y), number(z))); });
+    connect(canvas, &Canvas::frameSwapped, this, [this]
+    {
+        write("frame");
+        // So that the trace of a crash is complete up to the last frame
+        stream_.flush();
+    });
+    qDebug().noquote() << "Recording the input trace to" << path;
+}
+
+void Recorder::write(const QString& line)
+{
+    if(!file_.isOpen()) return;
+    stream_ << clock_.nsecsElapsed() / 1000 << ' ' << line << '\n';
+}
+
+bool Recorder::eventFilter(QObject*const watched, QEvent*const event)
+{
+    switch(event->type())
+    {
+    case QEvent::Resize:
+        write(QString("size %1 %2").arg(canvas_->width()).arg(canvas_->height()));
+        break;
+    case QEvent::MouseButtonPress:
+    case QEvent::MouseButtonRelease:
+    case QEvent::MouseMove:
+    {
+        const auto mouse = static_cast<QMouseEvent*>(event);
+        const QString type = event->type() == QEvent::MouseButtonPress   ? "press" :
+                             event->type() == QEvent::MouseButtonRelease ? "release" : "move";
+        write(QString("%1 %2 %3 %4 %5 %6").arg(type, number(mouse->position().x()), number(mouse->position().y()))
+                                          .arg(int(mouse->button())).arg(mouse->buttons().toInt())
+                                          .arg(mouse->modifiers().toInt()));
+        break;
+    }
+    case QEvent::Wheel:
+    {
+        const auto wheel = static_cast<QWheelEvent*>(event);
+        write(QString("wheel %1 %2 %3 %4 %5 %6").arg(number(wheel->position().x()), number(wheel->position().y()))
+                                                .arg(wheel->angleDelta().x()).arg(wheel->angleDelta().y())
+                                                .arg(wheel->buttons().toInt()).arg(wheel->modifiers().toInt()));
+        break;
+    }
+    case QEvent::KeyPress:
+    {
+        const auto key = static_cast<QKeyEvent*>(event);
+        write(QString("key %1 %2").arg(key->key()).arg(key->modifiers().toInt()));
+        break;
+    }
+    default:
+        break;
+    }
+    return QObject::eventFilter(watched, event);
+}
+
+bool replay(const QString& tracePath, const QString& reportPath, const bool hashes)
+{
+    QFile traceFile(tracePath);
+    if(!traceFile.open(QFile::ReadOnly | QFile::Text))
+    {
+        std::cerr << "Failed to open the trace \"" << tracePath.toStdString() << "\": "
+                  << traceFile.errorString().toStdString() << "\n";
+        return false;
+    }
+    QTextStream trace(&traceFile);
+    if(trace.readLine() != TRACE_HEADER)
+    {
+        std::cerr << "\"" << tracePath.toStdString() << "\" is not an input trace\n";
+        return false;
+    }
+    QFile reportFile(reportPath);
+    if(!reportFile.open(QFile::WriteOnly | QFile::Truncate | QFile::Text))
+    {
+        std::cerr << "Failed to open \"" << reportPath.toStdString() << "\" for the report: "
+                  << reportFile.errorString().toStdString() << "\n";
+        return false;
+    }
+    QTextStream report(&reportFile);
+    report << "frame,time_ms,cpu_ms,gpu_ms" << (hashes ? ",hash" : "") << "\n";
+
+    Canvas canvas;
+    canvas.setAttribute(Qt::WA_DontShowOnScreen);
+    canvas.setReplayTime(0);
+    canvas.show();
+    // Initializes GL, so that GPU timing can be set up
+    canvas.grabFramebuffer();
+    if(!canvas.setGpuTimingEnabled(true))
+        std::cout << "The GPU can't measure time, only CPU time will be reported\n";
+
+    std::vector<double> cpuTimes, gpuTimes;
+    int lineNumber = 1;
+    while(!trace.atEnd())
+    {
+        const auto line = trace.readLine();
+        ++lineNumber;
+        const auto fields = line.split(' ', Qt::SkipEmptyParts);
+        if(fields.isEmpty()) continue;
+        bool ok = false;
+        const double time = fields[0].toLongLong(&ok) / 1000.;
+        if(!ok || fields.size() < 2)
+        {
+            std::cerr << "Bad event at line " << lineNumber << " of the trace\n";
+            return false;
+        }
+        canvas.setReplayTime(time);
+        const auto& type = fields[1];
+        const auto value = [&fields](const int index) { return fields.value(index).toDouble(); };
+        const auto flags = [&fields](const int index) { return fields.value(index).toInt(); };
+        const QPointF pos(value(2), value(3));
+        if(type == "size")
+        {
+            canvas.resize(flags(2), flags(3));
+        }
+        else if(type == "open")
+        {
+            if(!openFile(canvas, line.section(' ', 2)))
+                return false;
+        }
+        else if(type == "press" || type == "release" || type == "move")
+        {
+            const auto eventType = type == "press"   ? QEvent::MouseButtonPress :
+                                   type == "release" ? QEvent::MouseButtonRelease : QEvent::MouseMove;
+            QMouseEvent event(eventType, pos, canvas.mapToGlobal(pos), Qt::MouseButton(flags(4)),
+                              Qt::MouseButtons::fromInt(flags(5)), Qt::KeyboardModifiers::fromInt(flags(6)));
+            QCoreApplication::sendEvent(&canvas, &event);
+        }
+        else if(type == "wheel")
+        {
+            QWheelEvent event(pos, canvas.mapToGlobal(pos), QPoint(), QPoint(flags(4), flags(5)),
+                              Qt::MouseButtons::fromInt(flags(6)), Qt::KeyboardModifiers::fromInt(flags(7)),
+                              Qt::NoScrollPhase, false);
+            QCoreApplication::sendEvent(&canvas, &event);
+        }
+        else if(type == "key")
+        {
+            QKeyEvent event(QEvent::KeyPress, flags(2), Qt::KeyboardModifiers::fromInt(flags(3)));
+            QCoreApplication::sendEvent(&canvas, &event);
+        }
+        else if(type == "sensor")
+        {
+            canvas.replaySensorReading(fields.value(2).toLongLong(), value(3), value(4), value(5));
+        }
+        else if(type == "frame")
+        {
+            const auto image = canvas.grabFramebuffer();
+            const auto timing = canvas.lastFrameTiming();
+            report << cpuTimes.size() << ',' << number(time) << ',' << number(timing.cpu) << ',' << number(timing.gpu);
+            if(hashes)
+            {
+                const auto bytes = QByteArray::fromRawData(reinterpret_cast<const char*>(image.constBits()),
+                                                           image.sizeInBytes());
+                report << ',' << QCryptographicHash::hash(bytes, QCryptographicHash::Sha1).toHex();
+            }
+            report << '\n';
+            cpuTimes.push_back(timing.cpu);
+            if(timing.gpu >= 0)
+                gpuTimes.push_back(timing.gpu);
+        }
+        else
+        {
+            std::cerr << "Unknown event \"" << type.toStdString() << "\" at line " << lineNumber << " of the trace\n";
+            return false;
+        }
+    }
+
+    std::cout << "Replayed " << cpuTimes.size() << " frames\n";
+    printSummary("CPU", cpuTimes);
+    printSummary("GPU", gpuTimes);
+    return true;
+}
+
+}
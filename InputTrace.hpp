@@ -0,0 +1,43 @@
+#pragma once
+
+#include <QFile>
+#include <QObject>
+#include <QTextStream>
+#include <QElapsedTimer>
+
+class Canvas;
+// Traces of what drives the frames of a Canvas: the input events, the
+// readings of the rotation sensor, the opened files and the frames
+// themselves, with their times. A trace is text, one event per line, so that
+// it can be inspected and trimmed by hand. Replaying it renders the same
+// frames with the same inputs, independent of the speed of the machine, so
+// that frame-time regressions can be found in a headless run.
+namespace InputTrace
+{
+
+// Records the main view into the file for as long as it lives
+class Recorder : public QObject
+{
+public:
+    Recorder(Canvas* canvas, const QString& path);
+
+protected:
+    bool eventFilter(QObject* watched, QEvent* event) override;
+
+private:
+    void write(const QString& line);
+
+    Canvas* canvas_;
+    QFile file_;
+    QTextStream stream_;
+    QElapsedTimer clock_;
+};
+
+// Replays the trace in a hidden canvas, rendering each recorded frame after
+// the events that preceded it. Writes CSV with the CPU and GPU time of each
+// frame to reportPath, with a hash of the rendered image if hashes is set,
+// and prints a summary to stdout. Files are opened as recorded, and the
+// replay waits for them to load. Returns false if the trace couldn't be read.
+bool replay(const QString& tracePath, const QString& reportPath, bool hashes);
+
+}
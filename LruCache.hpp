@@ -0,0 +1,101 @@
+#pragma once
+
+#include <list>
+#include <optional>
+#include <algorithm>
+#include <QString>
+#include "MemoryBudget.hpp"
+
+// Keeps values keyed by file path within a budget of bytes, evicting the
+// least recently used ones when a new value doesn't fit. The sizes are
+// whatever the user says they are, so the same class serves for RAM and
+// GPU memory. What the cache holds is registered with MemoryBudget under
+// the given category.
+template<typename T>
+class LruCache
+{
+public:
+    LruCache(const qint64 budget, const MemoryBudget::Category category)
+        : budget_(budget)
+        , allocation_(category, 0)
+    {
+    }
+
+    // Replaces any value with the same key. A value larger than the whole
+    // budget isn't kept.
+    void insert(const QString& key, T value, const qint64 bytes)
+    {
+        remove(key);
+        if(bytes > budget_) return;
+        entries_.push_front({key, std::move(value), bytes});
+        size_ += bytes;
+        evictOverBudget();
+    }
+    // Removes the value from the cache and returns it
+    std::optional<T> take(const QString& key)
+    {
+        const auto it = find(key);
+        if(it == entries_.end()) return std::nullopt;
+        std::optional<T> value(std::move(it->value));
+        size_ -= it->bytes;
+        entries_.erase(it);
+        allocation_.resize(size_);
+        return value;
+    }
+    void remove(const QString& key)
+    {
+        const auto it = find(key);
+        if(it == entries_.end()) return;
+        size_ -= it->bytes;
+        entries_.erase(it);
+        allocation_.resize(size_);
+    }
+    bool contains(const QString& key) const
+    {
+        return std::any_of(entries_.begin(), entries_.end(), [&](const Entry& e){ return e.key == key; });
+    }
+    void clear()
+    {
+        entries_.clear();
+        size_ = 0;
+        allocation_.resize(0);
+    }
+    // Evicts the least recently used values until the rest fit
+    void setBudget(const qint64 budget)
+    {
+        budget_ = budget;
+        evictOverBudget();
+    }
+    qint64 size() const { return size_; }
+    qint64 budget() const { return budget_; }
+
+private:
+    struct Entry
+    {
+        QString key;
+        T value;
+        qint64 bytes;
+    };
+
+    void evictOverBudget()
+    {
+        while(size_ > budget_)
+        {
+            size_ -= entries_.back().bytes;
+            entries_.pop_back();
+        }
+        allocation_.resize(size_);
+    }
+
+    typename std::list<Entry>::iterator find(const QString& key)
+    {
+        return std::find_if(entries_.begin(), entries_.end(), [&](const Entry& e){ return e.key == key; });
+    }
+
+    // Most recently used first. There are only a handful of entries, so
+    // linear search is fine.
+    std::list<Entry> entries_;
+    qint64 budget_;
+    qint64 size_ = 0;
+    MemoryBudget::Allocation allocation_;
+};
@@ -1,24 +1,41 @@
 #include "MainWin.hpp"
 #include <QLabel>
 #include <QTimer>
+#include <QDialog>
 #include <QAction>
 #include <QMenuBar>
+#include <QSpinBox>
+#include <QBoxLayout>
 #include <QCloseEvent>
+#include <QFormLayout>
 #include <QGridLayout>
 #include <QToolButton>
 #include <QFileDialog>
 #include <QMessageBox>
 #include <QApplication>
+#include <QActionGroup>
+#include <QProgressDialog>
+#include <QDialogButtonBox>
+#include "Utils.hpp"
 #include "Canvas.hpp"
 #include "Gallery.hpp"
 
+namespace
+{
+
+QString openFileFilter()
+{
+    return QObject::tr("Images and videos") + " (*.jpg *.png *.tiff *.insp *.hdr *.exr *.mp4 *.mov *.mkv *.webm)";
+}
+
+}
+
 void MainWin::openFile()
 {
     hintLabel_->hide();
-    const QString filter = tr("Images") + " (*.jpg *.png *.tiff)";
     QString defaultDir;
     const auto file = QFileDialog::getOpenFileName(this, tr("Open image file"),
-                                                   defaultDir, filter);
+                                                   defaultDir, openFileFilter());
     if(file.isEmpty())
     {
         closeFile();
@@ -27,27 +44,171 @@ void MainWin::openFile()
     doOpenFile(file);
 }
 
+void MainWin::ensureGallery()
+{
+    // Creating the gallery starts the scan of the storage, which is not needed
+    // when we start with a file to show, until the user wants to leave it
+    if(gallery_) return;
+    Utils::startupEvent("Creating the gallery");
+    gallery_ = new Gallery;
+    layout_->insertWidget(layout_->indexOf(views_), gallery_);
+    gallery_->setVisible(!views_->isVisible());
+    connect(gallery_, &Gallery::openFileRequest, this, &MainWin::doOpenFile);
+}
+
 void MainWin::doOpenFile(const QString& path)
 {
-    hintLabel_->setText(tr("Loading image..."));
-    hintLabel_->show();
-    gallery_->hide();
+    if(gallery_)
+        gallery_->hide();
     if(openFileButton_)
         openFileButton_->hide();
-    canvas_->show();
-    QTimer::singleShot(10, [this, path]{ canvas_->openFile(path); });
+    views_->show();
+    canvas_->setFocus();
+    if(canvas_->isCached(path))
+    {
+        canvas_->openFile(path);
+        prefetchNeighbors(path);
+        return;
+    }
+    hintLabel_->setText(tr("Loading image..."));
+    hintLabel_->show();
+    QTimer::singleShot(10, [this, path]
+    {
+        canvas_->openFile(path);
+        prefetchNeighbors(path);
+    });
+}
+
+void MainWin::openAdjacentFile(const int step)
+{
+    ensureGallery();
+    const auto path = gallery_->adjacentPath(canvas_->currentFile(), step);
+    if(!path.isEmpty())
+        doOpenFile(path);
+}
+
+void MainWin::prefetchNeighbors(const QString& path)
+{
+    if(!gallery_) return;
+    canvas_->prefetch({gallery_->adjacentPath(path, -1),
+                       gallery_->adjacentPath(path, 1)});
+}
+
+void MainWin::exportView()
+{
+    if(!canvas_->fileOpened() || !canvas_->isVisible())
+        return;
+
+    QDialog sizeDialog(this);
+    sizeDialog.setWindowTitle(tr("Export view"));
+    const auto form = new QFormLayout(&sizeDialog);
+    const auto widthBox = new QSpinBox;
+    const auto heightBox = new QSpinBox;
+    for(const auto box : {widthBox, heightBox})
+    {
+        box->setRange(16, 65535);
+        box->setSuffix(tr(" px"));
+    }
+    // Defaults to the aspect ratio of the window at print-like resolution
+    const auto viewSize = canvas_->size() * canvas_->devicePixelRatio();
+    widthBox->setValue(viewSize.width() * 4);
+    heightBox->setValue(viewSize.height() * 4);
+    form->addRow(tr("Width:"), widthBox);
+    form->addRow(tr("Height:"), heightBox);
+    const auto buttons = new QDialogButtonBox(QDialogButtonBox::Ok | QDialogButtonBox::Cancel);
+    connect(buttons, &QDialogButtonBox::accepted, &sizeDialog, &QDialog::accept);
+    connect(buttons, &QDialogButtonBox::rejected, &sizeDialog, &QDialog::reject);
+    form->addRow(buttons);
+    if(sizeDialog.exec() != QDialog::Accepted)
+        return;
+
+    const auto path = QFileDialog::getSaveFileName(this, tr("Export view"), {},
+                                                   tr("Images") + " (*.png *.tif *.tiff *.jpg)");
+    if(path.isEmpty())
+        return;
+
+    QProgressDialog progressDialog(tr("Exporting the view..."), tr("Cancel"), 0, 1, this);
+    progressDialog.setWindowModality(Qt::WindowModal);
+    progressDialog.setMinimumDuration(500);
+    QString error;
+    const bool ok = canvas_->exportView(path, QSize(widthBox->value(), heightBox->value()), error,
+                                        [&progressDialog](const int done, const int total)
+                                        {
+                                            progressDialog.setMaximum(total);
+                                            progressDialog.setValue(done);
+                                            return !progressDialog.wasCanceled();
+                                        });
+    if(!ok && !progressDialog.wasCanceled())
+    {
+        QMessageBox::critical(this, tr("Error exporting view"),
+                              tr("Failed to export the view to\n\"%1\":\n%2").arg(path).arg(error));
+    }
 }
 
 void MainWin::closeFile()
 {
     canvas_->closeImage();
     setWindowTitle(appName_);
-    canvas_->hide();
+    views_->hide();
+    ensureGallery();
     gallery_->show();
     if(openFileButton_)
         openFileButton_->show();
 }
 
+void MainWin::addView()
+{
+    const auto view = new Canvas;
+    extraViews_.push_back(view);
+    viewsLayout_->addWidget(view);
+    connect(view, &Canvas::newFileRequested, this, [this, view]{ openFileInView(view); });
+    connect(view, &Canvas::adjacentFileRequested, this, [this, view](const int step)
+            { openAdjacentFileInView(view, step); });
+    connect(view, &Canvas::cameraChanged, this, [this, view]{ syncCameras(view); });
+    view->setProjection(canvas_->projection());
+    // Starts with the file of the main view, which costs neither a decode
+    // nor a texture, since the views share them
+    if(!canvas_->currentFile().isEmpty())
+        view->openFile(canvas_->currentFile());
+    if(camerasLinked_)
+        view->setCamera(canvas_->camera());
+}
+
+void MainWin::removeView()
+{
+    if(extraViews_.empty()) return;
+    delete extraViews_.back();
+    extraViews_.pop_back();
+}
+
+void MainWin::openFileInView(Canvas*const view)
+{
+    const auto file = QFileDialog::getOpenFileName(this, tr("Open image file"), {}, openFileFilter());
+    if(!file.isEmpty())
+        view->openFile(file);
+}
+
+void MainWin::openAdjacentFileInView(Canvas*const view, const int step)
+{
+    ensureGallery();
+    const auto path = gallery_->adjacentPath(view->currentFile(), step);
+    if(!path.isEmpty())
+        view->openFile(path);
+}
+
+void MainWin::syncCameras(const Canvas*const source)
+{
+    if(!camerasLinked_) return;
+    const auto camera = source->camera();
+    if(source != canvas_)
+        canvas_->setCamera(camera);
+    for(const auto view : extraViews_)
+    {
+        if(view != source)
+            view->setCamera(camera);
+    }
+}
+
 void MainWin::closeEvent(QCloseEvent* event)
 {
 #ifdef Q_OS_ANDROID
@@ -83,19 +244,20 @@ void MainWin::showAboutDialog()
 MainWin::MainWin(const QString& appName, const QString& filePath, QWidget* parent)
     : QMainWindow(parent)
     , appName_(appName)
-    , gallery_(new Gallery)
     , canvas_(new Canvas)
+    , views_(new QWidget)
+    , viewsLayout_(new QHBoxLayout(views_))
 {
     setWindowTitle(appName_);
     setWindowIcon(QIcon(":icon.png"));
 
     const auto holder = new QWidget;
-    const auto layout = new QVBoxLayout;
-    holder->setLayout(layout);
+    layout_ = new QVBoxLayout;
+    holder->setLayout(layout_);
     setCentralWidget(holder);
 
-    layout->setContentsMargins(0,0,0,0);
-    layout->setSpacing(0);
+    layout_->setContentsMargins(0,0,0,0);
+    layout_->setSpacing(0);
 #ifdef Q_OS_ANDROID
     const auto toolbarHBox = new QHBoxLayout;
     openFileButton_ = new QToolButton;
@@ -105,12 +267,16 @@ MainWin::MainWin(const QString& appName, const QString& filePath, QWidget* paren
     connect(openFileButton_, &QToolButton::clicked, this, &MainWin::openFile);
     toolbarHBox->addStretch(10);
     toolbarHBox->addWidget(openFileButton_);
-    layout->addLayout(toolbarHBox);
+    layout_->addLayout(toolbarHBox);
 #endif
-    layout->addWidget(gallery_);
-    layout->addWidget(canvas_);
+    viewsLayout_->setContentsMargins(0,0,0,0);
+    viewsLayout_->setSpacing(2);
+    viewsLayout_->addWidget(canvas_);
+    layout_->addWidget(views_);
 
     connect(canvas_, &Canvas::newFileRequested, this, &MainWin::openFile);
+    connect(canvas_, &Canvas::adjacentFileRequested, this, &MainWin::openAdjacentFile);
+    connect(canvas_, &Canvas::cameraChanged, this, [this]{ syncCameras(canvas_); });
 
     const auto vbox = new QVBoxLayout(canvas_);
     vbox->addStretch(1);
@@ -122,13 +288,12 @@ MainWin::MainWin(const QString& appName, const QString& filePath, QWidget* paren
     connect(canvas_, &Canvas::newImageLoaded, [this]
             {
                 hintLabel_->hide();
-                gallery_->hide();
+                if(gallery_)
+                    gallery_->hide();
                 if(openFileButton_)
                     openFileButton_->hide();
             });
 
-    connect(gallery_, &Gallery::openFileRequest, this, &MainWin::doOpenFile);
-
 #ifndef Q_OS_ANDROID
     const auto menuBar = this->menuBar();
     const auto aboutAction = new QAction(tr("&About"), this);
@@ -139,14 +304,65 @@ MainWin::MainWin(const QString& appName, const QString& filePath, QWidget* paren
             { setWindowTitle(fileName + " - " + appName_); });
 
     const auto fileMenu = menuBar->addMenu(tr("&File"));
+    const auto viewMenu = menuBar->addMenu(tr("&View"));
     const auto helpMenu = menuBar->addMenu(tr("&Help"));
     helpMenu->addAction(aboutAction);
 
+    const auto projectionMenu = viewMenu->addMenu(tr("&Projection"));
+    const auto projectionGroup = new QActionGroup(this);
+    const std::pair<Canvas::Projection, QString> projections[] =
+    {
+        {Canvas::Projection::Equirect,     tr("&Rectilinear")},
+        {Canvas::Projection::CubeMap,      tr("Rectilinear via &cube map")},
+        {Canvas::Projection::LittlePlanet, tr("&Little planet")},
+        {Canvas::Projection::Fisheye,      tr("&Fisheye")},
+        {Canvas::Projection::VRStereo,     tr("&VR side by side")},
+    };
+    for(const auto& [projection, name] : projections)
+    {
+        const auto action = projectionMenu->addAction(name);
+        action->setCheckable(true);
+        action->setChecked(projection == canvas_->projection());
+        action->setData(int(projection));
+        projectionGroup->addAction(action);
+        connect(action, &QAction::triggered, this, [this, projection = projection]
+                {
+                    canvas_->setProjection(projection);
+                    for(const auto view : extraViews_)
+                        view->setProjection(projection);
+                });
+    }
+    connect(canvas_, &Canvas::projectionChanged, this, [projectionGroup](const Canvas::Projection projection)
+            {
+                for(const auto action : projectionGroup->actions())
+                    action->setChecked(action->data().toInt() == int(projection));
+            });
+
+    const auto addViewAction = viewMenu->addAction(tr("&Add view for comparison"));
+    addViewAction->setShortcut(QKeySequence::fromString("Ctrl+Shift+N"));
+    connect(addViewAction, &QAction::triggered, this, &MainWin::addView);
+    const auto removeViewAction = viewMenu->addAction(tr("&Remove view"));
+    removeViewAction->setShortcut(QKeySequence::fromString("Ctrl+Shift+W"));
+    connect(removeViewAction, &QAction::triggered, this, &MainWin::removeView);
+    const auto linkCamerasAction = viewMenu->addAction(tr("&Link cameras of the views"));
+    linkCamerasAction->setShortcut(QKeySequence::fromString("Ctrl+L"));
+    linkCamerasAction->setCheckable(true);
+    connect(linkCamerasAction, &QAction::toggled, this, [this](const bool linked)
+            {
+                camerasLinked_ = linked;
+                syncCameras(canvas_);
+            });
+
     const auto openAction = new QAction(tr("&Open"), this);
     openAction->setShortcut(QKeySequence::fromString("Ctrl+O"));
     connect(openAction, &QAction::triggered, this, &MainWin::openFile);
     fileMenu->addAction(openAction);
 
+    const auto exportAction = new QAction(tr("&Export view..."), this);
+    exportAction->setShortcut(QKeySequence::fromString("Ctrl+E"));
+    connect(exportAction, &QAction::triggered, this, &MainWin::exportView);
+    fileMenu->addAction(exportAction);
+
     const auto closeAction = new QAction(tr("&Close"), this);
     closeAction->setShortcut(QKeySequence::fromString("Ctrl+W"));
     connect(closeAction, &QAction::triggered, this, &MainWin::closeFile);
@@ -159,7 +375,15 @@ MainWin::MainWin(const QString& appName, const QString& filePath, QWidget* paren
 #endif
 
     if(!filePath.isEmpty())
-        QTimer::singleShot(0, [this, filePath]{canvas_->openFile(filePath);});
+    {
+        // Start decoding right away, so that it overlaps creation of the
+        // window and initialization of GL
+        canvas_->openFile(filePath);
+    }
     else
-        canvas_->hide();
+    {
+        views_->hide();
+        ensureGallery();
+    }
+    Utils::startupEvent("Main window constructed");
 }
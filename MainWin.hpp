@@ -1,27 +1,47 @@
 #pragma once
 
+#include <vector>
 #include <QMainWindow>
 
 class QLabel;
 class Canvas;
 class Gallery;
 class QToolButton;
+class QHBoxLayout;
+class QVBoxLayout;
 class MainWin : public QMainWindow
 {
 public:
     MainWin(const QString& appName, const QString& filePath, QWidget* parent = nullptr);
+    // The main view
+    Canvas* canvas() const { return canvas_; }
 protected:
 
     void closeEvent(QCloseEvent* event) override;
 private:
     void showAboutDialog();
+    void ensureGallery();
     void doOpenFile(const QString& path);
+    void openAdjacentFile(int step);
+    void prefetchNeighbors(const QString& path);
     void openFile();
+    void exportView();
     void closeFile();
+    // Views besides canvas_, side by side with it, for comparison
+    void addView();
+    void removeView();
+    void openFileInView(Canvas* view);
+    void openAdjacentFileInView(Canvas* view, int step);
+    void syncCameras(const Canvas* source);
 
     const QString appName_;
     Gallery* gallery_ = nullptr;
     Canvas* canvas_ = nullptr;
+    std::vector<Canvas*> extraViews_;
+    bool camerasLinked_ = false;
+    QWidget* views_ = nullptr;
+    QHBoxLayout* viewsLayout_ = nullptr;
     QLabel* hintLabel_ = nullptr;
     QToolButton* openFileButton_ = nullptr;
+    QVBoxLayout* layout_ = nullptr;
 };
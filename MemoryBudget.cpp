@@ -0,0 +1,334 @@
+#include "MemoryBudget.hpp"
+#include <tuple>
+#include <algorithm>
+#include <QFile>
+#include <QDebug>
+#include <QFileInfo>
+#include <QSettings>
+#include <QStandardPaths>
+
+namespace
+{
+
+constexpr int POLL_PERIOD = 1000; // ms
+// Fractions of the budget, and of the cgroup or system limit
+constexpr double HIGH_USAGE = 0.75;
+constexpr double CRITICAL_USAGE = 0.95;
+constexpr double HIGH_SYSTEM_USAGE = 0.85;
+constexpr double CRITICAL_SYSTEM_USAGE = 0.95;
+// Percentages of time stalled on memory in the last 10 s, see PSI in the kernel docs
+constexpr double HIGH_SOME_STALL = 10;
+constexpr double CRITICAL_FULL_STALL = 5;
+// To leave a pressure level, usage must fall this much below the threshold
+// that led to it, so that the level doesn't flap around the threshold
+constexpr double HYSTERESIS = 0.9;
+
+// Where the kernel tells about the memory of our cgroup, or of the system
+struct MemoryFiles
+{
+    QString limit;
+    QString usage;
+    QString stat;
+    QString pressure;
+    bool cgroupV1 = false;
+};
+
+#ifdef Q_OS_LINUX
+MemoryFiles findMemoryFiles()
+{
+    MemoryFiles files;
+    // cgroup v2 has a single hierarchy, listed as "0::/path"
+    QFile cgroups("/proc/self/cgroup");
+    if(cgroups.open(QFile::ReadOnly))
+    {
+        for(const auto& line : cgroups.readAll().split('\n'))
+        {
+            if(!line.startsWith("0::")) continue;
+            // In a container, our cgroup is usually mounted as the root
+            for(const auto& dir : {"/sys/fs/cgroup" + QString::fromUtf8(line.mid(3)), QString("/sys/fs/cgroup")})
+            {
+                if(QFileInfo::exists(dir + "/memory.max"))
+                {
+                    files.limit = dir + "/memory.max";
+                    files.usage = dir + "/memory.current";
+                    files.stat = dir + "/memory.stat";
+                    files.pressure = dir + "/memory.pressure";
+                    return files;
+                }
+            }
+        }
+    }
+    if(QFileInfo::exists("/sys/fs/cgroup/memory/memory.limit_in_bytes"))
+    {
+        files.limit = "/sys/fs/cgroup/memory/memory.limit_in_bytes";
+        files.usage = "/sys/fs/cgroup/memory/memory.usage_in_bytes";
+        files.stat = "/sys/fs/cgroup/memory/memory.stat";
+        files.cgroupV1 = true;
+    }
+    files.pressure = "/proc/pressure/memory";
+    return files;
+}
+#endif
+
+const MemoryFiles& memoryFiles()
+{
+#ifdef Q_OS_LINUX
+    static const MemoryFiles files = findMemoryFiles();
+#else
+    static const MemoryFiles files;
+#endif
+    return files;
+}
+
+QByteArray readSmallFile(const QString& path)
+{
+    if(path.isEmpty()) return {};
+    QFile file(path);
+    if(!file.open(QFile::ReadOnly)) return {};
+    return file.readAll().trimmed();
+}
+
+// -1 if there's no limit
+qint64 cgroupLimit()
+{
+    const auto value = readSmallFile(memoryFiles().limit);
+    bool ok = false;
+    const qint64 limit = value.toLongLong(&ok);
+    // v2 says "max" when unlimited, v1 gives a huge number
+    if(!ok || (memoryFiles().cgroupV1 && limit >= (qint64(1) << 60)))
+        return -1;
+    return limit;
+}
+
+// Value of a "Key:  123 kB" line of /proc/meminfo, in bytes, or -1
+qint64 memInfo(const QByteArray& meminfo, const QByteArray& key)
+{
+    for(const auto& line : meminfo.split('\n'))
+    {
+        if(!line.startsWith(key + ':')) continue;
+        const auto fields = line.mid(key.size() + 1).simplified().split(' ');
+        return fields.value(0).toLongLong() * 1024;
+    }
+    return -1;
+}
+
+// Value of a "key 123" line of memory.stat of the cgroup, or 0
+qint64 cgroupStat(const QByteArray& key)
+{
+    for(const auto& line : readSmallFile(memoryFiles().stat).split('\n'))
+    {
+        const auto fields = line.split(' ');
+        if(fields.size() == 2 && fields[0] == key)
+            return fields[1].toLongLong();
+    }
+    return 0;
+}
+
+// The usage and the limit of the cgroup if it has a limit, otherwise of the
+// system. The page cache that the kernel can drop right away doesn't count.
+std::pair<qint64, qint64> systemMemory()
+{
+    if(const auto limit = cgroupLimit(); limit > 0)
+    {
+        bool ok = false;
+        const qint64 usage = readSmallFile(memoryFiles().usage).toLongLong(&ok);
+        if(!ok) return {-1, limit};
+        const auto inactiveFile = cgroupStat(memoryFiles().cgroupV1 ? "total_inactive_file" : "inactive_file");
+        return {std::max<qint64>(0, usage - inactiveFile), limit};
+    }
+#ifdef Q_OS_LINUX
+    const auto meminfo = readSmallFile("/proc/meminfo");
+    const auto total = memInfo(meminfo, "MemTotal");
+    const auto available = memInfo(meminfo, "MemAvailable");
+    if(total > 0 && available >= 0)
+        return {total - available, total};
+#endif
+    return {-1, -1};
+}
+
+// The avg10 values of the "some" and "full" lines of a PSI file, or -1
+std::pair<double, double> memoryStall()
+{
+    double some = -1, full = -1;
+    for(const auto& line : readSmallFile(memoryFiles().pressure).split('\n'))
+    {
+        const auto fields = line.split(' ');
+        if(fields.size() < 2 || !fields[1].startsWith("avg10=")) continue;
+        const double value = fields[1].mid(6).toDouble();
+        if(fields[0] == "some")
+            some = value;
+        else if(fields[0] == "full")
+            full = value;
+    }
+    return {some, full};
+}
+
+qint64 defaultBudget()
+{
+    const auto path = QStandardPaths::writableLocation(QStandardPaths::AppConfigLocation) + "/memory.ini";
+    if(QFileInfo::exists(path))
+    {
+        const QSettings settings(path, QSettings::IniFormat);
+        bool ok = false;
+        const qint64 mib = settings.value("budgetMiB").toLongLong(&ok);
+        if(ok && mib > 0)
+            return mib << 20;
+    }
+    if(const auto limit = cgroupLimit(); limit > 0)
+        return limit / 4 * 3;
+    if(const auto total = systemMemory().second; total > 0)
+        return total / 2;
+    return 0;
+}
+
+const char* name(const MemoryBudget::Category category)
+{
+    switch(category)
+    {
+    case MemoryBudget::Category::Images:     return "images";
+    case MemoryBudget::Category::Textures:   return "textures";
+    case MemoryBudget::Category::Thumbnails: return "thumbnails";
+    case MemoryBudget::Category::Decoding:   return "decoding";
+    default:                                 return "?";
+    }
+}
+
+const char* name(const MemoryBudget::Pressure pressure)
+{
+    switch(pressure)
+    {
+    case MemoryBudget::Pressure::Normal: return "normal";
+    case MemoryBudget::Pressure::High:   return "high";
+    default:                             return "critical";
+    }
+}
+
+}
+
+MemoryBudget::Allocation::Allocation(const Category category, const qint64 bytes)
+    : category_(category)
+{
+    resize(bytes);
+}
+
+MemoryBudget::Allocation::Allocation(Allocation&& other) noexcept
+    : category_(other.category_)
+    , bytes_(other.bytes_)
+{
+    other.bytes_ = 0;
+}
+
+MemoryBudget::Allocation& MemoryBudget::Allocation::operator=(Allocation&& other) noexcept
+{
+    if(this == &other) return *this;
+    resize(0);
+    category_ = other.category_;
+    bytes_ = other.bytes_;
+    other.bytes_ = 0;
+    return *this;
+}
+
+void MemoryBudget::Allocation::resize(const qint64 bytes)
+{
+    if(bytes == bytes_) return;
+    MemoryBudget::instance().add(category_, bytes - bytes_);
+    bytes_ = bytes;
+}
+
+MemoryBudget& MemoryBudget::instance()
+{
+    // Never destroyed, as allocations may be released until the very end
+    static const auto budget = new MemoryBudget;
+    return *budget;
+}
+
+MemoryBudget::MemoryBudget()
+    : budget_(defaultBudget())
+{
+    qDebug() << "Memory budget:" << (budget_ ? QString("%1 MiB").arg(budget_ >> 20) : QString("unlimited"));
+    connect(&pollTimer_, &QTimer::timeout, this, &MemoryBudget::evaluate);
+    pollTimer_.start(POLL_PERIOD);
+}
+
+qint64 MemoryBudget::usage() const
+{
+    qint64 total = 0;
+    for(const auto& bytes : usage_)
+        total += bytes;
+    return total;
+}
+
+void MemoryBudget::add(const Category category, const qint64 bytes)
+{
+    usage_[int(category)] += bytes;
+    // Growth past the budget shouldn't wait for the next poll
+    if(bytes > 0 && budget_ && pressure_ == Pressure::Normal && usage() > HIGH_USAGE * budget_ &&
+       !evaluationQueued_.exchange(true))
+    {
+        QMetaObject::invokeMethod(this, [this]
+        {
+            evaluationQueued_ = false;
+            evaluate();
+        }, Qt::QueuedConnection);
+    }
+}
+
+MemoryBudget::Report MemoryBudget::report() const
+{
+    Report report;
+    report.budget = budget_;
+    report.total = usage();
+    for(int n = 0; n < int(Category::Count); ++n)
+        report.byCategory[n] = usage_[n];
+    std::tie(report.systemUsage, report.systemLimit) = systemMemory();
+    report.stallPercent = memoryStall().first;
+    report.pressure = pressure_;
+    return report;
+}
+
+void MemoryBudget::evaluate()
+{
+    const auto current = pressure_.load();
+    const auto above = [current](const double value, const double threshold, const Pressure level)
+    {
+        return value >= (current >= level ? threshold * HYSTERESIS : threshold);
+    };
+
+    const double usageFraction = budget_ ? double(usage()) / budget_ : 0;
+    const auto [systemUsage, systemLimit] = systemMemory();
+    const double systemFraction = systemUsage >= 0 && systemLimit > 0 ? double(systemUsage) / systemLimit : 0;
+    const auto [someStall, fullStall] = memoryStall();
+
+    Pressure pressure = Pressure::Normal;
+    if(above(usageFraction, CRITICAL_USAGE, Pressure::Critical) ||
+       above(systemFraction, CRITICAL_SYSTEM_USAGE, Pressure::Critical) ||
+       above(fullStall, CRITICAL_FULL_STALL, Pressure::Critical))
+        pressure = Pressure::Critical;
+    else if(above(usageFraction, HIGH_USAGE, Pressure::High) ||
+            above(systemFraction, HIGH_SYSTEM_USAGE, Pressure::High) ||
+            above(someStall, HIGH_SOME_STALL, Pressure::High))
+        pressure = Pressure::High;
+
+    if(pressure == current) return;
+    pressure_ = pressure;
+    qDebug().nospace() << "Memory pressure is " << name(pressure) << " now: " << report();
+    emit pressureChanged(pressure);
+}
+
+QDebug operator<<(QDebug debug, const MemoryBudget::Report& report)
+{
+    const QDebugStateSaver saver(debug);
+    debug.nospace() << report.total / (1 << 20) << " MiB used";
+    if(report.budget)
+        debug << " of " << report.budget / (1 << 20) << " MiB";
+    debug << " (";
+    for(int n = 0; n < int(MemoryBudget::Category::Count); ++n)
+        debug << (n ? ", " : "") << name(MemoryBudget::Category(n)) << ": " << report.byCategory[n] / (1 << 20);
+    debug << ")";
+    if(report.systemLimit > 0)
+        debug << ", system: " << report.systemUsage / (1 << 20) << " of " << report.systemLimit / (1 << 20) << " MiB";
+    if(report.stallPercent >= 0)
+        debug << ", stalled " << report.stallPercent << "% of the time";
+    debug << ", pressure " << name(report.pressure);
+    return debug;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <QTimer>
+#include <QObject>
+
+// Accounts for the large allocations of the app (decoded images, textures,
+// thumbnails) against a single budget, and tells the parts of the app that
+// hold them when memory gets tight. The budget is taken from budgetMiB in
+// memory.ini in the config location of the app if it's set there, otherwise
+// it's 3/4 of the cgroup memory limit, or half of the physical memory.
+// Texture memory is counted too, since on the integrated GPUs of the devices
+// where memory is tight it comes from the same RAM.
+class MemoryBudget : public QObject
+{
+    Q_OBJECT
+
+public:
+    enum class Category
+    {
+        Images,     // decoded images waiting to be uploaded or cached
+        Textures,
+        Thumbnails,
+        Decoding,   // buffers of decoders while they run
+        Count
+    };
+    enum class Pressure
+    {
+        Normal,
+        // Caches should shrink and prefetching should pause
+        High,
+        // Everything that can be dropped should be, and new images should
+        // be loaded at a lower resolution
+        Critical,
+    };
+    struct Report
+    {
+        qint64 budget;  // bytes, 0 if unlimited
+        qint64 total;
+        std::array<qint64, int(Category::Count)> byCategory;
+        // Of the cgroup, or the system if there's no cgroup limit; -1 if unknown
+        qint64 systemUsage;
+        qint64 systemLimit;
+        // Share of the last 10 s in which some threads stalled on memory, from PSI; -1 if unknown
+        double stallPercent;
+        Pressure pressure;
+    };
+
+    // A registered allocation, released on destruction. Thread-safe.
+    class Allocation
+    {
+    public:
+        Allocation() = default;
+        Allocation(Category category, qint64 bytes);
+        Allocation(Allocation&& other) noexcept;
+        Allocation& operator=(Allocation&& other) noexcept;
+        ~Allocation() { resize(0); }
+        void resize(qint64 bytes);
+        qint64 bytes() const { return bytes_; }
+
+    private:
+        Category category_ = Category::Images;
+        qint64 bytes_ = 0;
+    };
+
+    // Must first be called from the GUI thread
+    static MemoryBudget& instance();
+
+    qint64 budget() const { return budget_; }
+    qint64 usage() const;
+    qint64 usage(Category category) const { return usage_[int(category)]; }
+    Pressure pressure() const { return pressure_; }
+    Report report() const;
+
+signals:
+    void pressureChanged(MemoryBudget::Pressure pressure);
+
+private:
+    MemoryBudget();
+    void add(Category category, qint64 bytes);
+    void evaluate();
+
+    qint64 budget_ = 0;
+    std::array<std::atomic<qint64>, int(Category::Count)> usage_{};
+    std::atomic<Pressure> pressure_{Pressure::Normal};
+    std::atomic_bool evaluationQueued_{false};
+    QTimer pollTimer_;
+};
+
+QDebug operator<<(QDebug debug, const MemoryBudget::Report& report);
@@ -0,0 +1,155 @@
+#include "OrientationTracker.hpp"
+#include <cmath>
+#include <algorithm>
+#include <QDebug>
+#include <QRotationSensor>
+
+namespace
+{
+
+constexpr double DEGREE = M_PI / 180;
+constexpr unsigned MAX_SAMPLES = 64;
+constexpr int WANTED_DATA_RATE = 200; // Hz
+// Parameters of the adaptive low-pass filter (the "1€ filter"): slow motion
+// is smoothed heavily to remove jitter, fast motion barely at all to avoid lag.
+constexpr double MIN_CUTOFF = 1.5;      // Hz
+constexpr double CUTOFF_PER_SPEED = 1;  // Hz per rad/s
+constexpr double VELOCITY_CUTOFF = 2;   // Hz
+constexpr double MAX_PREDICTION = 0.1;  // s
+// Averaging factor for the timing measurements
+constexpr double TIMING_SMOOTHING = 0.05;
+
+double lowPassFactor(const double cutoff, const double dt)
+{
+    return 1 / (1 + 1 / (2 * M_PI * cutoff * dt));
+}
+
+Eigen::Quaterniond toQuaternion(const double x, const double y, const double z)
+{
+    using namespace Eigen;
+    Quaterniond q =
+        // Compensate for the default 0,0,0 orientation,
+        // which represents the phone lying on a table.
+        AngleAxisd(M_PI/2, -Vector3d::UnitY()) *
+        // Apply the sensed rotation
+        AngleAxisd(z * DEGREE, Vector3d::UnitX()) *
+        AngleAxisd(x * DEGREE, Vector3d::UnitY()) *
+        AngleAxisd(y * DEGREE, Vector3d::UnitZ());
+    return q.normalized();
+}
+
+}
+
+OrientationTracker::OrientationTracker(QObject* parent)
+    : QObject(parent)
+    , sensor_(new QRotationSensor(this))
+{
+    clock_.start();
+    connect(sensor_, &QRotationSensor::readingChanged, this, &OrientationTracker::handleReading);
+    if(!sensor_->connectToBackend())
+    {
+        qDebug() << "Failed to connect sensor to backend";
+        return;
+    }
+    // Data rate is in Hz. Get as close to the wanted rate as the sensor allows.
+    int rate = 0;
+    for(const auto& range : sensor_->availableDataRates())
+    {
+        const int candidate = std::clamp(WANTED_DATA_RATE, range.first, range.second);
+        if(std::abs(candidate - WANTED_DATA_RATE) < std::abs(rate - WANTED_DATA_RATE))
+            rate = candidate;
+    }
+    if(rate)
+        sensor_->setDataRate(rate);
+    qDebug() << "Sensor connected to backend, starting with data rate" << rate << "Hz";
+    sensor_->start();
+}
+
+void OrientationTracker::handleReading()
+{
+    const auto reading = sensor_->reading();
+    if(!reading || !sensor_->hasZ()) return;
+    emit readingReceived(reading->timestamp(), reading->x(), reading->y(), reading->z());
+    addReading(reading->timestamp(), toQuaternion(reading->x(), reading->y(), reading->z()));
+}
+
+void OrientationTracker::replayReading(const qint64 timestamp, const double x, const double y, const double z)
+{
+    addReading(timestamp, toQuaternion(x, y, z));
+}
+
+void OrientationTracker::addReading(const qint64 timestamp, const Eigen::Quaterniond& orientation)
+{
+    const auto receiptTime = now();
+    // The sensor clock has an unknown origin. The smallest difference between
+    // the receipt time and the timestamp is our best estimate of the offset,
+    // i.e. of the time when the reading was taken; the larger differences are
+    // delivery jitter that we don't want in the velocity.
+    Sample sample{receiptTime, timestamp ? receiptTime - timestamp : 0, orientation};
+    qint64 clockOffset = sample.clockOffset;
+    for(const auto& s : samples_)
+        clockOffset = std::min(clockOffset, s.clockOffset);
+    if(timestamp)
+        sample.time = timestamp + clockOffset;
+
+    if(samples_.empty())
+    {
+        smoothed_ = sample.orientation;
+        samples_.push_back(sample);
+        return;
+    }
+
+    const auto& last = samples_.back();
+    if(last.orientation.dot(sample.orientation) < 0)
+        sample.orientation.coeffs() = -sample.orientation.coeffs();
+    const double dt = std::max(sample.time - last.time, qint64(1000)) * 1e-6;
+
+    const Eigen::AngleAxisd delta(last.orientation.conjugate() * sample.orientation);
+    const Eigen::Vector3d velocity = delta.axis() * delta.angle() / dt;
+    angularVelocity_ += lowPassFactor(VELOCITY_CUTOFF, dt) * (velocity - angularVelocity_);
+    const double cutoff = MIN_CUTOFF + CUTOFF_PER_SPEED * angularVelocity_.norm();
+    smoothed_ = smoothed_.slerp(lowPassFactor(cutoff, dt), sample.orientation).normalized();
+
+    samples_.push_back(sample);
+    if(samples_.size() > MAX_SAMPLES)
+        samples_.pop_front();
+}
+
+Eigen::Quaterniond OrientationTracker::beginFrame()
+{
+    if(samples_.empty())
+        return Eigen::Quaterniond::Identity();
+    const auto start = now();
+    frameStart_ = start;
+    frameSampleTime_ = samples_.back().time;
+
+    const double predictionTime = std::clamp((start + displayDelay_ - frameSampleTime_) * 1e-6,
+                                             0., MAX_PREDICTION);
+    const double speed = angularVelocity_.norm();
+    if(speed < 1e-6)
+        return smoothed_;
+    return smoothed_ * Eigen::Quaterniond(Eigen::AngleAxisd(speed * predictionTime, angularVelocity_ / speed));
+}
+
+void OrientationTracker::frameSwapped()
+{
+    const auto swapTime = now();
+    if(lastSwap_ >= 0 && swapTime - lastSwap_ < 100000)
+        refreshPeriod_ += TIMING_SMOOTHING * (swapTime - lastSwap_ - refreshPeriod_);
+    lastSwap_ = swapTime;
+    if(frameStart_ < 0) return;
+
+    // The swap returns around the vertical blank, after which the frame is
+    // scanned out. Take the middle of the screen as the time it's seen.
+    const double displayTime = swapTime + refreshPeriod_ / 2;
+    displayDelay_ += TIMING_SMOOTHING * (displayTime - frameStart_ - displayDelay_);
+    latency_ += TIMING_SMOOTHING * (displayTime - frameSampleTime_ - latency_);
+    frameStart_ = -1;
+
+    if(swapTime - lastReport_ > 10'000'000)
+    {
+        qDebug().nospace() << "Sensor-to-photon latency: " << latency() << " ms, of which rendering and display: "
+                           << displayDelay_ / 1000 << " ms";
+        lastReport_ = swapTime;
+    }
+}
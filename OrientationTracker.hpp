@@ -0,0 +1,64 @@
+#pragma once
+
+#include <deque>
+#include <QObject>
+#include <QElapsedTimer>
+#include <Eigen/Geometry>
+
+class QRotationSensor;
+// Turns the readings of the rotation sensor into a smooth orientation of the
+// device, predicted to the moment when the frame being rendered reaches the
+// screen, and measures how long it takes from a reading to the screen.
+class OrientationTracker : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit OrientationTracker(QObject* parent = nullptr);
+    // Whether the sensor has delivered anything yet
+    bool isActive() const { return !samples_.empty(); }
+    // To be called when rendering of a frame starts. Returns the orientation
+    // expected at the time the frame is displayed.
+    Eigen::Quaterniond beginFrame();
+    // To be called when the frame has been swapped to the screen
+    void frameSwapped();
+    // Average time from a sensor reading to the display of the frame it went into, in ms
+    double latency() const { return latency_ / 1000; }
+
+    // For replaying traces: makes the tracker take the time, in µs, as now
+    // rather than reading its clock, and feeds it a reading as if it came
+    // from the sensor, see readingReceived()
+    void setReplayTime(qint64 time) { replayTime_ = time; }
+    void replayReading(qint64 timestamp, double x, double y, double z);
+
+signals:
+    // A reading as reported by the sensor: its timestamp in µs, and the
+    // angles in degrees
+    void readingReceived(qint64 timestamp, double x, double y, double z);
+
+private:
+    void handleReading();
+    void addReading(qint64 timestamp, const Eigen::Quaterniond& orientation);
+    qint64 now() const { return replayTime_ >= 0 ? replayTime_ : clock_.nsecsElapsed() / 1000; }
+
+    struct Sample
+    {
+        qint64 time;        // µs, our clock
+        qint64 clockOffset; // µs, receipt time minus the sensor timestamp
+        Eigen::Quaterniond orientation;
+    };
+    QRotationSensor* sensor_ = nullptr;
+    QElapsedTimer clock_;
+    qint64 replayTime_ = -1; // µs, -1 if not replaying
+    std::deque<Sample> samples_; // raw, newest last
+    Eigen::Quaterniond smoothed_ = Eigen::Quaterniond::Identity();
+    Eigen::Vector3d angularVelocity_ = Eigen::Vector3d::Zero(); // rad/s, in the device frame
+
+    qint64 frameStart_ = -1;    // µs, -1 if no frame is waiting for a swap
+    qint64 frameSampleTime_ = 0;
+    qint64 lastSwap_ = -1;
+    double refreshPeriod_ = 16667; // µs
+    double displayDelay_ = 33333;  // µs from the start of rendering to the display
+    double latency_ = 0;           // µs
+    qint64 lastReport_ = 0;
+};
@@ -0,0 +1,375 @@
+#include "PyramidCache.hpp"
+#include <cstring>
+#include <algorithm>
+#include <QDir>
+#include <QDebug>
+#include <QDateTime>
+#include <QSaveFile>
+#include <QFileInfo>
+#include <QStandardPaths>
+#include <QCryptographicHash>
+#include "Utils.hpp"
+
+namespace
+{
+
+constexpr char MAGIC[8] = {'4','p','i','P','y','r','m','d'};
+constexpr quint32 VERSION = 3; // 2: latitude-aware wrapping mip filter, 3: flags
+constexpr quint32 DUAL_FISHEYE_FLAG = 1;
+constexpr qint64 DATA_ALIGNMENT = 4096;
+constexpr qint64 MAX_CACHE_SIZE = 4ll << 30;
+
+struct FileHeader
+{
+    char magic[8];
+    quint32 version;
+    quint32 pixelFormat;
+    quint32 tileSize;
+    quint32 levelCount;
+    quint32 sourceWidth;
+    quint32 sourceHeight;
+    qint64 sourceModificationTime; // ms since epoch
+    qint64 sourceFileSize;
+    quint32 flags;
+    quint32 reserved;
+};
+
+struct LevelHeader
+{
+    quint32 width;
+    quint32 height;
+    quint64 offset;
+};
+
+QString cacheDir()
+{
+    return QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/pyramids";
+}
+
+QString cacheFilePath(const QFileInfo& source)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(source.absoluteFilePath().toUtf8());
+    return cacheDir() + "/" + QString::fromLatin1(hash.result().toHex()) + ".pyramid";
+}
+
+qint64 tileBytes(const ImagePyramid::PixelFormat format)
+{
+    constexpr int T = ImagePyramid::TILE_SIZE;
+    if(ImagePyramid::isCompressed(format))
+        return TextureCompressor::compressedSize(QSize(T, T));
+    return qint64(T) * T * ImagePyramid::bytesPerPixel(format);
+}
+
+ImagePyramid::PixelFormat pixelFormat(const TextureCompressor::Format format)
+{
+    switch(format)
+    {
+    case TextureCompressor::Format::BC1:       return ImagePyramid::PixelFormat::BC1;
+    case TextureCompressor::Format::ETC2_RGB8: return ImagePyramid::PixelFormat::ETC2_RGB8;
+    }
+    return ImagePyramid::PixelFormat::BC1;
+}
+
+qint64 alignUp(const qint64 value, const qint64 alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+void evictOldEntries()
+{
+    QDir dir(cacheDir());
+    // Sorted by modification time from newest to oldest. Loading an entry
+    // touches its file, so this is the LRU order.
+    const auto entries = dir.entryInfoList({"*.pyramid"}, QDir::Files, QDir::Time);
+    qint64 totalSize = 0;
+    for(const auto& entry : entries)
+    {
+        totalSize += entry.size();
+        if(totalSize > MAX_CACHE_SIZE)
+        {
+            qDebug() << "Evicting" << entry.fileName() << "from the pyramid cache";
+            QFile::remove(entry.absoluteFilePath());
+        }
+    }
+}
+
+}
+
+class PyramidCacheReader
+{
+public:
+    static std::shared_ptr<const ImagePyramid> map(const QString& cacheFilePath, const QFileInfo& source, const int maxSize,
+                                                   const std::optional<TextureCompressor::Format> compression)
+    {
+        auto pyramid = std::make_shared<ImagePyramid>();
+        auto& file = pyramid->file_;
+        file.setFileName(cacheFilePath);
+        if(!file.open(QFile::ReadOnly))
+            return nullptr;
+        const auto data = file.map(0, file.size());
+        if(!data || file.size() < qint64(sizeof(FileHeader)))
+            return nullptr;
+
+        FileHeader header;
+        std::memcpy(&header, data, sizeof header);
+        if(std::memcmp(header.magic, MAGIC, sizeof MAGIC) || header.version != VERSION ||
+           header.tileSize != ImagePyramid::TILE_SIZE)
+            return nullptr;
+        if(header.sourceModificationTime != source.lastModified().toMSecsSinceEpoch() ||
+           header.sourceFileSize != source.size())
+        {
+            qDebug() << "Pyramid cache entry for" << source.filePath() << "is stale";
+            return nullptr;
+        }
+        const auto format = ImagePyramid::PixelFormat(header.pixelFormat);
+        if(header.pixelFormat < quint32(ImagePyramid::PixelFormat::Gray8) ||
+           header.pixelFormat > quint32(ImagePyramid::PixelFormat::ETC2_RGB8))
+            return nullptr;
+        if(ImagePyramid::isCompressed(format) ? !compression || format != pixelFormat(*compression)
+                                              : compression && format != ImagePyramid::PixelFormat::RGBA8)
+        {
+            qDebug() << "Pyramid cache entry for" << source.filePath() << "doesn't match the texture compression of the GPU";
+            return nullptr;
+        }
+        if(file.size() < qint64(sizeof header + header.levelCount * sizeof(LevelHeader)) || !header.levelCount)
+            return nullptr;
+
+        for(quint32 n = 0; n < header.levelCount; ++n)
+        {
+            LevelHeader levelHeader;
+            std::memcpy(&levelHeader, data + sizeof header + n * sizeof levelHeader, sizeof levelHeader);
+            const QSize size(levelHeader.width, levelHeader.height);
+            const qint64 tileCount = qint64(size.width() + ImagePyramid::TILE_SIZE - 1) / ImagePyramid::TILE_SIZE *
+                                     ((size.height() + ImagePyramid::TILE_SIZE - 1) / ImagePyramid::TILE_SIZE);
+            if(qint64(levelHeader.offset) + tileCount * tileBytes(format) > file.size())
+                return nullptr;
+            pyramid->levels_.push_back({size, levelHeader.offset});
+        }
+
+        // The cache entry may have been made for a device with a smaller texture size limit
+        const auto wantedBaseSize = QSize(header.sourceWidth, header.sourceHeight).boundedTo(QSize(maxSize, maxSize));
+        const auto baseSize = pyramid->levels_[0].size;
+        if(baseSize.width() < wantedBaseSize.width() || baseSize.height() < wantedBaseSize.height())
+        {
+            qDebug() << "Pyramid cache entry for" << source.filePath() << "has too low resolution";
+            return nullptr;
+        }
+
+        pyramid->data_ = data;
+        pyramid->format_ = format;
+        pyramid->dualFisheye_ = header.flags & DUAL_FISHEYE_FLAG;
+        return pyramid;
+    }
+};
+
+int ImagePyramid::bytesPerPixel(const PixelFormat format)
+{
+    switch(format)
+    {
+    case PixelFormat::Gray8: return 1;
+    case PixelFormat::RGB8:  return 3;
+    case PixelFormat::RGBA8: return 4;
+    case PixelFormat::BC1:
+    case PixelFormat::ETC2_RGB8:
+        break;
+    }
+    return 0;
+}
+
+QImage::Format ImagePyramid::imageFormat() const
+{
+    switch(format_)
+    {
+    case PixelFormat::Gray8: return QImage::Format_Grayscale8;
+    case PixelFormat::RGB8:  return QImage::Format_RGB888;
+    case PixelFormat::RGBA8: return QImage::Format_RGBA8888;
+    case PixelFormat::BC1:
+    case PixelFormat::ETC2_RGB8:
+        break;
+    }
+    return QImage::Format_Invalid;
+}
+
+std::optional<TextureCompressor::Format> ImagePyramid::compressedFormat() const
+{
+    switch(format_)
+    {
+    case PixelFormat::BC1:       return TextureCompressor::Format::BC1;
+    case PixelFormat::ETC2_RGB8: return TextureCompressor::Format::ETC2_RGB8;
+    default:                     return std::nullopt;
+    }
+}
+
+const uchar* ImagePyramid::tile(const int level, const int tileX, const int tileY) const
+{
+    const auto& lvl = levels_[level];
+    return data_ + lvl.offset + (qint64(tileY) * tilesX(level) + tileX) * tileBytes(format_);
+}
+
+int ImagePyramid::tileDataSize(const int level, const int tileX, const int tileY) const
+{
+    const auto size = levelSize(level);
+    const QSize tileSize(std::min(TILE_SIZE, size.width() - tileX * TILE_SIZE),
+                         std::min(TILE_SIZE, size.height() - tileY * TILE_SIZE));
+    if(isCompressed(format_))
+        return TextureCompressor::compressedSize(tileSize);
+    return (tileSize.height() - 1) * TILE_SIZE * bytesPerPixel(format_) + tileSize.width() * bytesPerPixel(format_);
+}
+
+QImage ImagePyramid::levelImage(const int level) const
+{
+    if(isCompressed(format_)) return {};
+    const auto size = levelSize(level);
+    QImage image(size, imageFormat());
+    if(image.isNull()) return image;
+    const int bpp = bytesPerPixel(format_);
+    for(int tileY = 0; tileY < tilesY(level); ++tileY)
+    {
+        for(int tileX = 0; tileX < tilesX(level); ++tileX)
+        {
+            const auto src = tile(level, tileX, tileY);
+            const int width = std::min(TILE_SIZE, size.width() - tileX * TILE_SIZE);
+            const int height = std::min(TILE_SIZE, size.height() - tileY * TILE_SIZE);
+            for(int row = 0; row < height; ++row)
+            {
+                std::memcpy(image.scanLine(tileY * TILE_SIZE + row) + tileX * TILE_SIZE * bpp,
+                            src + row * TILE_SIZE * bpp, width * bpp);
+            }
+        }
+    }
+    return image;
+}
+
+namespace PyramidCache
+{
+
+std::shared_ptr<const ImagePyramid> load(const QString& path, const int maxSize,
+                                         const std::optional<TextureCompressor::Format> compression)
+{
+    const QFileInfo source(path);
+    const auto cachePath = cacheFilePath(source);
+    if(!QFile::exists(cachePath))
+        return nullptr;
+    auto pyramid = PyramidCacheReader::map(cachePath, source, maxSize, compression);
+    if(!pyramid)
+    {
+        QFile::remove(cachePath);
+        return nullptr;
+    }
+    // Mark the entry as recently used
+    QFile file(cachePath);
+    if(file.open(QFile::ReadWrite))
+        file.setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+    qDebug() << "Loaded pyramid of" << path << "from the cache";
+    return pyramid;
+}
+
+bool store(const QString& path, const QSize& sourceSize, const std::vector<QImage>& levels,
+           const bool dualFisheye, const std::optional<TextureCompressor::Format> compression)
+{
+    if(levels.empty()) return false;
+    ImagePyramid::PixelFormat format;
+    switch(levels[0].format())
+    {
+    case QImage::Format_Grayscale8: format = ImagePyramid::PixelFormat::Gray8; break;
+    case QImage::Format_RGB888:     format = ImagePyramid::PixelFormat::RGB8;  break;
+    case QImage::Format_RGBA8888:   format = ImagePyramid::PixelFormat::RGBA8; break;
+    default:
+        qWarning() << "Pyramid cache doesn't support image format" << levels[0].format();
+        return false;
+    }
+    if(compression && TextureCompressor::canCompress(levels[0].format()))
+        format = pixelFormat(*compression);
+
+    const QFileInfo source(path);
+    if(!QDir().mkpath(cacheDir()))
+        return false;
+    QSaveFile file(cacheFilePath(source));
+    if(!file.open(QFile::WriteOnly))
+    {
+        qWarning() << "Failed to open pyramid cache file for writing:" << file.errorString();
+        return false;
+    }
+
+    FileHeader header = {};
+    std::memcpy(header.magic, MAGIC, sizeof MAGIC);
+    header.version = VERSION;
+    header.pixelFormat = quint32(format);
+    header.tileSize = ImagePyramid::TILE_SIZE;
+    header.levelCount = levels.size();
+    header.sourceWidth = sourceSize.width();
+    header.sourceHeight = sourceSize.height();
+    header.sourceModificationTime = source.lastModified().toMSecsSinceEpoch();
+    header.sourceFileSize = source.size();
+    header.flags = dualFisheye ? DUAL_FISHEYE_FLAG : 0;
+    file.write(reinterpret_cast<const char*>(&header), sizeof header);
+
+    constexpr int T = ImagePyramid::TILE_SIZE;
+    qint64 offset = alignUp(sizeof header + levels.size() * sizeof(LevelHeader), DATA_ALIGNMENT);
+    for(const auto& level : levels)
+    {
+        const LevelHeader levelHeader{quint32(level.width()), quint32(level.height()), quint64(offset)};
+        file.write(reinterpret_cast<const char*>(&levelHeader), sizeof levelHeader);
+        offset += qint64((level.width() + T - 1) / T) * ((level.height() + T - 1) / T) * tileBytes(format);
+    }
+    file.write(QByteArray(alignUp(file.pos(), DATA_ALIGNMENT) - file.pos(), 0));
+
+    if(ImagePyramid::isCompressed(format))
+    {
+        // Compressing is slow, so a whole row of tiles is done in parallel
+        const auto compressedFormat = *compression;
+        QByteArray tileRow;
+        for(const auto& level : levels)
+        {
+            const int tilesX = (level.width() + T - 1) / T;
+            for(int tileY = 0; tileY < level.height(); tileY += T)
+            {
+                tileRow.fill(0, tilesX * tileBytes(format));
+                Utils::parallelFor(tilesX, [&](const int tileIndex)
+                {
+                    const int tileX = tileIndex * T;
+                    const QRect rect(tileX, tileY, std::min(T, level.width() - tileX),
+                                     std::min(T, level.height() - tileY));
+                    TextureCompressor::compress(compressedFormat, level, rect,
+                                                reinterpret_cast<uchar*>(tileRow.data()) + tileIndex * tileBytes(format));
+                });
+                file.write(tileRow);
+            }
+        }
+    }
+    else
+    {
+        const int bpp = ImagePyramid::bytesPerPixel(format);
+        QByteArray tile(tileBytes(format), 0);
+        for(const auto& level : levels)
+        {
+            for(int tileY = 0; tileY < level.height(); tileY += T)
+            {
+                for(int tileX = 0; tileX < level.width(); tileX += T)
+                {
+                    const int width = std::min(T, level.width() - tileX);
+                    const int height = std::min(T, level.height() - tileY);
+                    if(width < T || height < T)
+                        tile.fill(0);
+                    for(int row = 0; row < height; ++row)
+                    {
+                        std::memcpy(tile.data() + row * T * bpp,
+                                    level.constScanLine(tileY + row) + tileX * bpp, width * bpp);
+                    }
+                    file.write(tile);
+                }
+            }
+        }
+    }
+    if(!file.commit())
+    {
+        qWarning() << "Failed to write pyramid cache file:" << file.errorString();
+        return false;
+    }
+    qDebug() << "Stored pyramid of" << path << "in the cache";
+    evictOldEntries();
+    return true;
+}
+
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <optional>
+#include <QFile>
+#include <QImage>
+#include "TextureCompressor.hpp"
+
+// A tiled multi-resolution pyramid (mip chain) of an image, memory-mapped
+// from a cache file. Nothing is read from disk until a tile is accessed, so
+// opening a cached panorama costs only the page faults for the tiles that
+// actually get uploaded.
+class ImagePyramid
+{
+public:
+    enum class PixelFormat : quint32
+    {
+        Gray8 = 1,
+        RGB8,
+        RGBA8,
+        BC1,       // TextureCompressor::Format::BC1
+        ETC2_RGB8, // TextureCompressor::Format::ETC2_RGB8
+    };
+    static constexpr int TILE_SIZE = 256;
+
+    int levelCount() const { return levels_.size(); }
+    QSize levelSize(int level) const { return levels_[level].size; }
+    PixelFormat format() const { return format_; }
+    // Format_Invalid for compressed pyramids
+    QImage::Format imageFormat() const;
+    std::optional<TextureCompressor::Format> compressedFormat() const;
+    int tilesX(int level) const { return (levels_[level].size.width() + TILE_SIZE - 1) / TILE_SIZE; }
+    int tilesY(int level) const { return (levels_[level].size.height() + TILE_SIZE - 1) / TILE_SIZE; }
+    // Pixels of the tile, TILE_SIZE per row, even if the tile is cut by the
+    // edge of the level. For compressed formats these are the blocks that
+    // cover the part of the tile inside the level, packed as described in
+    // TextureCompressor::compress().
+    const uchar* tile(int level, int tileX, int tileY) const;
+    // Size of the data of the tile, cut by the edge of the level
+    int tileDataSize(int level, int tileX, int tileY) const;
+    // Assembles the whole level into an image. Not available for compressed formats.
+    QImage levelImage(int level) const;
+    // Whether the source is a dual-fisheye frame rather than an equirectangular image
+    bool isDualFisheye() const { return dualFisheye_; }
+
+    static int bytesPerPixel(PixelFormat format);
+    static bool isCompressed(PixelFormat format) { return format == PixelFormat::BC1 || format == PixelFormat::ETC2_RGB8; }
+
+private:
+    friend class PyramidCacheReader;
+    struct Level
+    {
+        QSize size;
+        quint64 offset;
+    };
+    QFile file_;
+    const uchar* data_ = nullptr;
+    PixelFormat format_ = PixelFormat::RGBA8;
+    bool dualFisheye_ = false;
+    std::vector<Level> levels_;
+};
+
+namespace PyramidCache
+{
+
+// Returns the cached pyramid for the file at path, or nullptr if there's
+// none, or it's stale, or its base level is smaller than the source image
+// bounded to maxSize. If compression is set, it's the format the GPU can
+// sample, and entries that could be, but aren't, stored in this format are
+// treated as missing, so that the caller replaces them with compressed ones.
+// Without compression, compressed entries are treated as missing.
+std::shared_ptr<const ImagePyramid> load(const QString& path, int maxSize,
+                                         std::optional<TextureCompressor::Format> compression = std::nullopt);
+// Writes the mip chain to the cache, replacing any existing entry for the
+// file, and evicts the least recently used entries if the cache grows too big.
+// If compression is set and the levels are opaque, they are stored compressed.
+// dualFisheye is remembered as the layout of the source, see DualFisheye.
+bool store(const QString& path, const QSize& sourceSize, const std::vector<QImage>& levels,
+           bool dualFisheye, std::optional<TextureCompressor::Format> compression = std::nullopt);
+
+}
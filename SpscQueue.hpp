@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+#include <optional>
+
+// A bounded lock-free queue for one producer thread and one consumer thread.
+// The slots are allocated upfront, and a popped slot is reset, so that the
+// queue doesn't keep alive the data of the values that have passed through.
+template<typename T>
+class SpscQueue
+{
+public:
+    explicit SpscQueue(const size_t capacity) : slots_(capacity + 1) {}
+
+    // Producer side. Returns false, leaving value untouched, if the queue is full.
+    bool tryPush(T& value)
+    {
+        const auto tail = tail_.load(std::memory_order_relaxed);
+        const auto next = (tail + 1) % slots_.size();
+        if(next == head_.load(std::memory_order_acquire))
+            return false;
+        slots_[tail] = std::move(value);
+        tail_.store(next, std::memory_order_release);
+        return true;
+    }
+    // Consumer side
+    std::optional<T> tryPop()
+    {
+        const auto head = head_.load(std::memory_order_relaxed);
+        if(head == tail_.load(std::memory_order_acquire))
+            return std::nullopt;
+        std::optional<T> value(std::move(slots_[head]));
+        slots_[head] = T();
+        head_.store((head + 1) % slots_.size(), std::memory_order_release);
+        return value;
+    }
+    bool empty() const
+    {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+    }
+    size_t capacity() const { return slots_.size() - 1; }
+
+private:
+    std::vector<T> slots_;
+    // On separate cache lines, so that the threads don't invalidate each other's
+    alignas(64) std::atomic<size_t> head_{0}; // next slot to pop
+    alignas(64) std::atomic<size_t> tail_{0}; // next slot to push into
+};
@@ -0,0 +1,42 @@
+#include "StoppableFile.hpp"
+#include <algorithm>
+
+StoppableFile::StoppableFile(const QString& path, const std::atomic_bool*const mustStop)
+    : file_(path)
+    , mustStop_(mustStop)
+{
+}
+
+bool StoppableFile::open(const OpenMode mode)
+{
+    if(!file_.open(mode))
+    {
+        setErrorString(file_.errorString());
+        return false;
+    }
+    return QIODevice::open(mode);
+}
+
+void StoppableFile::close()
+{
+    QIODevice::close();
+    file_.close();
+}
+
+bool StoppableFile::seek(const qint64 pos)
+{
+    return QIODevice::seek(pos) && file_.seek(pos);
+}
+
+qint64 StoppableFile::readData(char*const data, const qint64 maxSize)
+{
+    if(mustStop_ && *mustStop_)
+    {
+        setErrorString(QObject::tr("Reading stopped"));
+        return -1;
+    }
+    const qint64 bytesRead = file_.read(data, std::min(maxSize, CHUNK_SIZE));
+    if(bytesRead < 0)
+        setErrorString(file_.errorString());
+    return bytesRead;
+}
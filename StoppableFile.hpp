@@ -0,0 +1,30 @@
+#pragma once
+
+#include <atomic>
+#include <QFile>
+#include <QIODevice>
+
+// A file that is read at most a chunk at a time, and fails to read once the
+// stop flag is set, so that a reader like QImageReader can stream from it
+// without holding the whole file and still be interrupted. A read from a
+// stalled file system still blocks until it returns.
+class StoppableFile : public QIODevice
+{
+public:
+    static constexpr qint64 CHUNK_SIZE = 64 << 10;
+
+    // A null mustStop means the reading is never stopped
+    StoppableFile(const QString& path, const std::atomic_bool* mustStop);
+    bool open(OpenMode mode) override;
+    void close() override;
+    qint64 size() const override { return file_.size(); }
+    bool seek(qint64 pos) override;
+
+protected:
+    qint64 readData(char* data, qint64 maxSize) override;
+    qint64 writeData(const char*, qint64) override { return -1; }
+
+private:
+    QFile file_;
+    const std::atomic_bool* mustStop_;
+};
@@ -0,0 +1,339 @@
+#include "TextureCompressor.hpp"
+#include <array>
+#include <limits>
+#include <cstdint>
+#include <algorithm>
+
+namespace TextureCompressor
+{
+
+namespace
+{
+
+using Color = std::array<int, 3>;
+using Block = std::array<Color, BLOCK_SIZE * BLOCK_SIZE>; // pixel (x,y) is at y*4+x
+
+Block fetchBlock(const QImage& image, const QRect& rect, const int blockX, const int blockY)
+{
+    const int channels = image.format() == QImage::Format_Grayscale8 ? 1 :
+                         image.format() == QImage::Format_RGB888 ? 3 : 4;
+    Block block;
+    for(int y = 0; y < BLOCK_SIZE; ++y)
+    {
+        const int row = std::min(blockY * BLOCK_SIZE + y, rect.height() - 1) + rect.top();
+        const uchar*const line = image.constScanLine(row);
+        for(int x = 0; x < BLOCK_SIZE; ++x)
+        {
+            const int col = std::min(blockX * BLOCK_SIZE + x, rect.width() - 1) + rect.left();
+            const uchar*const pixel = line + col * channels;
+            auto& color = block[y * BLOCK_SIZE + x];
+            if(channels == 1)
+                color = {pixel[0], pixel[0], pixel[0]};
+            else
+                color = {pixel[0], pixel[1], pixel[2]};
+        }
+    }
+    return block;
+}
+
+int distance2(const Color& a, const Color& b)
+{
+    int sum = 0;
+    for(int c = 0; c < 3; ++c)
+        sum += (a[c] - b[c]) * (a[c] - b[c]);
+    return sum;
+}
+
+// ---------------------------------- BC1 ----------------------------------
+
+uint16_t packRGB565(const Color& c)
+{
+    return (c[0] * 31 + 127) / 255 << 11 |
+           (c[1] * 63 + 127) / 255 << 5 |
+           (c[2] * 31 + 127) / 255;
+}
+
+Color unpackRGB565(const uint16_t v)
+{
+    const int r = v >> 11 & 31, g = v >> 5 & 63, b = v & 31;
+    return {r << 3 | r >> 2, g << 2 | g >> 4, b << 3 | b >> 2};
+}
+
+void compressBlockBC1(const Block& block, uchar*const out)
+{
+    // Range fit: endpoints at the corners of the bounding box, inset a bit
+    // to reduce the error of the colors near the ends.
+    Color min{255, 255, 255}, max{0, 0, 0};
+    for(const auto& color : block)
+    {
+        for(int c = 0; c < 3; ++c)
+        {
+            min[c] = std::min(min[c], color[c]);
+            max[c] = std::max(max[c], color[c]);
+        }
+    }
+    // Along the diagonal that correlates with the data the best
+    int covGR = 0, covBR = 0;
+    Color mean{};
+    for(const auto& color : block)
+        for(int c = 0; c < 3; ++c)
+            mean[c] += color[c];
+    for(int c = 0; c < 3; ++c)
+        mean[c] /= 16;
+    for(const auto& color : block)
+    {
+        covGR += (color[1] - mean[1]) * (color[0] - mean[0]);
+        covBR += (color[2] - mean[2]) * (color[0] - mean[0]);
+    }
+    if(covGR < 0) std::swap(min[1], max[1]);
+    if(covBR < 0) std::swap(min[2], max[2]);
+    for(int c = 0; c < 3; ++c)
+    {
+        const int inset = (max[c] - min[c]) / 16;
+        max[c] -= inset;
+        min[c] += inset;
+    }
+
+    uint16_t color0 = packRGB565(max), color1 = packRGB565(min);
+    if(color0 < color1)
+        std::swap(color0, color1);
+    uint32_t indices = 0;
+    if(color0 != color1)
+    {
+        // color0 > color1 selects the four-color mode
+        const Color c0 = unpackRGB565(color0), c1 = unpackRGB565(color1);
+        std::array<Color, 4> palette{c0, c1, Color{}, Color{}};
+        for(int c = 0; c < 3; ++c)
+        {
+            palette[2][c] = (2 * c0[c] + c1[c]) / 3;
+            palette[3][c] = (c0[c] + 2 * c1[c]) / 3;
+        }
+        for(int n = 0; n < 16; ++n)
+        {
+            int best = 0, bestError = std::numeric_limits<int>::max();
+            for(int i = 0; i < 4; ++i)
+            {
+                const int error = distance2(block[n], palette[i]);
+                if(error < bestError)
+                {
+                    best = i;
+                    bestError = error;
+                }
+            }
+            indices |= uint32_t(best) << (2 * n);
+        }
+    }
+    out[0] = color0 & 0xff;
+    out[1] = color0 >> 8;
+    out[2] = color1 & 0xff;
+    out[3] = color1 >> 8;
+    for(int n = 0; n < 4; ++n)
+        out[4 + n] = indices >> (8 * n) & 0xff;
+}
+
+// ---------------------------------- ETC ----------------------------------
+// We only use the individual and differential modes of ETC1, which are a
+// subset of ETC2 RGB8, making sure differential mode never overflows into
+// the ETC2-specific T, H and planar modes.
+
+constexpr int ETC_MODIFIERS[8][2] =
+{
+    { 2,   8}, { 5,  17}, { 9,  29}, {13,  42},
+    {18,  60}, {24,  80}, {33, 106}, {47, 183},
+};
+
+// Pixel index values as stored in the block, in the order of the modifiers:
+// +small, +large, -small, -large
+constexpr int ETC_INDEX_CODES[4] = {0, 1, 2, 3};
+
+struct SubBlockFit
+{
+    int table;
+    int error;
+    std::array<int, 8> codes;
+};
+
+SubBlockFit fitSubBlock(const std::array<Color, 8>& pixels, const Color& base)
+{
+    SubBlockFit best{0, std::numeric_limits<int>::max(), {}};
+    for(int table = 0; table < 8; ++table)
+    {
+        SubBlockFit fit{table, 0, {}};
+        const int modifiers[4] = {ETC_MODIFIERS[table][0], ETC_MODIFIERS[table][1],
+                                  -ETC_MODIFIERS[table][0], -ETC_MODIFIERS[table][1]};
+        for(int n = 0; n < 8; ++n)
+        {
+            int bestError = std::numeric_limits<int>::max();
+            for(int i = 0; i < 4; ++i)
+            {
+                Color candidate;
+                for(int c = 0; c < 3; ++c)
+                    candidate[c] = std::clamp(base[c] + modifiers[i], 0, 255);
+                const int error = distance2(pixels[n], candidate);
+                if(error < bestError)
+                {
+                    bestError = error;
+                    fit.codes[n] = ETC_INDEX_CODES[i];
+                }
+            }
+            fit.error += bestError;
+            if(fit.error >= best.error) break;
+        }
+        if(fit.error < best.error)
+            best = fit;
+    }
+    return best;
+}
+
+// Coordinates of the pixels of sub-block 0 or 1, for the flip bit
+std::array<std::array<int, 2>, 8> subBlockPixels(const bool flip, const int subBlock)
+{
+    std::array<std::array<int, 2>, 8> coords;
+    int n = 0;
+    for(int y = 0; y < 4; ++y)
+    {
+        for(int x = 0; x < 4; ++x)
+        {
+            const int which = flip ? y / 2 : x / 2;
+            if(which == subBlock)
+                coords[n++] = {x, y};
+        }
+    }
+    return coords;
+}
+
+struct EtcCandidate
+{
+    uint64_t bits;
+    int error;
+};
+
+EtcCandidate encodeEtc(const Block& block, const bool flip, const bool differential)
+{
+    std::array<Color, 8> pixels[2];
+    Color averages[2];
+    for(int s = 0; s < 2; ++s)
+    {
+        const auto coords = subBlockPixels(flip, s);
+        Color sum{};
+        for(int n = 0; n < 8; ++n)
+        {
+            pixels[s][n] = block[coords[n][1] * 4 + coords[n][0]];
+            for(int c = 0; c < 3; ++c)
+                sum[c] += pixels[s][n][c];
+        }
+        for(int c = 0; c < 3; ++c)
+            averages[s][c] = (sum[c] + 4) / 8;
+    }
+
+    Color quantized[2], bases[2];
+    if(differential)
+    {
+        for(int s = 0; s < 2; ++s)
+            for(int c = 0; c < 3; ++c)
+                quantized[s][c] = (averages[s][c] * 31 + 127) / 255;
+        for(int c = 0; c < 3; ++c)
+        {
+            const int delta = quantized[1][c] - quantized[0][c];
+            if(delta < -4 || delta > 3)
+                return {0, std::numeric_limits<int>::max()};
+        }
+        for(int s = 0; s < 2; ++s)
+            for(int c = 0; c < 3; ++c)
+                bases[s][c] = quantized[s][c] << 3 | quantized[s][c] >> 2;
+    }
+    else
+    {
+        for(int s = 0; s < 2; ++s)
+        {
+            for(int c = 0; c < 3; ++c)
+            {
+                quantized[s][c] = (averages[s][c] * 15 + 127) / 255;
+                bases[s][c] = quantized[s][c] << 4 | quantized[s][c];
+            }
+        }
+    }
+
+    const SubBlockFit fits[2] = {fitSubBlock(pixels[0], bases[0]), fitSubBlock(pixels[1], bases[1])};
+
+    uint64_t bits = 0;
+    if(differential)
+    {
+        for(int c = 0; c < 3; ++c)
+        {
+            const int delta = quantized[1][c] - quantized[0][c];
+            bits |= uint64_t(quantized[0][c]) << (59 - 8 * c);
+            bits |= uint64_t(delta & 7) << (56 - 8 * c);
+        }
+    }
+    else
+    {
+        for(int c = 0; c < 3; ++c)
+        {
+            bits |= uint64_t(quantized[0][c]) << (60 - 8 * c);
+            bits |= uint64_t(quantized[1][c]) << (56 - 8 * c);
+        }
+    }
+    bits |= uint64_t(fits[0].table) << 37;
+    bits |= uint64_t(fits[1].table) << 34;
+    bits |= uint64_t(differential) << 33;
+    bits |= uint64_t(flip) << 32;
+    for(int s = 0; s < 2; ++s)
+    {
+        const auto coords = subBlockPixels(flip, s);
+        for(int n = 0; n < 8; ++n)
+        {
+            // Pixels are numbered in column-major order
+            const int bit = coords[n][0] * 4 + coords[n][1];
+            const int code = fits[s].codes[n];
+            bits |= uint64_t(code >> 1) << (16 + bit);
+            bits |= uint64_t(code & 1) << bit;
+        }
+    }
+    return {bits, fits[0].error + fits[1].error};
+}
+
+void compressBlockETC(const Block& block, uchar*const out)
+{
+    EtcCandidate best{0, std::numeric_limits<int>::max()};
+    for(const bool flip : {false, true})
+    {
+        for(const bool differential : {true, false})
+        {
+            const auto candidate = encodeEtc(block, flip, differential);
+            if(candidate.error < best.error)
+                best = candidate;
+        }
+    }
+    for(int n = 0; n < 8; ++n)
+        out[n] = best.bits >> (56 - 8 * n) & 0xff;
+}
+
+}
+
+bool canCompress(const QImage::Format format)
+{
+    return format == QImage::Format_Grayscale8 ||
+           format == QImage::Format_RGB888 ||
+           format == QImage::Format_RGBX8888;
+}
+
+void compress(const Format format, const QImage& image, const QRect& rect, uchar* out)
+{
+    const int blocksX = (rect.width() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    const int blocksY = (rect.height() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for(int blockY = 0; blockY < blocksY; ++blockY)
+    {
+        for(int blockX = 0; blockX < blocksX; ++blockX)
+        {
+            const auto block = fetchBlock(image, rect, blockX, blockY);
+            if(format == Format::BC1)
+                compressBlockBC1(block, out);
+            else
+                compressBlockETC(block, out);
+            out += BYTES_PER_BLOCK;
+        }
+    }
+}
+
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <QRect>
+#include <QImage>
+
+// CPU encoders for the block-compressed texture formats we upload opaque
+// panoramas in: S3TC/BC1 on desktop GPUs, ETC2 RGB8 on GLES 3.0. Both store
+// a 4×4 block of pixels in 8 bytes.
+namespace TextureCompressor
+{
+
+enum class Format
+{
+    BC1,
+    ETC2_RGB8,
+};
+
+constexpr int BLOCK_SIZE = 4;
+constexpr int BYTES_PER_BLOCK = 8;
+
+inline int compressedSize(const QSize& size)
+{
+    return (size.width() + BLOCK_SIZE - 1) / BLOCK_SIZE *
+           ((size.height() + BLOCK_SIZE - 1) / BLOCK_SIZE) * BYTES_PER_BLOCK;
+}
+
+// Whether the pixels of the image format can be compressed without losing
+// information other than by the encoding itself, i.e. the format is opaque
+// and is one of Grayscale8, RGB888, RGBX8888.
+bool canCompress(QImage::Format format);
+
+// Compresses the rect of the image into out, which must have room for
+// compressedSize(rect.size()) bytes. Blocks go in row-major order, with
+// as many blocks per row as needed to cover rect.width(). Pixels of partial
+// blocks at the right and bottom edges are replicated from the edge.
+void compress(Format format, const QImage& image, const QRect& rect, uchar* out);
+
+}
@@ -1,12 +1,23 @@
 #include "Utils.hpp"
+#include <atomic>
+#include <algorithm>
+#include <QDebug>
 #include <QtGlobal>
 #include <QPalette>
+#include <QSemaphore>
+#include <QThreadPool>
 #include <QStyleHints>
+#include <QElapsedTimer>
 #include <QGuiApplication>
 #ifdef Q_OS_ANDROID
 #include <QJniObject>
 #endif
 
+namespace
+{
+std::atomic_bool startupDone{false};
+}
+
 namespace Utils
 {
 
@@ -38,4 +49,49 @@ bool isDarkMode()
 #endif // Q_OS_ANDROID
 }
 
+void parallelFor(const int count, const std::function<void(int)>& func)
+{
+    std::atomic_int next{0};
+    const auto work = [&]
+    {
+        for(int n = next++; n < count; n = next++)
+            func(n);
+    };
+
+    // The calling thread takes part in the work too, so we only ask the pool
+    // for maxThreadCount-1 helpers. The helpers are started with tryStart(),
+    // so that we never wait for a task that sits in the queue behind busy
+    // threads (which might be the ones waiting for us).
+    const auto pool = QThreadPool::globalInstance();
+    const int helpersWanted = std::min(count, pool->maxThreadCount()) - 1;
+    QSemaphore helpersDone;
+    int helpersStarted = 0;
+    for(int n = 0; n < helpersWanted; ++n)
+    {
+        if(!pool->tryStart([&]{ work(); helpersDone.release(); }))
+            break;
+        ++helpersStarted;
+    }
+    work();
+    helpersDone.acquire(helpersStarted);
+}
+
+void startupEvent(const char*const what)
+{
+    static const auto timer = []
+    {
+        QElapsedTimer timer;
+        timer.start();
+        return timer;
+    }();
+    if(startupDone) return;
+    qDebug().noquote().nospace() << "Startup +" << timer.elapsed() << " ms: " << what;
+}
+
+void startupFinished(const char*const what)
+{
+    startupEvent(what);
+    startupDone = true;
+}
+
 }
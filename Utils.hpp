@@ -1,8 +1,21 @@
 #pragma once
 
+#include <functional>
+
 namespace Utils
 {
 
 bool isDarkMode();
 
+// Calls func(n) for each n in [0, count), distributing the calls between the
+// calling thread and idle threads of the global thread pool. Returns when all
+// the calls have finished.
+void parallelFor(int count, const std::function<void(int)>& func);
+
+// Startup timeline: logs the time since the first call for each event, until
+// startupFinished() is called when the first panorama is on the screen.
+// Thread-safe.
+void startupEvent(const char* what);
+void startupFinished(const char* what);
+
 }
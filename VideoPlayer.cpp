@@ -0,0 +1,115 @@
+#include "VideoPlayer.hpp"
+#include <QUrl>
+#include <QDebug>
+#include <QFileInfo>
+#include <QVideoSink>
+#include <QAudioOutput>
+#include <QMediaPlayer>
+
+namespace
+{
+
+// Each 8K frame takes about 50 MB
+constexpr size_t FRAME_BUFFER_CAPACITY = 4;
+// A jump back in media time by more than this means a loop or a seek
+constexpr qint64 TIME_JUMP = 500'000; // µs
+// Averaging factor for the timing measurements
+constexpr double TIMING_SMOOTHING = 0.05;
+constexpr qint64 REPORT_PERIOD = 10'000'000; // µs
+
+}
+
+VideoPlayer::VideoPlayer(const QString& path, QObject* parent)
+    : QObject(parent)
+    , player_(new QMediaPlayer(this))
+    , sink_(new QVideoSink(this))
+    , frames_(FRAME_BUFFER_CAPACITY)
+{
+    clock_.start();
+    // The sink may deliver frames from the decoding thread, then they go
+    // right into the buffer without an event per frame for the GUI thread
+    connect(sink_, &QVideoSink::videoFrameChanged, this, &VideoPlayer::handleFrame, Qt::DirectConnection);
+    connect(player_, &QMediaPlayer::errorOccurred, this, [this](QMediaPlayer::Error, const QString& message)
+            { emit error(message); });
+    player_->setVideoSink(sink_);
+    player_->setAudioOutput(new QAudioOutput(this));
+    player_->setLoops(QMediaPlayer::Infinite);
+    player_->setSource(QUrl::fromLocalFile(path));
+    player_->play();
+}
+
+VideoPlayer::~VideoPlayer()
+{
+    player_->stop();
+    player_->setVideoSink(nullptr);
+}
+
+bool VideoPlayer::isVideoFile(const QString& path)
+{
+    const auto suffix = QFileInfo(path).suffix().toLower();
+    return suffix == "mp4" || suffix == "mov" || suffix == "mkv" ||
+           suffix == "webm" || suffix == "m4v" || suffix == "avi";
+}
+
+void VideoPlayer::handleFrame(const QVideoFrame& frame)
+{
+    if(!frame.isValid()) return;
+    DecodedFrame decoded{frame, now()};
+    if(!frames_.tryPush(decoded))
+    {
+        // Rendering has stalled, the buffered frames will be late anyway
+        ++overflowDrops_;
+        return;
+    }
+    emit frameAvailable();
+}
+
+std::optional<QVideoFrame> VideoPlayer::takeDueFrame()
+{
+    const auto time = now();
+    std::optional<QVideoFrame> due;
+    for(;;)
+    {
+        if(!nextFrame_)
+        {
+            nextFrame_ = frames_.tryPop();
+            if(!nextFrame_) break;
+
+            const qint64 startTime = nextFrame_->frame.startTime();
+            if(startTime >= 0)
+            {
+                if(!clockOffset_ || startTime < lastStartTime_ - TIME_JUMP)
+                    clockOffset_ = startTime - nextFrame_->arrivalTime;
+                lastStartTime_ = startTime;
+                const double lead = (startTime - *clockOffset_ - nextFrame_->arrivalTime) / 1000.;
+                stats_.arrivalLead += TIMING_SMOOTHING * (lead - stats_.arrivalLead);
+            }
+        }
+        const qint64 startTime = nextFrame_->frame.startTime();
+        if(startTime >= 0 && clockOffset_ && startTime - *clockOffset_ > time)
+            break;
+        if(due)
+            ++stats_.droppedFrames;
+        due = std::move(nextFrame_->frame);
+        nextFrame_.reset();
+    }
+    if(due)
+        ++stats_.shownFrames;
+
+    if(time - lastReport_ > REPORT_PERIOD)
+    {
+        stats_.droppedFrames += overflowDrops_.exchange(0);
+        qDebug().nospace() << "Video: " << stats_.shownFrames << " frames shown, " << stats_.droppedFrames
+                           << " dropped, frames arrive " << stats_.arrivalLead << " ms before due, upload takes "
+                           << stats_.uploadTime << " ms";
+        lastReport_ = time;
+    }
+    return due;
+}
+
+void VideoPlayer::reportUploadTime(const double ms)
+{
+    if(stats_.uploadTime == 0)
+        stats_.uploadTime = ms;
+    stats_.uploadTime += TIMING_SMOOTHING * (ms - stats_.uploadTime);
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <optional>
+#include <QObject>
+#include <QVideoFrame>
+#include <QElapsedTimer>
+#include "SpscQueue.hpp"
+
+class QVideoSink;
+class QMediaPlayer;
+// Plays an equirectangular video. Decoded frames wait in a small ring buffer
+// until Canvas takes the one that is due at a repaint; the frames that are
+// already late by then are dropped, so the video keeps up with the display
+// clock even when rendering can't keep up with the frame rate.
+class VideoPlayer : public QObject
+{
+    Q_OBJECT
+
+public:
+    struct Stats
+    {
+        int shownFrames = 0;
+        int droppedFrames = 0; // decoded but never shown
+        double arrivalLead = 0; // ms, how long before being due the frames arrive
+        double uploadTime = 0;  // ms, upload and conversion of a frame by Canvas
+    };
+
+    explicit VideoPlayer(const QString& path, QObject* parent = nullptr);
+    ~VideoPlayer();
+    // The newest frame that is due by now, if there's one that hasn't been
+    // taken yet. To be called from the GUI thread.
+    std::optional<QVideoFrame> takeDueFrame();
+    void reportUploadTime(double ms);
+    Stats stats() const { return stats_; }
+
+    static bool isVideoFile(const QString& path);
+
+signals:
+    // A new frame is in the buffer. May be emitted from the decoding thread.
+    void frameAvailable();
+    void error(const QString& message);
+
+private:
+    void handleFrame(const QVideoFrame& frame);
+    qint64 now() const { return clock_.nsecsElapsed() / 1000; }
+
+    struct DecodedFrame
+    {
+        QVideoFrame frame;
+        qint64 arrivalTime = 0; // µs, our clock
+    };
+    QMediaPlayer* player_ = nullptr;
+    QVideoSink* sink_ = nullptr;
+    QElapsedTimer clock_;
+    SpscQueue<DecodedFrame> frames_;
+    // Taken from the queue, but not due yet
+    std::optional<DecodedFrame> nextFrame_;
+    std::atomic_int overflowDrops_{0};
+    // Media time minus our clock, µs. Reset when the video loops or seeks.
+    std::optional<qint64> clockOffset_;
+    qint64 lastStartTime_ = 0;
+    Stats stats_;
+    qint64 lastReport_ = 0;
+};
@@ -0,0 +1,64 @@
+#include "VrLens.hpp"
+#include <QFileInfo>
+#include <QSettings>
+#include <QStandardPaths>
+
+namespace
+{
+
+// Cells along each side of the mesh. The view directions are interpolated
+// linearly inside the cells, which is indistinguishable at this density.
+constexpr int MESH_CELLS = 48;
+
+}
+
+namespace VrLens
+{
+
+Parameters parameters()
+{
+    Parameters parameters{0.34, 0.55, 1.0};
+    const auto path = QStandardPaths::writableLocation(QStandardPaths::AppConfigLocation) + "/vr.ini";
+    if(!QFileInfo::exists(path))
+        return parameters;
+
+    QSettings settings(path, QSettings::IniFormat);
+    parameters.k1 = settings.value("k1", parameters.k1).toDouble();
+    parameters.k2 = settings.value("k2", parameters.k2).toDouble();
+    parameters.screenTangent = settings.value("screenTangent", parameters.screenTangent).toDouble();
+    return parameters;
+}
+
+Mesh buildMesh(const Parameters& parameters, const double eyeAspectRatio)
+{
+    constexpr int N = MESH_CELLS + 1;
+    Mesh mesh;
+    mesh.vertices.reserve(N * N * MESH_COMPONENTS_PER_VERTEX);
+    for(int j = 0; j < N; ++j)
+    {
+        for(int i = 0; i < N; ++i)
+        {
+            const double x = 2. * i / MESH_CELLS - 1;
+            const double y = 2. * j / MESH_CELLS - 1;
+            // Tangent-space position on the screen, as seen without the lens
+            const double sx = x * parameters.screenTangent;
+            const double sy = y * parameters.screenTangent / eyeAspectRatio;
+            const double r2 = sx * sx + sy * sy;
+            const double scale = 1 + parameters.k1 * r2 + parameters.k2 * r2 * r2;
+            mesh.vertices.insert(mesh.vertices.end(), {float(x), float(y), float(sx * scale), float(sy * scale)});
+        }
+    }
+    mesh.indices.reserve(MESH_CELLS * MESH_CELLS * 6);
+    for(int j = 0; j < MESH_CELLS; ++j)
+    {
+        for(int i = 0; i < MESH_CELLS; ++i)
+        {
+            const quint16 v = j * N + i;
+            mesh.indices.insert(mesh.indices.end(), {v, quint16(v + 1), quint16(v + N),
+                                                     quint16(v + 1), quint16(v + N + 1), quint16(v + N)});
+        }
+    }
+    return mesh;
+}
+
+}
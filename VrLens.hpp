@@ -0,0 +1,39 @@
+#pragma once
+
+#include <vector>
+#include <QtGlobal>
+
+// Lenses of phone-based headsets, like Cardboard. A lens makes a point of
+// the screen at tangent-space radius r (relative to the lens axis) appear
+// at radius r·(1 + k1·r² + k2·r⁴). Canvas draws each eye through a mesh that
+// has this precomputed in its vertices, so that no distortion math is done
+// per pixel.
+namespace VrLens
+{
+
+struct Parameters
+{
+    double k1;
+    double k2;
+    // Tangent of the half-angle the eye's half of the screen subtends
+    // horizontally without the lens
+    double screenTangent;
+};
+
+// Typical Cardboard values, with the ones found in vr.ini in the config
+// location of the app taking priority
+Parameters parameters();
+
+struct Mesh
+{
+    // Per vertex: position in the eye's viewport in [-1,1]², then the
+    // tangents of the horizontal and vertical view angles seen there
+    std::vector<float> vertices;
+    std::vector<quint16> indices;
+};
+constexpr int MESH_COMPONENTS_PER_VERTEX = 4;
+
+// A grid over the viewport of one eye, whose width/height is eyeAspectRatio
+Mesh buildMesh(const Parameters& parameters, double eyeAspectRatio);
+
+}
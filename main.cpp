@@ -1,9 +1,15 @@
 #include <stdlib.h>
 #include <iostream>
+#include <string_view>
 #include <QScreen>
 #include <QApplication>
 #include "Utils.hpp"
+#include "Canvas.hpp"
 #include "MainWin.hpp"
+#include "InputTrace.hpp"
+#include "MemoryBudget.hpp"
+#include "Downscaler.hpp"
+#include "CpuRenderer.hpp"
 
 namespace
 {
@@ -29,13 +35,36 @@ QLabel {
 
 int main(int argc, char** argv)
 {
+    // Only formats without a streaming decoder are read by Qt as a whole
     setenv("QT_IMAGEIO_MAXALLOC", "4096", false);
+    // Replays and comparisons are meant to run headless
+    if(argc > 1 && (std::string_view(argv[1]) == "--replay-trace" ||
+                    std::string_view(argv[1]) == "--compare-cpu-renderer"))
+        setenv("QT_QPA_PLATFORM", "offscreen", false);
+    Utils::startupEvent("Entered main()");
+    Canvas::shareGLContexts();
     QApplication app(argc, argv);
+    Utils::startupEvent("QApplication created");
     const auto args = app.arguments();
     QString filePath;
-    if(args.size() == 2)
-        filePath = args[1];
-    else if(args.size() != 1)
+    if(args.size() == 3 && args[1] == "--benchmark-cpu-renderer")
+        return CpuRenderer::benchmark(args[2]) ? 0 : 1;
+    if(args.size() == 2 && args[1] == "--check-downscaler")
+        return checkDownscaler() ? 0 : 1;
+    if(args.size() == 3 && args[1] == "--compare-cpu-renderer")
+        return CpuRenderer::compareWithGpu(args[2]) ? 0 : 1;
+    if((args.size() == 4 || args.size() == 5) && args[1] == "--replay-trace")
+        return InputTrace::replay(args[2], args[3], args.size() == 5 && args[4] == "--hashes") ? 0 : 1;
+    auto fileArgs = args.mid(1);
+    QString tracePath;
+    if(fileArgs.size() >= 2 && fileArgs[0] == "--record-trace")
+    {
+        tracePath = fileArgs[1];
+        fileArgs = fileArgs.mid(2);
+    }
+    if(fileArgs.size() == 1)
+        filePath = fileArgs[0];
+    else if(!fileArgs.isEmpty())
         std::cerr << "Bad number of arguments, ignoring all\n";
 
 #ifdef Q_OS_ANDROID
@@ -59,11 +88,16 @@ QListView, QMainWindow
     }
 #endif
     app.setStyleSheet(uiCSS);
+    // Created here, so that it polls from the GUI thread
+    MemoryBudget::instance();
     MainWin mainWin(u8"4π View", filePath);
+    if(!tracePath.isEmpty())
+        new InputTrace::Recorder(mainWin.canvas(), tracePath);
 
     const auto size = app.primaryScreen()->size().height();
     mainWin.resize(size, 0.7 * size);
     mainWin.show();
+    Utils::startupEvent("Main window shown");
 
     return app.exec();
 }